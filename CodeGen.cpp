@@ -7,14 +7,29 @@
 
 #include "CodeGen.hpp"
 
-Command::Command(Instruction instruction_)
-        : instruction(instruction_), arg(0)
+Command::Command(Instruction instruction_, int line_)
+        : instruction(instruction_), arg(0), line(line_)
 {}
 
-Command::Command(Instruction instruction_, int arg_)
-        : instruction(instruction_), arg(arg_)
+Command::Command(Instruction instruction_, int arg_, int line_)
+        : instruction(instruction_), arg(arg_), line(line_)
 {}
 
+int Command::getLine() const
+{
+    return line;
+}
+
+Instruction Command::getInstruction() const
+{
+    return instruction;
+}
+
+int Command::getArg() const
+{
+    return arg;
+}
+
 void Command::print(int address, std::ostream & output)
 {
     output << address << ":\t";
@@ -121,31 +136,42 @@ void Command::print(int address, std::ostream & output)
         }
     }
 
+    if (line > 0) {
+        output << "\t; line " << line;
+    }
+
     output << std::endl;
 }
 
 CodeGen::CodeGen(std::ostream & output_)
-        : output(output_)
+        : output(output_), currentLine(0)
 {}
 
 void CodeGen::emit(Instruction instruction)
 {
-    commandBuffer.push_back(Command(instruction));
+    commandBuffer.push_back(Command(instruction, currentLine));
 }
 
 void CodeGen::emit(Instruction instruction, int arg)
 {
-    commandBuffer.push_back(Command(instruction, arg));
+    commandBuffer.push_back(Command(instruction, arg, currentLine));
 }
 
 void CodeGen::emitAt(int address, Instruction instruction)
 {
-    commandBuffer.at((unsigned int) address) = Command(instruction);
+    Command & command = commandBuffer.at((unsigned int) address);
+    command = Command(instruction, command.getLine());
 }
 
 void CodeGen::emitAt(int address, Instruction instruction, int arg)
 {
-    commandBuffer.at((unsigned int) address) = Command(instruction, arg);
+    Command & command = commandBuffer.at((unsigned int) address);
+    command = Command(instruction, arg, command.getLine());
+}
+
+void CodeGen::setLine(int line)
+{
+    currentLine = line;
 }
 
 int CodeGen::getCurrentAddress()
@@ -167,3 +193,8 @@ void CodeGen::flush()
     }
     output.flush();
 }
+
+const std::vector<Command> & CodeGen::getCommands() const
+{
+    return commandBuffer;
+}
@@ -42,12 +42,21 @@ class Command
 
     public:
 
-        Command(Instruction instruction_);
+        Command(Instruction instruction_, int line_);
         /* Instruction with argument */
-        Command(Instruction instruction_, int arg_);
+        Command(Instruction instruction_, int arg_, int line_);
 
+        /* Prints instruction and its source line as comment
+           ('; line N', skipped by VM) */
         void print(int address, std::ostream & output);
 
+        int getLine() const;
+
+        Instruction getInstruction() const;
+
+        /* Argument (0 for instruction without argument) */
+        int getArg() const;
+
     private:
 
         /* Instruction code */
@@ -55,6 +64,9 @@ class Command
 
         /* Argument for instruction */
         int arg;
+
+        /* Source line of statement which generated instruction (0 - unknown) */
+        int line;
 };
 
 class CodeGen
@@ -76,6 +88,10 @@ class CodeGen
         /* Instruction with argument addition to concrete address */
         void emitAt(int address, Instruction instruction, int arg);
 
+        /* Source line for next emitted instructions (line table);
+           instructions placed by emitAt() keep line of reserved one */
+        void setLine(int line);
+
         /* Get address next to the last instruction */
         int getCurrentAddress();
 
@@ -86,11 +102,16 @@ class CodeGen
         /* Output of instructions sequence */
         void flush();
 
+        /* Generated instructions, address is index */
+        const std::vector<Command> & getCommands() const;
+
     private:
 
         std::ostream & output;
         std::vector<Command> commandBuffer;
 
+        int currentLine;
+
 };
 
 #endif //MILANCOMPILER_CODEGEN_HPP
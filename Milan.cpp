@@ -0,0 +1,92 @@
+//
+// Embeddable Milan: compilation and execution in the same process
+//
+
+#include "Milan.hpp"
+#include "Parser.hpp"
+
+#include <new>
+#include <sstream>
+#include <vector>
+
+/* VM header is not included here: its NOP, STOP, ... clash with
+   enum Instruction, so commands are passed to VM as plain numbers */
+#include "vm/vm/vm_milan.h"
+
+MilanProgram::MilanProgram()
+        : loaded(vm_milan_create()), context(vm_milan_create()),
+          engine(0), compiled(false)
+{
+    if (loaded == 0 || context == 0) {
+        vm_milan_destroy(context);
+        vm_milan_destroy(loaded);
+        throw std::bad_alloc();
+    }
+    vm_milan_engine("switch", &engine);
+}
+
+MilanProgram::~MilanProgram()
+{
+    // context uses command memory of loaded
+    vm_milan_destroy(context);
+    vm_milan_destroy(loaded);
+}
+
+bool MilanProgram::compile(const std::string & source, std::ostream & errors)
+{
+    std::istringstream input(source);
+    std::ostringstream messages;
+    Parser parser(input, messages, messages);
+
+    compiled = false;
+    if (!parser.compile()) {
+        error = messages.str();
+        errors << error;
+        return false;
+    }
+
+    const std::vector<Command> & commands = parser.getCommands();
+    std::vector<milan_command> program(commands.size());
+    for (unsigned int address = 0; address < commands.size(); ++address) {
+        program[address].op = commands[address].getInstruction();
+        program[address].arg = commands[address].getArg();
+    }
+
+    if (!vm_milan_load(loaded, program.empty() ? 0 : &program[0], program.size())) {
+        error = "Program is too long";
+        errors << error << std::endl;
+        return false;
+    }
+
+    error.clear();
+    compiled = true;
+    return true;
+}
+
+bool MilanProgram::setEngine(const std::string & name)
+{
+    return vm_milan_engine(name.c_str(), &engine) != 0;
+}
+
+bool MilanProgram::run(InputCallback input, OutputCallback output, void * data)
+{
+    if (!compiled) {
+        error = "Program is not compiled";
+        return false;
+    }
+
+    if (vm_milan_run(context, loaded, engine, input, output, data)) {
+        error.clear();
+        return true;
+    }
+
+    char text[256];
+    vm_milan_error(context, text, sizeof(text));
+    error = text;
+    return false;
+}
+
+const std::string & MilanProgram::getError() const
+{
+    return error;
+}
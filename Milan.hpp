@@ -0,0 +1,64 @@
+//
+// Embeddable Milan: compilation and execution in the same process
+//
+
+#ifndef MILANCOMPILER_MILAN_HPP
+#define MILANCOMPILER_MILAN_HPP
+
+
+#include <iostream>
+#include <string>
+
+struct vm_context; // vm/vm/vm_milan.h
+
+class MilanProgram
+{
+
+    public:
+
+        /* Reads value for INPUT instruction;
+           @return: 1 if value was read, 0 on error (BAD_INPUT) */
+        typedef int (*InputCallback)(void * data, int * value);
+
+        /* Writes value of PRINT instruction */
+        typedef void (*OutputCallback)(void * data, int value);
+
+        MilanProgram();
+        ~MilanProgram();
+
+        /* Compiles Milan source text and loads generated instructions
+           into VM command memory (no text or files in between);
+           compilation errors are written to errors;
+           @return: true on success */
+        bool compile(const std::string & source, std::ostream & errors = std::cerr);
+
+        /* Chooses VM engine by name ("switch", "threaded", ...);
+           @return: false if there is no such engine */
+        bool setEngine(const std::string & name);
+
+        /* Runs compiled program from the beginning with cleared data memory;
+           INPUT and PRINT call input and output with data;
+           @return: true if program stopped without error */
+        bool run(InputCallback input, OutputCallback output, void * data);
+
+        /* Error of last compile() or run() ("" if there was no error) */
+        const std::string & getError() const;
+
+    private:
+
+        /* Not copyable: owns VM contexts */
+        MilanProgram(const MilanProgram &);
+        MilanProgram & operator=(const MilanProgram &);
+
+        /* Loaded program and its data memory right after loading */
+        vm_context * loaded;
+        /* Context running the program of loaded: its data memory
+           is copied from loaded before every run() */
+        vm_context * context;
+        int engine;
+        bool compiled;
+        std::string error;
+
+};
+
+#endif //MILANCOMPILER_MILAN_HPP
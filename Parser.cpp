@@ -9,25 +9,37 @@
 
 #include <sstream>
 
-Parser::Parser(std::istream & input_, std::ostream & output_)
-        : output(output_), error(false), recovered(true), lastVar(0),
-          codegen(output_), scanner(input_)
+Parser::Parser(std::istream & input_, std::ostream & output_,
+               std::ostream & errors_)
+        : output(output_), errors(errors_), error(false), recovered(true),
+          lastVar(0), codegen(output_), scanner(input_)
 {
     nextLexeme();
 }
 
 void Parser::parse()
 {
-    program();
-    if (!error) {
+    if (compile()) {
         codegen.flush(); // write to output
     }
 }
 
+bool Parser::compile()
+{
+    program();
+    return !error;
+}
+
+const std::vector<Command> & Parser::getCommands() const
+{
+    return codegen.getCommands();
+}
+
 void Parser::program()
 {
     matchLexemeSafe(T_BEGIN);
     statementList();
+    codegen.setLine(scanner.getLineNumber()); // STOP belongs to 'END'
     matchLexemeSafe(T_END);
     codegen.emit(STOP);
 }
@@ -44,6 +56,10 @@ void Parser::statementList()
 
 void Parser::statement()
 {
+    // Line table: instructions of statement belong to its first line
+    int line = scanner.getLineNumber();
+    codegen.setLine(line);
+
     if (checkLexeme(T_IDENTIFIER)) {
         std::string variable = scanner.getStringValue();
         if (variable.find(':') != std::string::npos) {
@@ -62,6 +78,7 @@ void Parser::statement()
         statementList();
 
         if (matchLexeme(T_ELSE)) {
+            codegen.setLine(line);
             int jumpAddress = codegen.reserve();
             // Start of else block (jump if false condition)
             codegen.emitAt(jumpNoAddress, JUMP_NO, codegen.getCurrentAddress());
@@ -81,6 +98,7 @@ void Parser::statement()
         matchLexemeSafe(T_DO);
         statementList();
         matchLexemeSafe(T_OD);
+        codegen.setLine(line);
         codegen.emit(JUMP, conditionAddress); // check condition
         codegen.emitAt(jumpNoAddress, JUMP_NO, codegen.getCurrentAddress()); // if false
     } else if (matchLexeme(T_WRITE)) {
@@ -261,7 +279,7 @@ void Parser::matchLexemeSafe(Token t)
 
 void Parser::reportError(const std::string & message)
 {
-    std::cerr << "Error at line "
+    errors << "Error at line "
               << scanner.getLineNumber()
               << ": " << message << std::endl;
     error = true;
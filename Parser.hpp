@@ -21,10 +21,20 @@ class Parser
 {
     public:
 
-        Parser(std::istream & input_, std::ostream & output_);
+        /* Error messages are written to errors_ */
+        Parser(std::istream & input_, std::ostream & output_,
+               std::ostream & errors_ = std::cerr);
 
+        /* Parses program and writes it to output if there were no errors */
         void parse();
 
+        /* Parses program without output;
+           @return: true if there were no errors */
+        bool compile();
+
+        /* Generated program (valid after successful compile()) */
+        const std::vector<Command> & getCommands() const;
+
     private:
 
         typedef std::map<std::string, int> VarTable;
@@ -76,6 +86,7 @@ class Parser
         CodeGen codegen;
 
         std::ostream & output;
+        std::ostream & errors;
 
         bool error;
         bool recovered;
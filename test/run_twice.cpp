@@ -0,0 +1,56 @@
+//
+// libmilan test: the same program run twice starts with cleared variables
+//
+
+#include "Milan.hpp"
+
+#include <cstdio>
+#include <vector>
+
+static const char source[] =
+    "BEGIN\n"
+    "    i := i + 1;\n"
+    "    WRITE(i)\n"
+    "END\n";
+
+static int noInput(void * data, int * value)
+{
+    return 0;
+}
+
+static void collect(void * data, int value)
+{
+    static_cast<std::vector<int> *>(data)->push_back(value);
+}
+
+int main()
+{
+    static const char * engines[] = {"switch", "threaded", "register", "jit", "verified", "cached", "packed"};
+    int failures = 0;
+
+    for (unsigned int i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i) {
+        MilanProgram program;
+
+        if (!program.setEngine(engines[i]) || !program.compile(source)) {
+            std::printf("%s: unable to compile\n", engines[i]);
+            ++failures;
+            continue;
+        }
+
+        for (int run = 1; run <= 2; ++run) {
+            std::vector<int> output;
+
+            if (!program.run(noInput, collect, &output)) {
+                std::printf("%s, run %d: %s\n", engines[i], run, program.getError().c_str());
+                ++failures;
+            } else if (output.size() != 1 || output[0] != 1) {
+                std::printf("%s, run %d: expected 1, got %d\n", engines[i], run,
+                            output.empty() ? 0 : output[0]);
+                ++failures;
+            }
+        }
+    }
+
+    std::printf(failures == 0 ? "OK\n" : "FAILED\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -1,46 +1,423 @@
-#include "vm.h"
-#include "vmparse.tab.h"
-#include <stdio.h>
-#include <stdlib.h>
-
-extern FILE *yyin;
-int need_close = 0;
-
-int yyparse();
-
-void milan_error(char const * msg)
-{
-        if(need_close)
-                fclose(yyin);
-        
-	fprintf(stderr, msg);
-	exit(1);
-}
-
-int main(int argc, char **argv)
-{
-        if(argc < 2) {
-                yyin = stdin;
-                printf("Reading input from stdin\n");
-        }
-        else {
-                yyin = fopen(argv[1], "rt");
-                if(!yyin) {
-                        printf("Unable to read %s\n", argv[1]);
-                        return 1;
-                }
-                
-                need_close = 1;
-                printf("Reading input from %s\n", argv[1]);
-        }
-        
-        if(0 == yyparse()) {
-                run();
-        }
-
-        if(need_close) {
-                fclose(yyin);
-        }
-                
-        return 0;
-}
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void milan_error(char const * msg)
+{
+	fprintf(stderr, msg);
+	exit(1);
+}
+
+void usage()
+{
+        printf("Usage: mvm [--engine switch|threaded|register|jit|verified|cached|packed]\n"
+               "           [--jit] [--no-fuse] [--fuse-stats] [--bench runs] [--profile]\n"
+               "           [--perf] [--perf-sample period]\n"
+               "           [--sample n | --sample-timer us] [--folded file]\n"
+               "           [--trace file] [--trace-size records]\n"
+               "           [--checkpoint file] [--checkpoint-at input|signal|address]\n"
+               "           [--memory words]\n"
+               "           [--output stderr|stdout|file] [--output-format text|binary]\n"
+               "           [--input stdin|file] [--input-format text|binary] [file]\n"
+               "       mvm --batch [--threads n] [--budget n] [--limit n] [--memory words]\n"
+               "           [--output-format text|binary] [--input-format text|binary]\n"
+               "           file input...\n"
+               "       mvm --lanes n [--memory words] [--output-format text|binary]\n"
+               "           file [records]\n"
+               "       mvm --restore file [--output ...] [--input ...]\n"
+               "       mvm --serve socket [--threads n] [--cache programs] [--limit n]\n"
+               "           [--memory words]\n"
+               "       mvm --assemble [--memory words] file.ms file.mbc\n"
+               "       mvm --bench-load runs file.ms\n"
+               "       mvm --decode-trace trace [file]\n");
+}
+
+int main(int argc, char **argv)
+{
+        char const *file = NULL;
+        char const *assemble = NULL;
+        char const **inputs;
+        unsigned int inputs_count = 0;
+        input_format format = INPUT_TEXT;
+        int format_given = 0;
+        vm_engine engine = ENGINE_SWITCH;
+        int bench_runs = 0;
+        int load_runs = 0;
+        int batch = 0;
+        int lanes = 0;
+        int profile = 0;
+        int perf = 0;
+        unsigned long perf_period = 0;
+        unsigned long sample_interval = 0;
+        int sample_timer = 0;
+        char const *folded = NULL;
+        char const *trace = NULL;
+        char const *decode = NULL;
+        unsigned long trace_size = 4096;
+        int threads = 0;
+        unsigned long budget = 0;
+        char const *serve = NULL;
+        char const *checkpoint = NULL;
+        char const *restore = NULL;
+        int checkpoint_at_input = 1;
+        unsigned long checkpoint_address = MAX_PROGRAM_SIZE;
+        unsigned long cache_programs = 64;
+        unsigned long limit = 1000000000;
+        int loaded = 0;
+        int parsed = 0;
+        int status = 0;
+        int i;
+
+        /* Входные файлы пакетного режима */
+        inputs = malloc(argc * sizeof(char const *));
+        if(NULL == inputs) {
+                printf("Not enough memory\n");
+                return 1;
+        }
+
+        for(i = 1; i < argc; ++i) {
+                if(0 == strcmp(argv[i], "--engine") && i + 1 < argc) {
+                        if(!engine_by_name(argv[++i], &engine)) {
+                                printf("Unknown engine %s\n", argv[i]);
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--bench") && i + 1 < argc) {
+                        bench_runs = atoi(argv[++i]);
+                        if(bench_runs <= 0) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--bench-load") && i + 1 < argc) {
+                        load_runs = atoi(argv[++i]);
+                        if(load_runs <= 0) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--profile")) {
+                        profile = 1;
+                }
+                else if(0 == strcmp(argv[i], "--perf")) {
+                        perf = 1;
+                        set_bench_perf(1);
+                }
+                else if(0 == strcmp(argv[i], "--perf-sample") && i + 1 < argc) {
+                        perf = 1;
+                        perf_period = strtoul(argv[++i], NULL, 10);
+                        if(0 == perf_period) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if((0 == strcmp(argv[i], "--sample") ||
+                         0 == strcmp(argv[i], "--sample-timer")) && i + 1 < argc) {
+                        sample_timer = (0 == strcmp(argv[i], "--sample-timer"));
+                        sample_interval = strtoul(argv[++i], NULL, 10);
+                        if(0 == sample_interval) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--folded") && i + 1 < argc) {
+                        folded = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--trace") && i + 1 < argc) {
+                        trace = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--trace-size") && i + 1 < argc) {
+                        trace_size = strtoul(argv[++i], NULL, 10);
+                        if(0 == trace_size) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--decode-trace") && i + 1 < argc) {
+                        decode = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--batch")) {
+                        batch = 1;
+                }
+                else if(0 == strcmp(argv[i], "--lanes") && i + 1 < argc) {
+                        lanes = atoi(argv[++i]);
+                        if(lanes <= 0 || lanes > 16) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+                        threads = atoi(argv[++i]);
+                        if(threads <= 0) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--budget") && i + 1 < argc) {
+                        budget = strtoul(argv[++i], NULL, 10);
+                        if(0 == budget) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+                        checkpoint = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--checkpoint-at") && i + 1 < argc) {
+                        char *end;
+
+                        ++i;
+                        checkpoint_at_input = (0 == strcmp(argv[i], "input"));
+                        checkpoint_address = MAX_PROGRAM_SIZE;
+                        if(!checkpoint_at_input && 0 != strcmp(argv[i], "signal")) {
+                                checkpoint_address = strtoul(argv[i], &end, 10);
+                                if('\0' != *end || checkpoint_address >= MAX_PROGRAM_SIZE) {
+                                        usage();
+                                        return 1;
+                                }
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--memory") && i + 1 < argc) {
+                        char *end;
+                        unsigned long words = strtoul(argv[++i], &end, 10);
+
+                        if('\0' != *end || words > MEMORY_SIZE_LIMIT ||
+                           !set_memory_size((unsigned int) words)) {
+                                printf("Data memory size must be from %d to %d words\n",
+                                       MIN_MEMORY_SIZE, MEMORY_SIZE_LIMIT);
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--restore") && i + 1 < argc) {
+                        restore = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--serve") && i + 1 < argc) {
+                        serve = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--cache") && i + 1 < argc) {
+                        cache_programs = strtoul(argv[++i], NULL, 10);
+                        if(0 == cache_programs) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--limit") && i + 1 < argc) {
+                        char *end;
+
+                        limit = strtoul(argv[++i], &end, 10);
+                        if('\0' != *end) {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--assemble") && i + 2 < argc) {
+                        file = argv[++i];
+                        assemble = argv[++i];
+                }
+                else if(0 == strcmp(argv[i], "--output") && i + 1 < argc) {
+                        if(!set_output(argv[++i])) {
+                                printf("Unable to write %s\n", argv[i]);
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--output-format") && i + 1 < argc) {
+                        ++i;
+                        if(0 == strcmp(argv[i], "text")) {
+                                set_output_format(OUTPUT_TEXT);
+                        }
+                        else if(0 == strcmp(argv[i], "binary")) {
+                                set_output_format(OUTPUT_BINARY);
+                        }
+                        else {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--input") && i + 1 < argc) {
+                        if(!set_input(argv[++i])) {
+                                printf("Unable to read %s\n", argv[i]);
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--input-format") && i + 1 < argc) {
+                        format_given = 1;
+                        ++i;
+                        if(0 == strcmp(argv[i], "text")) {
+                                format = INPUT_TEXT;
+                        }
+                        else if(0 == strcmp(argv[i], "binary")) {
+                                format = INPUT_BINARY;
+                        }
+                        else {
+                                usage();
+                                return 1;
+                        }
+                }
+                else if(0 == strcmp(argv[i], "--jit")) {
+                        engine = ENGINE_JIT;
+                }
+                else if(0 == strcmp(argv[i], "--no-fuse")) {
+                        set_fusion(0);
+                }
+                else if(0 == strcmp(argv[i], "--fuse-stats")) {
+                        set_fusion_stats(1);
+                }
+                else if('-' == argv[i][0] && '\0' != argv[i][1]) {
+                        usage();
+                        return 1;
+                }
+                else {
+                        inputs[inputs_count++] = argv[i];
+                }
+        }
+
+        if(NULL != serve) {
+                if(0 != inputs_count || batch || NULL != assemble) {
+                        usage();
+                        return 1;
+                }
+                free(inputs);
+                return run_server(serve, threads, (unsigned int) cache_programs, limit);
+        }
+
+        if(lanes > 0) {
+                if(0 == inputs_count || inputs_count > 2 || batch || NULL != assemble ||
+                   bench_runs > 0) {
+                        usage();
+                        return 1;
+                }
+                status = run_lanes(inputs[0], (inputs_count > 1) ? inputs[1] : "stdin", lanes);
+                free(inputs);
+                return status;
+        }
+
+        if(batch) {
+                if(0 == inputs_count || NULL != assemble || bench_runs > 0) {
+                        usage();
+                        return 1;
+                }
+                status = run_batch(inputs[0], inputs + 1, inputs_count - 1, threads, budget,
+                                   limit, format);
+                free(inputs);
+                return status;
+        }
+
+        if(inputs_count > 0) {
+                file = inputs[inputs_count - 1];
+        }
+        free(inputs);
+
+        if(load_runs > 0) {
+                if(NULL == file || NULL != assemble || bench_runs > 0) {
+                        usage();
+                        return 1;
+                }
+                return !bench_loaders(file, load_runs);
+        }
+
+        if(NULL != decode && NULL == file) {
+                return !decode_trace(decode, 0);
+        }
+
+        if(format_given) {
+                set_input_format(format);
+        }
+
+        if(NULL != restore) {
+                vm_status result;
+
+                if(NULL != file || NULL != assemble || bench_runs > 0) {
+                        usage();
+                        return 1;
+                }
+
+                /* Программа и её состояние берутся из снимка */
+                result = run_restore(restore);
+                if(VM_RUNTIME_ERROR == result) {
+                        print_error(stderr);
+                        milan_error("VM error");
+                }
+                return VM_OK != result;
+        }
+
+        if(NULL == file && bench_runs > 0) {
+                printf("Benchmark reads program input from stdin, program file is required\n");
+                return 1;
+        }
+
+        if(NULL != file && NULL == assemble) {
+                /* Двоичный файл загружается без разбора */
+                loaded = load_bytecode(file);
+                if(loaded < 0) {
+                        return 1;
+                }
+        }
+
+        printf("Reading input from %s\n", (NULL != file) ? file : "stdin");
+        if(!loaded) {
+                /* Текст программы из файла или со стандартного ввода */
+                parsed = load_source(file);
+                if(0 == parsed) {
+                        printf("Unable to read %s\n", file);
+                        return 1;
+                }
+        }
+
+        if(loaded || parsed > 0) {
+                if(NULL != assemble) {
+                        status = !save_bytecode(assemble);
+                }
+                else if(bench_runs > 0) {
+                        bench_engines(bench_runs);
+                }
+                else if(NULL != decode) {
+                        status = !decode_trace(decode, 1);
+                }
+                else if(NULL != checkpoint) {
+                        vm_status result = run_checkpoint(checkpoint, checkpoint_at_input,
+                                                          (unsigned int) checkpoint_address);
+
+                        if(VM_RUNTIME_ERROR == result) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                        status = (VM_OK != result);
+                }
+                else if(NULL != trace) {
+                        if(VM_OK != run_trace(trace, trace_size)) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                }
+                else if(0 != sample_interval) {
+                        if(VM_OK != run_sampled(sample_interval, sample_timer, folded)) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                }
+                else if(perf) {
+                        if(VM_OK != run_perf(engine, perf_period)) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                }
+                else if(profile) {
+                        /* Листинг строится по тексту программы, если он есть */
+                        if(VM_OK != run_profile(stdout, loaded ? NULL : file)) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                }
+                else if(VM_OK != run_engine(engine)) {
+                        print_error(stderr);
+                        milan_error("VM error");
+                }
+        }
+        else {
+                status = 1;
+        }
+
+        return status;
+}
@@ -0,0 +1,585 @@
+#include "vm_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Перевод программы виртуальной машины в программу на языке C.
+ *
+ * Программа читается так же, как в mvm, после чего по памяти команд
+ * строится функция run(): каждый достижимый базовый блок становится
+ * участком кода, на начало которого ведёт метка, а переходы - операторами
+ * goto. Если глубина стека перед каждой командой известна заранее
+ * (одинакова на всех путях, ведущих к команде), ячейки стека становятся
+ * локальными переменными s0, s1, ..., а ошибки стека диагностируются
+ * при переводе. Иначе программа работает со стеком в памяти и проверяет
+ * его перед каждой командой так же, как интерпретатор.
+ *
+ * Сообщения об ошибках, приглашение ввода и формат вывода совпадают
+ * с сообщениями и форматом mvm.
+ */
+
+static FILE *out;
+
+/* Признак того, что на команду есть переход */
+static unsigned char is_target[MAX_PROGRAM_SIZE];
+
+/* Признак использования BLOAD и BSTORE */
+static int uses_address;
+
+static char const *error_names[] = {
+        "BAD_DATA_ADDRESS",
+        "BAD_CODE_ADDRESS",
+        "BAD_RELATION",
+        "STACK_OVERFLOW",
+        "STACK_EMPTY",
+        "DIVISION_BY_ZERO",
+        "BAD_INPUT",
+        "UNKNOWN_COMMAND",
+        "DIVISION_OVERFLOW"
+};
+
+static char const *relations[] = { "==", "!=", "<", ">", "<=", ">=" };
+
+/* Начало получаемой программы */
+static char const *prelude =
+        "#include <limits.h>\n"
+        "#include <stdio.h>\n"
+        "#include <stdlib.h>\n"
+        "\n"
+        "#define MAX_MEMORY_SIZE %d\n"
+        "#define MAX_STACK_SIZE %d\n"
+        "\n"
+        "typedef enum {\n"
+        "        BAD_DATA_ADDRESS,\n"
+        "        BAD_CODE_ADDRESS,\n"
+        "        BAD_RELATION,\n"
+        "        STACK_OVERFLOW,\n"
+        "        STACK_EMPTY,\n"
+        "        DIVISION_BY_ZERO,\n"
+        "        BAD_INPUT,\n"
+        "        UNKNOWN_COMMAND,\n"
+        "        DIVISION_OVERFLOW\n"
+        "} runtime_error;\n"
+        "\n";
+
+/* Функции получаемой программы; следуют за памятью, листингом
+ * и сообщениями об ошибках
+ */
+static char const *runtime =
+        "static void vm_error(runtime_error error, unsigned int pc)\n"
+        "{\n"
+        "        fprintf(stderr, \"Error: %s\\n\", messages[error]);\n"
+        "        fprintf(stderr, \"Code:\\n\\n\");\n"
+        "        fputs(listing[pc], stderr);\n"
+        "        fprintf(stderr, \"VM error\");\n"
+        "        exit(1);\n"
+        "}\n"
+        "\n"
+        "static int vm_read(unsigned int pc)\n"
+        "{\n"
+        "        int n = 0;\n"
+        "\n"
+        "        fprintf(stderr, \"> \"); fflush(stdout);\n"
+        "        if(scanf(\"%d\", &n)) {\n"
+        "                return n;\n"
+        "        }\n"
+        "        vm_error(BAD_INPUT, pc);\n"
+        "        return 0;\n"
+        "}\n"
+        "\n"
+        "static void vm_write(int n)\n"
+        "{\n"
+        "        fprintf(stderr, \"%d\\n\", n);\n"
+        "}\n"
+        "\n";
+
+/* Стек в памяти для программ, глубина стека в которых не известна заранее */
+static char const *dynamic_stack =
+        "static int stack[MAX_STACK_SIZE];\n"
+        "static unsigned int sp = 0;\n"
+        "\n"
+        "static int pop(unsigned int pc)\n"
+        "{\n"
+        "        if(sp > 0) {\n"
+        "                return stack[--sp];\n"
+        "        }\n"
+        "        vm_error(STACK_EMPTY, pc);\n"
+        "        return 0;\n"
+        "}\n"
+        "\n"
+        "static void push(unsigned int pc, int word)\n"
+        "{\n"
+        "        if(sp < MAX_STACK_SIZE) {\n"
+        "                stack[sp++] = word;\n"
+        "        }\n"
+        "        else {\n"
+        "                vm_error(STACK_OVERFLOW, pc);\n"
+        "        }\n"
+        "}\n"
+        "\n";
+
+void milan_error(char const *msg)
+{
+        fprintf(stderr, "%s", msg);
+        exit(1);
+}
+
+static int is_jump(operation op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op;
+}
+
+/* Поиск меток и команд BLOAD и BSTORE среди команд, которые будут
+ * переведены. Если глубина стека известна, переводятся только достижимые
+ * команды.
+ */
+static void mark_targets(int known_depth)
+{
+        unsigned int size = vm_program_size;
+        unsigned int address;
+        runtime_error error;
+
+        for(address = 0; address < size; ++address) {
+                is_target[address] = 0;
+        }
+        uses_address = !known_depth;
+
+        for(address = 0; address < size; ++address) {
+                command const *cmd = &vm_program[address];
+                unsigned int target = cmd->arg;
+
+                if(known_depth) {
+                        if(vm_stack_depth[address] < 0 ||
+                           stack_effect(address, vm_stack_depth[address], &error) < 0) {
+                                continue;
+                        }
+                        if(BLOAD == cmd->operation || BSTORE == cmd->operation) {
+                                uses_address = 1;
+                        }
+                }
+
+                if(is_jump(cmd->operation) && target < size) {
+                        is_target[target] = 1;
+                }
+        }
+}
+
+static void emit_error(runtime_error error, unsigned int address)
+{
+        fprintf(out, "        vm_error(%s, %u);\n", error_names[error], address);
+}
+
+/* Переход к команде target или остановка, если target за концом программы */
+static void emit_goto(char const *condition, unsigned int target)
+{
+        char const *jump = (target < vm_program_size) ? "goto L" : "return;";
+
+        if(NULL != condition) {
+                fprintf(out, "        if(%s) ", condition);
+        }
+        else {
+                fprintf(out, "        ");
+        }
+
+        if(target < vm_program_size) {
+                fprintf(out, "%s%u;\n", jump, target);
+        }
+        else {
+                fprintf(out, "%s\n", jump);
+        }
+}
+
+/* Команда при известной глубине стека: ячейка i стека - переменная si */
+static void emit_static(unsigned int address)
+{
+        command const *cmd = &vm_program[address];
+        int arg = cmd->arg;
+        int depth = vm_stack_depth[address];
+        int top = depth - 1;
+        runtime_error error;
+        char condition[32];
+
+        if(stack_effect(address, depth, &error) < 0) {
+                /* DIV с одним словом в стеке сначала проверяет делитель */
+                if(DIV == cmd->operation && 1 == depth) {
+                        fprintf(out, "        if(0 == s0) vm_error(DIVISION_BY_ZERO, %u);\n", address);
+                }
+                else if(INPUT == cmd->operation) {
+                        fprintf(out, "        vm_read(%u);\n", address);
+                }
+                emit_error(error, address);
+                return;
+        }
+
+        switch(cmd->operation) {
+        case NOP:
+        case POP:
+                break;
+
+        case STOP:
+                fprintf(out, "        return;\n");
+                break;
+
+        case LOAD:
+                fprintf(out, "        s%d = memory[%d];\n", depth, arg);
+                break;
+
+        case STORE:
+                fprintf(out, "        memory[%d] = s%d;\n", arg, top);
+                break;
+
+        case BLOAD:
+                fprintf(out, "        address = %uu + (unsigned int) s%d;\n", (unsigned int) arg, top);
+                fprintf(out, "        if(address >= MAX_MEMORY_SIZE) vm_error(BAD_DATA_ADDRESS, %u);\n", address);
+                fprintf(out, "        s%d = memory[address];\n", top);
+                break;
+
+        case BSTORE:
+                fprintf(out, "        address = %uu + (unsigned int) s%d;\n", (unsigned int) arg, top);
+                fprintf(out, "        if(address >= MAX_MEMORY_SIZE) vm_error(BAD_DATA_ADDRESS, %u);\n", address);
+                fprintf(out, "        memory[address] = s%d;\n", top - 1);
+                break;
+
+        case PUSH:
+                fprintf(out, "        s%d = %d;\n", depth, arg);
+                break;
+
+        case DUP:
+                fprintf(out, "        s%d = s%d;\n", depth, top);
+                break;
+
+        case INVERT:
+                fprintf(out, "        s%d = (int) (0u - (unsigned int) s%d);\n", top, top);
+                break;
+
+        case ADD:
+        case SUB:
+        case MULT:
+                fprintf(out, "        s%d = (int) ((unsigned int) s%d %c (unsigned int) s%d);\n", top - 1, top - 1,
+                        (ADD == cmd->operation) ? '+' : (SUB == cmd->operation) ? '-' : '*', top);
+                break;
+
+        case DIV:
+                fprintf(out, "        if(0 == s%d) vm_error(DIVISION_BY_ZERO, %u);\n", top, address);
+                fprintf(out, "        if(-1 == s%d && INT_MIN == s%d) vm_error(DIVISION_OVERFLOW, %u);\n",
+                        top, top - 1, address);
+                fprintf(out, "        s%d = s%d / s%d;\n", top - 1, top - 1, top);
+                break;
+
+        case COMPARE:
+                fprintf(out, "        s%d = (s%d %s s%d) ? 1 : 0;\n", top - 1, top - 1, relations[arg], top);
+                break;
+
+        case JUMP:
+                emit_goto(NULL, arg);
+                break;
+
+        case JUMP_YES:
+        case JUMP_NO:
+                sprintf(condition, (JUMP_YES == cmd->operation) ? "s%d" : "!s%d", top);
+                emit_goto(condition, arg);
+                break;
+
+        case INPUT:
+                fprintf(out, "        s%d = vm_read(%u);\n", depth, address);
+                break;
+
+        case PRINT:
+                fprintf(out, "        vm_write(s%d);\n", top);
+                break;
+
+        default:
+                break;
+        }
+}
+
+/* Команда при неизвестной глубине стека: стек в памяти с проверками */
+static void emit_dynamic(unsigned int address)
+{
+        command const *cmd = &vm_program[address];
+        int arg = cmd->arg;
+        char condition[32];
+
+        switch(cmd->operation) {
+        case NOP:
+                break;
+
+        case STOP:
+                fprintf(out, "        return;\n");
+                break;
+
+        case LOAD:
+                if((unsigned int) arg >= MAX_MEMORY_SIZE) {
+                        emit_error(BAD_DATA_ADDRESS, address);
+                }
+                else {
+                        fprintf(out, "        push(%u, memory[%d]);\n", address, arg);
+                }
+                break;
+
+        case STORE:
+                if((unsigned int) arg >= MAX_MEMORY_SIZE) {
+                        fprintf(out, "        pop(%u);\n", address);
+                        emit_error(BAD_DATA_ADDRESS, address);
+                }
+                else {
+                        fprintf(out, "        memory[%d] = pop(%u);\n", arg, address);
+                }
+                break;
+
+        case BLOAD:
+                fprintf(out, "        address = %uu + (unsigned int) pop(%u);\n", (unsigned int) arg, address);
+                fprintf(out, "        if(address >= MAX_MEMORY_SIZE) vm_error(BAD_DATA_ADDRESS, %u);\n", address);
+                fprintf(out, "        push(%u, memory[address]);\n", address);
+                break;
+
+        case BSTORE:
+                fprintf(out, "        address = %uu + (unsigned int) pop(%u);\n", (unsigned int) arg, address);
+                fprintf(out, "        data = pop(%u);\n", address);
+                fprintf(out, "        if(address >= MAX_MEMORY_SIZE) vm_error(BAD_DATA_ADDRESS, %u);\n", address);
+                fprintf(out, "        memory[address] = data;\n");
+                break;
+
+        case PUSH:
+                fprintf(out, "        push(%u, %d);\n", address, arg);
+                break;
+
+        case POP:
+                fprintf(out, "        pop(%u);\n", address);
+                break;
+
+        case DUP:
+                fprintf(out, "        data = pop(%u);\n", address);
+                fprintf(out, "        push(%u, data);\n", address);
+                fprintf(out, "        push(%u, data);\n", address);
+                break;
+
+        case INVERT:
+                fprintf(out, "        push(%u, (int) (0u - (unsigned int) pop(%u)));\n", address, address);
+                break;
+
+        case ADD:
+        case SUB:
+        case MULT:
+                fprintf(out, "        data = pop(%u);\n", address);
+                fprintf(out, "        push(%u, (int) ((unsigned int) pop(%u) %c (unsigned int) data));\n", address, address,
+                        (ADD == cmd->operation) ? '+' : (SUB == cmd->operation) ? '-' : '*');
+                break;
+
+        case DIV:
+                fprintf(out, "        data = pop(%u);\n", address);
+                fprintf(out, "        if(0 == data) vm_error(DIVISION_BY_ZERO, %u);\n", address);
+                fprintf(out, "        if(-1 == data && sp > 0 && INT_MIN == stack[sp - 1]) vm_error(DIVISION_OVERFLOW, %u);\n",
+                        address);
+                fprintf(out, "        push(%u, pop(%u) / data);\n", address, address);
+                break;
+
+        case COMPARE:
+                fprintf(out, "        data = pop(%u);\n", address);
+                if((unsigned int) arg > GE) {
+                        emit_error(BAD_RELATION, address);
+                }
+                else {
+                        fprintf(out, "        push(%u, (pop(%u) %s data) ? 1 : 0);\n", address, address, relations[arg]);
+                }
+                break;
+
+        case JUMP:
+        case JUMP_YES:
+        case JUMP_NO:
+                if((unsigned int) arg >= MAX_PROGRAM_SIZE) {
+                        emit_error(BAD_CODE_ADDRESS, address);
+                }
+                else if(JUMP == cmd->operation) {
+                        emit_goto(NULL, arg);
+                }
+                else {
+                        sprintf(condition, (JUMP_YES == cmd->operation) ? "pop(%u)" : "!pop(%u)", address);
+                        emit_goto(condition, arg);
+                }
+                break;
+
+        case INPUT:
+                fprintf(out, "        data = vm_read(%u);\n", address);
+                fprintf(out, "        push(%u, data);\n", address);
+                break;
+
+        case PRINT:
+                fprintf(out, "        vm_write(pop(%u));\n", address);
+                break;
+
+        default:
+                emit_error(UNKNOWN_COMMAND, address);
+        }
+}
+
+/* Строки листинга, выводимые vm_error() после "Code:" */
+static void emit_listing()
+{
+        unsigned int address;
+
+        fprintf(out, "static char const *const listing[] = {\n");
+        for(address = 0; address < vm_program_size; ++address) {
+                command const *cmd = &vm_program[address];
+                opcode_info *info = operation_info(cmd->operation);
+
+                if(NULL == info) {
+                        fprintf(out, "        \"%u\\t(%d)\\t\\t%d\\n\"", address, cmd->operation, cmd->arg);
+                }
+                else if(info->need_arg) {
+                        fprintf(out, "        \"\\t%u\\t%s\\t\\t%d\\n\"", address, info->name, cmd->arg);
+                }
+                else {
+                        fprintf(out, "        \"\\t%u\\t%s\\n\"", address, info->name);
+                }
+                fprintf(out, "%s\n", (address + 1 < vm_program_size) ? "," : "");
+        }
+        if(0 == vm_program_size) {
+                fprintf(out, "        \"\"\n");
+        }
+        fprintf(out, "};\n\n");
+}
+
+/* Тексты сообщений об ошибках, индексируемые runtime_error */
+static void emit_messages()
+{
+        unsigned int i;
+
+        fprintf(out, "static char const *const messages[] = {\n");
+        for(i = 0; i < sizeof(error_names) / sizeof(error_names[0]); ++i) {
+                fprintf(out, "        \"%s\"%s\n", vm_error_message((runtime_error) i),
+                        (i + 1 < sizeof(error_names) / sizeof(error_names[0])) ? "," : "");
+        }
+        fprintf(out, "};\n\n");
+}
+
+/* Начальное содержимое памяти данных (директивы SET) */
+static void emit_memory()
+{
+        unsigned int address;
+        int initialized = 0;
+
+        for(address = 0; address < MAX_MEMORY_SIZE; ++address) {
+                int value = LOAD_WORD(vm_memory, address);
+
+                if(0 == value) {
+                        continue;
+                }
+                if(!initialized++) {
+                        fprintf(out, "static int memory[MAX_MEMORY_SIZE] = {\n");
+                }
+                fprintf(out, "        [%u] = %d,\n", address, value);
+        }
+
+        if(initialized) {
+                fprintf(out, "};\n\n");
+        }
+        else {
+                fprintf(out, "static int memory[MAX_MEMORY_SIZE];\n\n");
+        }
+}
+
+static void translate()
+{
+        verify_result result;
+        int known_depth;
+        unsigned int address;
+        int i;
+
+        verify_program(&result);
+        known_depth = (VERIFY_CONFLICT != result.status);
+        mark_targets(known_depth);
+
+        fprintf(out, prelude, MAX_MEMORY_SIZE, MAX_STACK_SIZE);
+        emit_memory();
+        emit_listing();
+        emit_messages();
+        fprintf(out, "%s", runtime);
+        if(!known_depth) {
+                fprintf(out, "%s", dynamic_stack);
+        }
+
+        fprintf(out, "static void run(void)\n{\n");
+        if(known_depth) {
+                for(i = 0; i < result.max_depth; ++i) {
+                        fprintf(out, "        int s%d = 0;\n", i);
+                }
+        }
+        else {
+                fprintf(out, "        int data;\n");
+        }
+        if(uses_address) {
+                fprintf(out, "        unsigned int address;\n");
+        }
+        fprintf(out, "\n");
+
+        for(address = 0; address < vm_program_size; ++address) {
+                opcode_info *info = operation_info(vm_program[address].operation);
+
+                if(known_depth && vm_stack_depth[address] < 0) {
+                        continue;
+                }
+
+                if(is_target[address]) {
+                        fprintf(out, "L%u:\n", address);
+                }
+
+                if(NULL != info && info->need_arg) {
+                        fprintf(out, "        /* %u: %s %d */\n", address, info->name, vm_program[address].arg);
+                }
+                else if(NULL != info) {
+                        fprintf(out, "        /* %u: %s */\n", address, info->name);
+                }
+
+                if(known_depth) {
+                        emit_static(address);
+                }
+                else {
+                        emit_dynamic(address);
+                }
+        }
+
+        fprintf(out, "        return;\n}\n\n");
+        fprintf(out, "int main(void)\n{\n        run();\n        return 0;\n}\n");
+}
+
+void usage()
+{
+        printf("Usage: ms2c program.ms [output.c]\n");
+}
+
+int main(int argc, char **argv)
+{
+        int loaded;
+
+        if(argc < 2 || argc > 3) {
+                usage();
+                return 1;
+        }
+
+        loaded = load_source(argv[1]);
+        if(0 == loaded) {
+                printf("Unable to read %s\n", argv[1]);
+        }
+        if(loaded <= 0) {
+                return 1;
+        }
+
+        if(3 == argc) {
+                out = fopen(argv[2], "wt");
+                if(!out) {
+                        printf("Unable to write %s\n", argv[2]);
+                        return 1;
+                }
+        }
+        else {
+                out = stdout;
+        }
+
+        translate();
+
+        if(out != stdout) {
+                fclose(out);
+        }
+
+        return 0;
+}
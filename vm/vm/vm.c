@@ -1,371 +1,523 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include "vm.h"
-
-void milan_error();
-
-command vm_program[MAX_PROGRAM_SIZE];
-
-int vm_memory[MAX_MEMORY_SIZE];
-int vm_stack[MAX_STACK_SIZE];
-
-unsigned int vm_stack_pointer = 0;
-unsigned int vm_command_pointer = 0;
-
-opcode_info opcodes_table[] = {
-        {"NOP",      0},
-        {"STOP",     0},
-        {"LOAD",     1},
-        {"STORE",    1},
-        {"BLOAD",    1},
-        {"BSTORE",   1},
-        {"PUSH",     1},
-        {"POP",      0},
-        {"DUP",      0},
-        {"INVERT",   0},
-        {"ADD",      0},
-        {"SUB",      0},
-        {"MULT",     0},
-        {"DIV",      0},
-        {"COMPARE",  1},
-        {"JUMP",     1},
-        {"JUMP_YES", 1},
-        {"JUMP_NO",  1},
-        {"INPUT",    0},
-        {"PRINT",    0}
-};
-
-int opcodes_table_size = sizeof(opcodes_table) / sizeof(opcode_info);
-
-typedef enum {
-        BAD_DATA_ADDRESS,
-        BAD_CODE_ADDRESS,
-        BAD_RELATION,
-        STACK_OVERFLOW,
-        STACK_EMPTY,
-        DIVISION_BY_ZERO,
-        BAD_INPUT,
-        UNKNOWN_COMMAND
-} runtime_error;
-
-void vm_init()
-{
-        vm_stack_pointer = 0;
-	vm_command_pointer = 0;
-}
-
-void vm_error(runtime_error error)
-{
-	opcode_info* info;
-
-        switch(error) {
-        case BAD_DATA_ADDRESS:
-                fprintf(stderr, "Error: illegal data address\n");
-                break;
-
-        case BAD_CODE_ADDRESS:
-                fprintf(stderr, "Error: illegal address in JUMP* instruction\n");
-                break;
-
-        case BAD_RELATION:
-                fprintf(stderr, "Error: illegal comparison operator\n");
-                break;
-
-        case STACK_OVERFLOW:
-                fprintf(stderr, "Error: stack overflow\n");
-                break;
-
-        case STACK_EMPTY:
-                fprintf(stderr, "Error: stack is empty (no arguments are available)\n");
-                break;
-
-        case DIVISION_BY_ZERO:
-                fprintf(stderr, "Error: division by zero\n");
-                break;
-
-        case BAD_INPUT:
-                fprintf(stderr, "Error: illegal input\n");
-                break;
-
-        case UNKNOWN_COMMAND:
-                fprintf(stderr, "Error: unknown command, unable to execute\n");
-                break;
-
-        default:
-                fprintf(stderr, "Error: runtime error %d\n", error);
-        }
-	
-	fprintf(stderr, "Code:\n\n");
-
-        info = operation_info(vm_program[vm_command_pointer].operation);
-	if(NULL == info) {
-		fprintf(stderr, "%d\t(%d)\t\t%d\n", vm_command_pointer, 
-			vm_program[vm_command_pointer].operation,
-			vm_program[vm_command_pointer].arg);
-	}
-	else {
-                if(info->need_arg) {
-                        fprintf(stderr, "\t%d\t%s\t\t%d\n", vm_command_pointer, info->name,
-                                vm_program[vm_command_pointer].arg);
-                }
-                else {
-                        fprintf(stderr, "\t%d\t%s\n", vm_command_pointer, info->name);
-                }
-        }
-
-        milan_error("VM error");
-}
-
-int vm_load(unsigned int address)
-{
-        if(address < MAX_MEMORY_SIZE) {
-                return vm_memory[address];
-        }
-        else {
-                vm_error(BAD_DATA_ADDRESS);
-                return 0;
-        }
-}
-
-void vm_store(unsigned int address, int word)
-{
-        if(address < MAX_MEMORY_SIZE) {
-                vm_memory[address] = word;
-        }
-        else {
-                vm_error(BAD_DATA_ADDRESS);
-        }
-}
-
-int vm_read()
-{
-        int n;
-
-	fprintf(stderr, "> "); fflush(stdout);
-        if(scanf("%d", &n)) {
-                return n;
-        }
-        else {
-                vm_error(BAD_INPUT);
-                return 0;
-        }
-}
-
-void vm_write(int n)
-{
-        fprintf(stderr, "%d\n", n);
-}
-
-int vm_pop()
-{
-	if(vm_stack_pointer > 0) {
-		return vm_stack[--vm_stack_pointer];
-	}
-	else {
-		vm_error(STACK_EMPTY);
-                return 0;
-	}
-}
-
-void vm_push(int word)
-{
-	if(vm_stack_pointer < MAX_STACK_SIZE) {
-		vm_stack[vm_stack_pointer++] = word;
-	}
-	else {
-		vm_error(STACK_OVERFLOW);
-	}
-}
-
-int vm_run_command()
-{
-	unsigned int index = vm_command_pointer;
-
-        operation op = vm_program[index].operation;
-        unsigned int arg = vm_program[index].arg;
-        int data;
-
-        switch(op) {
-        case NOP:
-                /*    */
-                break;
-
-        case STOP:
-                return 0;
-                break;
-                
-        case LOAD:
-                vm_push(vm_load(arg));
-                break;
-
-        case STORE:
-                vm_store(arg, vm_pop());
-                break;
-
-        case BLOAD:
-                vm_push(vm_load(arg + vm_pop()));
-                break;
-
-        case BSTORE:
-                data = vm_pop();
-                vm_store(arg + data, vm_pop());
-                break;
-
-        case PUSH:
-                vm_push(arg);
-                break;
-
-        case POP:
-                vm_pop();
-                break;
-
-        case DUP:
-                data = vm_pop();
-                vm_push(data);
-                vm_push(data);
-                break;
-
-        case INVERT:
-                vm_push(-vm_pop());
-                break;
-
-        case ADD:
-                data = vm_pop();
-                vm_push(vm_pop() + data);
-                break;
-
-        case SUB:
-                data = vm_pop();
-                vm_push(vm_pop() - data);
-                break;
-
-        case MULT:
-                data = vm_pop();
-                vm_push(vm_pop() * data);
-                break;
-
-        case DIV:
-                data = vm_pop();
-                if(0 == data) {
-                        vm_error(DIVISION_BY_ZERO);
-                }
-                else {
-                        vm_push(vm_pop() / data);
-                }
-                break;
-
-        case COMPARE:
-                data = vm_pop();
-                switch(arg) {
-                case EQ:
-                        vm_push((vm_pop() == data) ? 1 : 0);
-                        break;
-
-                case NE:
-                        vm_push((vm_pop() != data) ? 1 : 0);
-                        break;
-
-                case LT:
-                        vm_push((vm_pop() < data) ? 1 : 0);
-                        break;
-
-                case GT:
-                        vm_push((vm_pop() > data) ? 1 : 0);
-                        break;
-
-                case LE:
-                        vm_push((vm_pop() <= data) ? 1 : 0);
-                        break;
-
-                case GE:
-                        vm_push((vm_pop() >= data) ? 1 : 0);
-                        break;
-
-                default:
-                        vm_error(BAD_RELATION);
-                }
-                break;
-
-        case JUMP:
-                if(arg < MAX_PROGRAM_SIZE) {
-                        vm_command_pointer = arg;
-                        return 1;
-                }
-                else {
-                        vm_error(BAD_CODE_ADDRESS);
-                }
-                        
-                break;
-
-        case JUMP_YES:
-                if(arg < MAX_PROGRAM_SIZE) {
-                        data = vm_pop();
-                        if(data) {
-                                vm_command_pointer = arg;
-                                return 1;
-                        }
-                }
-                else {
-                        vm_error(BAD_CODE_ADDRESS);
-                }
-                break;
-
-        case JUMP_NO:
-                if(arg < MAX_PROGRAM_SIZE) {
-                        data = vm_pop();
-                        if(!data) {
-                                vm_command_pointer = arg;
-                                return 1;
-                        }
-                }
-                else {
-                        vm_error(BAD_CODE_ADDRESS);
-                }
-                break;
-
-        case INPUT:
-                vm_push(vm_read());
-                break;
-
-        case PRINT:
-		vm_write(vm_pop());
-                break;
-
-        default:
-		vm_error(UNKNOWN_COMMAND);
-        }
-
-        ++vm_command_pointer;
-        return 1;
-}
-
-void run()
-{
-	vm_command_pointer = 0;
-	while(vm_command_pointer < MAX_PROGRAM_SIZE) {
-		if(!vm_run_command())
-			break;
-	}
-}
-
-opcode_info* operation_info(operation op)
-{
-        return (op < opcodes_table_size) ? &opcodes_table[op] : NULL;
-}
-
-void put_command(unsigned int address, operation op, int arg)
-{
-        if(address < MAX_PROGRAM_SIZE) {
-                vm_program[address].operation = op;
-                vm_program[address].arg = arg;
-        }
-        else {
-                milan_error("Illegal address in put_command()");
-        }
-}
-
-void set_mem(unsigned int address, int value)
-{
-        vm_memory[address] = value;
-}
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "vm_internal.h"
+
+opcode_info opcodes_table[] = {
+        {"NOP",      0},
+        {"STOP",     0},
+        {"LOAD",     1},
+        {"STORE",    1},
+        {"BLOAD",    1},
+        {"BSTORE",   1},
+        {"PUSH",     1},
+        {"POP",      0},
+        {"DUP",      0},
+        {"INVERT",   0},
+        {"ADD",      0},
+        {"SUB",      0},
+        {"MULT",     0},
+        {"DIV",      0},
+        {"COMPARE",  1},
+        {"JUMP",     1},
+        {"JUMP_YES", 1},
+        {"JUMP_NO",  1},
+        {"INPUT",    0},
+        {"PRINT",    0}
+};
+
+int opcodes_table_size = sizeof(opcodes_table) / sizeof(opcode_info);
+
+void vm_init()
+{
+        vm_stack_pointer = 0;
+	vm_command_pointer = 0;
+}
+
+char const *vm_error_message(runtime_error error)
+{
+        switch(error) {
+        case BAD_DATA_ADDRESS:
+                return "illegal data address";
+
+        case BAD_CODE_ADDRESS:
+                return "illegal address in JUMP* instruction";
+
+        case BAD_RELATION:
+                return "illegal comparison operator";
+
+        case STACK_OVERFLOW:
+                return "stack overflow";
+
+        case STACK_EMPTY:
+                return "stack is empty (no arguments are available)";
+
+        case DIVISION_BY_ZERO:
+                return "division by zero";
+
+        case BAD_INPUT:
+                return "illegal input";
+
+        case UNKNOWN_COMMAND:
+                return "unknown command, unable to execute";
+
+        case DIVISION_OVERFLOW:
+                return "integer overflow in division";
+
+        default:
+                return NULL;
+        }
+}
+
+void vm_error(runtime_error error)
+{
+        vm_current->error = error;
+        vm_current->error_address = vm_command_pointer;
+        vm_fail(VM_RUNTIME_ERROR, "VM error");
+}
+
+void print_error(FILE *stream)
+{
+	opcode_info* info;
+        unsigned int address = vm_current->error_address;
+        char const *message = vm_error_message(vm_current->error);
+
+        if(VM_RUNTIME_ERROR != vm_current->status) {
+                return;
+        }
+
+        if(NULL == vm_current->write) {
+                flush_output();
+        }
+
+        if(NULL != message) {
+                fprintf(stream, "Error: %s\n", message);
+        }
+        else {
+                fprintf(stream, "Error: runtime error %d\n", vm_current->error);
+        }
+        if(vm_source_lines_loaded && 0 != vm_source_line[address]) {
+                fprintf(stream, "Line: %u\n", vm_source_line[address]);
+        }
+	
+	fprintf(stream, "Code:\n\n");
+
+        info = operation_info(vm_program[address].operation);
+	if(NULL == info) {
+		fprintf(stream, "%d\t(%d)\t\t%d\n", address, 
+			vm_program[address].operation,
+			vm_program[address].arg);
+	}
+	else {
+                if(info->need_arg) {
+                        fprintf(stream, "\t%d\t%s\t\t%d\n", address, info->name,
+                                vm_program[address].arg);
+                }
+                else {
+                        fprintf(stream, "\t%d\t%s\n", address, info->name);
+                }
+        }
+}
+
+int vm_load(unsigned int address)
+{
+        if(address < DENSE_MEMORY_SIZE) {
+                return vm_memory[address];
+        }
+        else if(address < vm_memory_size) {
+                return load_paged(address);
+        }
+        else {
+                vm_error(BAD_DATA_ADDRESS);
+                return 0;
+        }
+}
+
+void vm_store(unsigned int address, int word)
+{
+        if(address < DENSE_MEMORY_SIZE) {
+                vm_memory[address] = word;
+        }
+        else if(address < vm_memory_size) {
+                store_paged(address, word);
+        }
+        else {
+                vm_error(BAD_DATA_ADDRESS);
+        }
+}
+
+int vm_read()
+{
+        int n;
+
+        if(NULL != vm_current->read) {
+                int result = vm_current->read(vm_current->io_data, &n);
+
+                if(result > 0) {
+                        return n;
+                }
+                if(result < 0 && vm_current->resumable) {
+                        /* INPUT будет исполнена заново, когда появятся данные */
+                        vm_fail(VM_WAIT_INPUT, "Waiting for input");
+                }
+                vm_error(BAD_INPUT);
+                return 0;
+        }
+
+        if(!input_interactive) {
+                if(input_word(&n)) {
+                        return n;
+                }
+                vm_error(BAD_INPUT);
+                return 0;
+        }
+
+        flush_output();
+	fprintf(stderr, "> "); fflush(stdout);
+        if(scanf("%d", &n)) {
+                return n;
+        }
+        else {
+                vm_error(BAD_INPUT);
+                return 0;
+        }
+}
+
+void vm_write(int n)
+{
+        if(NULL != vm_current->write) {
+                vm_current->write(vm_current->io_data, n);
+                return;
+        }
+
+        output_word(n);
+}
+
+int vm_pop()
+{
+	if(vm_stack_pointer > 0) {
+		return vm_stack[--vm_stack_pointer];
+	}
+	else {
+		vm_error(STACK_EMPTY);
+                return 0;
+	}
+}
+
+void vm_push(int word)
+{
+	if(vm_stack_pointer < MAX_STACK_SIZE) {
+		vm_stack[vm_stack_pointer++] = word;
+	}
+	else {
+		vm_error(STACK_OVERFLOW);
+	}
+}
+
+int vm_run_command()
+{
+	unsigned int index = vm_command_pointer;
+
+        operation op = vm_program[index].operation;
+        unsigned int arg = vm_program[index].arg;
+        int data;
+
+        switch(op) {
+        case NOP:
+                /* Ничего не делаем */
+                break;
+
+        case STOP:
+                return 0;
+                break;
+                
+        case LOAD:
+                vm_push(vm_load(arg));
+                break;
+
+        case STORE:
+                vm_store(arg, vm_pop());
+                break;
+
+        case BLOAD:
+                vm_push(vm_load(arg + vm_pop()));
+                break;
+
+        case BSTORE:
+                data = vm_pop();
+                vm_store(arg + data, vm_pop());
+                break;
+
+        case PUSH:
+                vm_push(arg);
+                break;
+
+        case POP:
+                vm_pop();
+                break;
+
+        case DUP:
+                data = vm_pop();
+                vm_push(data);
+                vm_push(data);
+                break;
+
+        case INVERT:
+                vm_push(-vm_pop());
+                break;
+
+        case ADD:
+                data = vm_pop();
+                vm_push(vm_pop() + data);
+                break;
+
+        case SUB:
+                data = vm_pop();
+                vm_push(vm_pop() - data);
+                break;
+
+        case MULT:
+                data = vm_pop();
+                vm_push(vm_pop() * data);
+                break;
+
+        case DIV:
+                data = vm_pop();
+                if(0 == data) {
+                        vm_error(DIVISION_BY_ZERO);
+                }
+                else {
+                        int dividend = vm_pop();
+
+                        if(DIVISION_OVERFLOWS(dividend, data)) {
+                                vm_error(DIVISION_OVERFLOW);
+                        }
+                        vm_push(dividend / data);
+                }
+                break;
+
+        case COMPARE:
+                data = vm_pop();
+                switch(arg) {
+                case EQ:
+                        vm_push((vm_pop() == data) ? 1 : 0);
+                        break;
+
+                case NE:
+                        vm_push((vm_pop() != data) ? 1 : 0);
+                        break;
+
+                case LT:
+                        vm_push((vm_pop() < data) ? 1 : 0);
+                        break;
+
+                case GT:
+                        vm_push((vm_pop() > data) ? 1 : 0);
+                        break;
+
+                case LE:
+                        vm_push((vm_pop() <= data) ? 1 : 0);
+                        break;
+
+                case GE:
+                        vm_push((vm_pop() >= data) ? 1 : 0);
+                        break;
+
+                default:
+                        vm_error(BAD_RELATION);
+                }
+                break;
+
+        case JUMP:
+                if(arg < MAX_PROGRAM_SIZE) {
+                        vm_command_pointer = arg;
+                        return 1;
+                }
+                else {
+                        vm_error(BAD_CODE_ADDRESS);
+                }
+                        
+                break;
+
+        case JUMP_YES:
+                if(arg < MAX_PROGRAM_SIZE) {
+                        data = vm_pop();
+                        if(data) {
+                                vm_command_pointer = arg;
+                                return 1;
+                        }
+                }
+                else {
+                        vm_error(BAD_CODE_ADDRESS);
+                }
+                break;
+
+        case JUMP_NO:
+                if(arg < MAX_PROGRAM_SIZE) {
+                        data = vm_pop();
+                        if(!data) {
+                                vm_command_pointer = arg;
+                                return 1;
+                        }
+                }
+                else {
+                        vm_error(BAD_CODE_ADDRESS);
+                }
+                break;
+
+        case INPUT:
+                vm_push(vm_read());
+                break;
+
+        case PRINT:
+		vm_write(vm_pop());
+                break;
+
+        default:
+		vm_error(UNKNOWN_COMMAND);
+        }
+
+        ++vm_command_pointer;
+        return 1;
+}
+
+int run_until_leader(unsigned char const *leaders)
+{
+        do {
+                if(!vm_run_command()) {
+                        return 0;
+                }
+        } while(vm_command_pointer < vm_program_size && !leaders[vm_command_pointer]);
+
+        if(vm_command_pointer >= vm_program_size) {
+                /* Дальше в памяти команд только NOP */
+                vm_command_pointer = MAX_PROGRAM_SIZE;
+                return 0;
+        }
+
+        return 1;
+}
+
+int run_budget(unsigned long budget)
+{
+	while(vm_command_pointer < vm_program_size) {
+                if(0 == budget--) {
+                        return 1;
+                }
+                ++vm_current->instructions;
+		if(!vm_run_command())
+			return 0;
+	}
+
+        /* Дальше в памяти команд только NOP */
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+        return 0;
+}
+
+void run()
+{
+	vm_command_pointer = 0;
+        vm_current->instructions = 0;
+        run_budget(ULONG_MAX);
+}
+
+opcode_info* operation_info(operation op)
+{
+        return (op < opcodes_table_size) ? &opcodes_table[op] : NULL;
+}
+
+void put_command(unsigned int address, operation op, int arg)
+{
+        if(address < MAX_PROGRAM_SIZE) {
+                vm_program[address].operation = op;
+                vm_program[address].arg = arg;
+                if(address >= vm_program_size) {
+                        vm_program_size = address + 1;
+                }
+        }
+        else {
+                vm_fail(VM_LOAD_ERROR, "Illegal address in put_command()");
+        }
+}
+
+void set_mem(unsigned int address, int value)
+{
+        if(address < vm_memory_size) {
+                STORE_WORD(vm_memory, address, value);
+        }
+        else {
+                vm_fail(VM_LOAD_ERROR, "Illegal address in set_mem()");
+        }
+}
+
+
+engine_info engines_table[] = {
+        {"switch",   ENGINE_SWITCH},
+        {"threaded", ENGINE_THREADED},
+        {"register", ENGINE_REGISTER},
+        {"jit",      ENGINE_JIT},
+        {"verified", ENGINE_VERIFIED},
+        {"cached",   ENGINE_CACHED},
+        {"packed",   ENGINE_PACKED}
+};
+
+int engines_table_size = sizeof(engines_table) / sizeof(engines_table[0]);
+
+int engine_by_name(char const *name, vm_engine *engine)
+{
+        int i;
+
+        for(i = 0; i < engines_table_size; ++i) {
+                if(0 == strcmp(engines_table[i].name, name)) {
+                        *engine = engines_table[i].engine;
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+vm_status run_protected(void (*engine)())
+{
+        jmp_buf on_error;
+
+        vm_current->status = VM_OK;
+        vm_current->on_error = &on_error;
+        if(0 == setjmp(on_error)) {
+                engine();
+        }
+        vm_current->on_error = NULL;
+
+        if(NULL == vm_current->write) {
+                flush_output();
+        }
+
+        return vm_current->status;
+}
+
+vm_status run_engine(vm_engine engine)
+{
+        switch(engine) {
+        case ENGINE_THREADED:
+                return run_protected(run_threaded);
+
+        case ENGINE_REGISTER:
+                return run_protected(run_register);
+
+        case ENGINE_JIT:
+                return run_protected(run_jit);
+
+        case ENGINE_VERIFIED:
+                return run_protected(run_verified);
+
+        case ENGINE_CACHED:
+                return run_protected(run_cached);
+
+        case ENGINE_PACKED:
+                return run_protected(run_packed);
+
+        default:
+                return run_protected(run);
+        }
+}
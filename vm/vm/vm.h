@@ -1,88 +1,614 @@
-#ifndef _MILAN_VM_H
-#define _MILAN_VM_H
-
-#include <stdio.h>
-
-/*  */
-
-/*    */
-#define MAX_PROGRAM_SIZE        65536
-
-/*    */
-#define MAX_MEMORY_SIZE         65536
-
-/*   */
-#define MAX_STACK_SIZE          8192
-
-/*    */
-typedef enum {
-        NOP = 0,        /*   */
-        STOP,           /*  */
-        LOAD,           /*      */
-        STORE,          /*      */
-        BLOAD,          /*         */
-        BSTORE,         /*         */
-        PUSH,           /*     */
-        POP,            /*     */
-        DUP,            /*      */
-        INVERT,         /*       */
-        ADD,            /*  */
-        SUB,            /*  */
-        MULT,           /*  */
-        DIV,            /*   */
-        COMPARE,        /*  */
-        JUMP,           /*   */
-        JUMP_YES,       /*  ,      0 */
-        JUMP_NO,        /*  ,     0 */
-        INPUT,          /*       */
-        PRINT           /*       */
-} operation;
-
-/*   */
-typedef enum {
-        EQ,             /* =  */
-        NE,             /* !- */
-        LT,             /* <  */
-        GT,             /* >  */
-        LE,             /* <= */
-        GE              /* >= */
-} compare_type;
-
-/*     */
-typedef struct {
-        operation operation; /*   */
-        int arg;         /*  */
-} command;
-
-/*    */
-typedef struct opcode_info {
-        char *name;          /*    */
-        int need_arg;        /* ,  1,     */
-} opcode_info;
-
-/*       op.
- *  ,    
- * ,  .
- */
-
-opcode_info* operation_info(operation op);
-
-/*        address. */
-
-void put_command(unsigned int address, operation op, int arg);
-
-/*  .
- *
- *      0  ,
- *    STOP    
- *  .
- */
-
-void run();
-
-/*   value      address. */
-
-void set_mem(unsigned int address, int value);
-
-#endif
-
+#ifndef _MILAN_VM_H
+#define _MILAN_VM_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Константы */
+
+/* Размер памяти команд */
+#define MAX_PROGRAM_SIZE        65536
+
+/* Размер памяти данных по умолчанию (vm_context_set_memory()) */
+#define MAX_MEMORY_SIZE         65536
+
+/* Пределы размера памяти данных */
+#define MIN_MEMORY_SIZE         4096
+#define MEMORY_SIZE_LIMIT       0x40000000
+
+/* Размер стека */
+#define MAX_STACK_SIZE          8192
+
+/* Команды виртуальной машины */
+typedef enum {
+        NOP = 0,        /* Нет операции */
+        STOP,           /* Остановка */
+        LOAD,           /* Загрузка слова из памяти данных */
+        STORE,          /* Запись слова в память данных */
+        BLOAD,          /* Загрузка слова из памяти данных с учётом смещения */
+        BSTORE,         /* Запись слова в память данныз с учётом смещения */
+        PUSH,           /* Заталкивание слова в стек */
+        POP,            /* Выталкивание слова из стека */
+        DUP,            /* Дублирование слова на вершине стека */
+        INVERT,         /* Изменение знака числа на вершине стека */
+        ADD,            /* Сложение */
+        SUB,            /* Вычитание */
+        MULT,           /* Умножение */
+        DIV,            /* Целочисленное деление */
+        COMPARE,        /* Сравнение */
+        JUMP,           /* Безусловный переход */
+        JUMP_YES,       /* Условный переход, если на вершине стека не 0 */
+        JUMP_NO,        /* Условный переход, если на вершине стека 0 */
+        INPUT,          /* Чтение слова со стандартного устройства ввода */
+        PRINT           /* Запись слова на стандартное устройство вывода */
+} operation;
+
+/* Операции сравнения */
+typedef enum {
+        EQ,             /* =  */
+        NE,             /* !- */
+        LT,             /* <  */
+        GT,             /* >  */
+        LE,             /* <= */
+        GE              /* >= */
+} compare_type;
+
+/* Структура ячейки памяти команд */
+typedef struct {
+        operation operation; /* Код команды */
+        int arg;         /* Аргумент */
+} command;
+
+/* Информация о команде */
+typedef struct opcode_info {
+        char *name;          /* Текстовое представление команды */
+        int need_arg;        /* Признак, равный 1, если команде нужен аргумент */
+} opcode_info;
+
+/* Получение информации о команде с кодом op.
+ * Освобождать память, на которую указывает возвращаемый
+ * указатель, не нужно.
+ */
+
+opcode_info* operation_info(operation op);
+
+/* Запись команды в память команд по адресу address. */
+
+void put_command(unsigned int address, operation op, int arg);
+
+/* Запуск программы.
+ *
+ * Исполнение программы начинается с адреса 0 и заканчивается,
+ * когда встретится команда STOP или будет обнаружена ошибка
+ * времени исполнения.
+ */
+
+void run();
+
+/* Запись значения value в память данных по адресу address. */
+
+void set_mem(unsigned int address, int value);
+
+/* Размер памяти данных в словах (vm_context_set_memory()). Задаётся
+ * до загрузки программы. Возвращает 0, если размер вне допустимых
+ * пределов.
+ */
+
+int set_memory_size(unsigned int words);
+
+/* Загрузка программы из двоичного файла file (.mbc) в память команд
+ * и память данных. Возвращает 1, если программа загружена, 0, если file
+ * не является двоичным файлом программы, и -1, если файл повреждён или
+ * записан несовместимой версией (сообщение об ошибке уже выведено).
+ */
+
+int load_bytecode(char const *file);
+
+/* Загрузка программы из текстового файла file (.ms) или, если file
+ * равен NULL, со стандартного устройства ввода в память команд
+ * и память данных. Возвращает 1, если программа загружена, 0, если
+ * файл не удалось открыть, и -1 при ошибке в тексте программы
+ * (сообщение с номером строки уже выведено).
+ */
+
+int load_source(char const *file);
+
+/* Запись загруженной программы в двоичный файл file вместе с таблицей
+ * строк программы на Милане, если она есть у программы. Возвращает 0
+ * при ошибке записи.
+ */
+
+int save_bytecode(char const *file);
+
+/* Формат вывода команды PRINT */
+typedef enum {
+        OUTPUT_TEXT,            /* Десятичная запись числа и перевод строки */
+        OUTPUT_BINARY           /* 4 байта, младший байт первым */
+} output_format;
+
+/* Выбор потока для вывода команды PRINT: "stderr" (по умолчанию),
+ * "stdout" или имя файла. Возвращает 0, если файл не удалось открыть.
+ */
+
+int set_output(char const *name);
+
+/* Выбор формата вывода команды PRINT. */
+
+void set_output_format(output_format format);
+
+/* Запись накопленного вывода команды PRINT в выходной поток. Вызывается
+ * по окончании работы программы, перед вводом и перед сообщением
+ * об ошибке.
+ */
+
+void flush_output();
+
+/* Формат входных данных команды INPUT в неинтерактивном режиме */
+typedef enum {
+        INPUT_TEXT,             /* Десятичные числа, разделённые пробелами */
+        INPUT_BINARY            /* 4 байта на число, младший байт первым */
+} input_format;
+
+/* Неинтерактивный ввод команды INPUT из "stdin" или файла name:
+ * приглашение не выводится, данные читаются большими блоками.
+ * Возвращает 0, если файл не удалось открыть.
+ */
+
+int set_input(char const *name);
+
+/* Выбор формата входных данных. Включает неинтерактивный ввод
+ * со стандартного устройства ввода, если источник не выбран.
+ */
+
+void set_input_format(input_format format);
+
+/* Исполняющие ядра виртуальной машины */
+typedef enum {
+        ENGINE_SWITCH = 0,      /* Интерпретатор с разбором команд через switch */
+        ENGINE_THREADED,        /* Шитый код с переходами по адресам меток */
+        ENGINE_REGISTER,        /* Трёхадресная регистровая форма */
+        ENGINE_JIT,             /* Компиляция в машинный код x86-64 */
+        ENGINE_VERIFIED,        /* Интерпретатор без проверок для проверенных программ */
+        ENGINE_CACHED,          /* Интерпретатор с вершиной стека в регистрах */
+        ENGINE_PACKED           /* Интерпретатор упакованного кода */
+} vm_engine;
+
+/* Поиск ядра по его имени name.
+ * Возвращает 1 и записывает ядро в *engine, если имя известно,
+ * и 0 в противном случае.
+ */
+
+int engine_by_name(char const *name, vm_engine *engine);
+
+/* Результат загрузки и запуска программы */
+typedef enum {
+        VM_OK = 0,
+        VM_RUNTIME_ERROR,       /* Ошибка времени исполнения */
+        VM_LOAD_ERROR,          /* Файл не прочитан или программа записана с ошибкой */
+        VM_NO_MEMORY,           /* Не хватило памяти */
+        VM_YIELD,               /* Исполнено заданное число команд (vm_context_resume()) */
+        VM_WAIT_INPUT,          /* Команда INPUT ждёт данных (vm_context_resume()) */
+        VM_LIMIT                /* Исполнено больше команд, чем разрешено */
+} vm_status;
+
+/* Запуск программы на выбранном ядре. Все ядра дают одинаковый
+ * результат и диагностируют одни и те же ошибки времени исполнения.
+ * Возвращает VM_OK или VM_RUNTIME_ERROR; сообщение об ошибке
+ * выводится функцией print_error().
+ */
+
+vm_status run_engine(vm_engine engine);
+
+/* Вывод сообщения об ошибке последнего запуска и команды, на которой
+ * она произошла.
+ */
+
+void print_error(FILE *stream);
+
+/* Контекст виртуальной машины.
+ *
+ * Контекст содержит программу, память данных, стек и рабочие данные
+ * ядер, поэтому несколько программ можно исполнять одновременно
+ * в разных потоках, каждую в своём контексте. Функции выше работают
+ * с контекстом по умолчанию, общим для всего потока.
+ */
+typedef struct vm_context vm_context;
+
+/* Создание пустого контекста. Возвращает NULL, если не хватило памяти. */
+
+vm_context *vm_context_create();
+
+/* Удаление контекста и рабочих данных ядер */
+
+void vm_context_destroy(vm_context *vm);
+
+/* Загрузка программы из двоичного (.mbc) или текстового файла file.
+ * Прежняя программа и память данных контекста очищаются.
+ */
+
+vm_status vm_context_load(vm_context *vm, char const *file);
+
+/* Загрузка программы из памяти: length байт по адресу data содержат
+ * образ двоичного файла .mbc или текст программы. В остальном так же,
+ * как vm_context_load().
+ */
+
+vm_status vm_context_load_memory(vm_context *vm, void const *data, size_t length);
+
+/* Загрузка программы из count команд program, например созданных
+ * компилятором в том же процессе, без текста и файлов. Память данных
+ * очищается, как в vm_context_load().
+ */
+
+vm_status vm_context_load_program(vm_context *vm, command const *program,
+                                  unsigned int count);
+
+/* Использование программы контекста source без копирования: память
+ * команд становится общей, память данных копируется вместе с её
+ * размером. Контекст source должен существовать и не загружать новых
+ * программ, пока vm исполняет общую программу. Следующая загрузка в vm
+ * возвращает ему свою память команд. Возвращает VM_NO_MEMORY, если
+ * не хватило памяти под страницы памяти данных.
+ */
+
+vm_status vm_context_share(vm_context *vm, vm_context const *source);
+
+/* Размер памяти данных контекста vm: words слов, от MIN_MEMORY_SIZE
+ * до MEMORY_SIZE_LIMIT (по умолчанию MAX_MEMORY_SIZE). Обращение
+ * за её пределы - ошибка "illegal data address". Память выделяется
+ * страницами при первой записи, поэтому большой размер сам по себе
+ * памяти не требует. Задаётся до загрузки программы: всё, что лежит
+ * в памяти данных за первыми MIN_MEMORY_SIZE словами, теряется.
+ * Возвращает 0, если размер вне допустимых пределов.
+ */
+
+int vm_context_set_memory(vm_context *vm, unsigned int words);
+
+/* Функции ввода и вывода для команд INPUT и PRINT; data передаётся
+ * им первым аргументом. Функция ввода возвращает 1, если число
+ * прочитано, 0, если прочитать его не удалось (ошибка BAD_INPUT),
+ * и -1, если данных пока нет: при запуске vm_context_resume() команда
+ * INPUT тогда не исполняется, и запуск возвращает VM_WAIT_INPUT,
+ * в остальных случаях это ошибка BAD_INPUT. По умолчанию (NULL)
+ * используются стандартные потоки, которые нельзя использовать
+ * из нескольких потоков сразу.
+ */
+
+void vm_context_set_io(vm_context *vm, int (*read)(void *data, int *value),
+                       void (*write)(void *data, int value), void *data);
+
+/* Запуск программы контекста на ядре engine с пустым стеком и текущей
+ * памятью данных.
+ */
+
+vm_status vm_context_run(vm_context *vm, vm_engine engine);
+
+/* Продолжение исполнения программы контекста с команды, на которой
+ * оно остановилось (после загрузки - с адреса 0), интерпретатором
+ * run() не более чем на budget команд. Возвращает VM_YIELD, если
+ * исполнено budget команд, VM_WAIT_INPUT, если функция ввода сообщила,
+ * что данных нет (команда INPUT будет исполнена при следующем вызове),
+ * иначе - результат завершения программы.
+ */
+
+vm_status vm_context_resume(vm_context *vm, unsigned long budget);
+
+/* Запись состояния контекста в файл снимка: память команд, стек,
+ * номер следующей команды и ненулевые страницы памяти данных.
+ * Возвращает VM_LOAD_ERROR при ошибке записи.
+ */
+
+vm_status vm_context_save(vm_context *vm, char const *file);
+
+/* Восстановление состояния контекста из файла снимка. Программа
+ * продолжается с сохранённой команды функцией vm_context_resume().
+ */
+
+vm_status vm_context_restore(vm_context *vm, char const *file);
+
+/* Текст ошибки последнего запуска или NULL, если ошибки не было.
+ * Адрес команды с ошибкой записывается в *address, если address
+ * не NULL.
+ */
+
+char const *vm_context_error(vm_context const *vm, unsigned int *address);
+
+/* Планировщик: контексты исполняются по очереди квантами по budget
+ * команд в threads рабочих потоках, так что многие программы делят
+ * несколько потоков ОС. Команда INPUT без данных не блокирует поток:
+ * программа ждёт вне очереди, пока для неё не поступят данные.
+ */
+
+typedef struct vm_scheduler vm_scheduler;
+
+/* Создание планировщика с threads потоками. Возвращает NULL при
+ * нехватке памяти или ошибке создания потока.
+ */
+
+vm_scheduler *vm_scheduler_create(int threads, unsigned long budget);
+
+/* Наибольшее число команд одной задачи (0 - без ограничения, по
+ * умолчанию): исполнившая их задача завершается с результатом VM_LIMIT.
+ */
+
+void vm_scheduler_set_limit(vm_scheduler *scheduler, unsigned long limit);
+
+/* Постановка в очередь контекста vm с загруженной программой. Ввод
+ * контекста заменяется очередью чисел задачи, вывод остаётся прежним
+ * и вызывается из рабочих потоков. Контекст нельзя использовать, пока
+ * задача не завершилась. Возвращает номер задачи или -1 при нехватке
+ * памяти.
+ */
+
+int vm_scheduler_add(vm_scheduler *scheduler, vm_context *vm);
+
+/* Добавление count чисел в очередь ввода задачи task; ждущая ввода
+ * задача возвращается в очередь исполнения. Возвращает 0 при нехватке
+ * памяти.
+ */
+
+int vm_scheduler_input(vm_scheduler *scheduler, int task, int const *values,
+                       unsigned int count);
+
+/* Конец ввода задачи task: INPUT после последнего числа - ошибка
+ * BAD_INPUT.
+ */
+
+void vm_scheduler_close_input(vm_scheduler *scheduler, int task);
+
+/* Ожидание, пока все задачи не завершатся или не будут ждать ввода. */
+
+void vm_scheduler_wait(vm_scheduler *scheduler);
+
+/* Ожидание, пока задача task не завершится или не будет ждать ввода.
+ * Остальные задачи при этом продолжают исполняться.
+ */
+
+void vm_scheduler_wait_task(vm_scheduler *scheduler, int task);
+
+/* Состояние задачи task: результат завершения программы, VM_WAIT_INPUT,
+ * если она ждёт ввода, или VM_YIELD, если она ещё исполняется.
+ */
+
+vm_status vm_scheduler_status(vm_scheduler *scheduler, int task);
+
+/* Остановка потоков и освобождение планировщика. Незавершённые задачи
+ * остаются незавершёнными, контекстам возвращается стандартный ввод.
+ */
+
+void vm_scheduler_destroy(vm_scheduler *scheduler);
+
+/* Запуск программы на ядре с шитым кодом.
+ *
+ * Перед исполнением память команд переводится в массив адресов
+ * обработчиков, переход к следующей команде выполняется косвенным
+ * переходом (computed goto). Если компилятор не поддерживает адреса
+ * меток, используется обычный интерпретатор run().
+ */
+
+void run_threaded();
+
+/* Запуск программы на регистровом ядре.
+ *
+ * Перед исполнением каждый базовый блок переводится в трёхадресную
+ * форму: ячейки стека, заполняемые внутри блока, становятся регистрами,
+ * а LOAD и PUSH - операндами использующих их команд. Если глубины стека
+ * на входе в блок не хватает для исполнения блока без ошибок, блок
+ * исполняется интерпретатором run().
+ */
+
+void run_register();
+
+/* Запуск программы, скомпилированной в машинный код x86-64.
+ *
+ * Каждый базовый блок компилируется в отдельный участок машинного
+ * кода, команды INPUT и PRINT вызывают vm_read() и vm_write().
+ * Блоки, глубины стека на входе в которые не хватает, и команды,
+ * которые компилятор не поддерживает, исполняются интерпретатором
+ * run(). На других платформах используется ядро threaded.
+ */
+
+void run_jit();
+
+/* Запуск программы после проверки.
+ *
+ * Перед запуском для каждой команды вычисляется глубина стека и
+ * проверяются адреса LOAD, STORE и переходов. Если проверка прошла,
+ * программа исполняется интерпретатором, в котором нет проверок стека
+ * и этих адресов. Иначе в поток ошибок выводится причина, и программа
+ * исполняется интерпретатором run().
+ */
+
+void run_verified();
+
+/* Запуск программы на интерпретаторе с кэшированием вершины стека.
+ *
+ * Одно или два верхних слова стека хранятся в локальных переменных,
+ * для каждой команды есть отдельный обработчик для каждого числа
+ * кэшированных слов. Ошибки стека диагностируются так же, как в run().
+ */
+
+void run_cached();
+
+/* Запуск программы на интерпретаторе упакованного кода.
+ *
+ * Перед запуском память команд переводится в упакованный код: байт
+ * кода операции и непосредственный операнд переменной длины, команды
+ * без аргумента занимают один байт. Интерпретатор исполняет упакованный
+ * код без перевода обратно, ошибки диагностируются так же, как в run().
+ */
+
+void run_packed();
+
+/* Запуск программы с профилированием.
+ *
+ * Программа исполняется отдельным ядром с проверками, как в run(),
+ * которое считает исполнения каждой команды и каждого кода операции,
+ * переходы и проходы команд JUMP_YES и JUMP_NO и наибольшую глубину
+ * стека. По окончании программы (в том числе при ошибке) в stream
+ * записываются листинг со счётчиками на полях, таблица кодов операций
+ * и самые горячие циклы, найденные по обратным переходам. Листинг
+ * строится по тексту программы source или, если source равен NULL,
+ * по памяти команд. Возвращает VM_OK или VM_RUNTIME_ERROR.
+ */
+
+vm_status run_profile(FILE *stream, char const *source);
+
+/* Запуск программы на выбранном ядре с замером аппаратных счётчиков
+ * процессора (такты, команды, промахи предсказания переходов и кэша).
+ *
+ * По окончании программы печатаются значения счётчиков и их отношение
+ * к числу исполненных команд виртуальной машины, если ядро его считает
+ * (switch и verified). Если period не равен 0, программа исполняется
+ * ядром switch и через каждые period тактов отмечается код операции
+ * исполняемой команды; печатается распределение выборок по кодам.
+ * Возвращает VM_OK или VM_RUNTIME_ERROR.
+ */
+
+vm_status run_perf(vm_engine engine, unsigned long period);
+
+/* Запуск программы с выборочным профилем по строкам на Милане.
+ *
+ * Если timer равен 0, выборка делается через каждые interval команд
+ * виртуальной машины отдельным ядром; иначе - по сигналу таймера
+ * времени процессора через каждые interval микросекунд, программа
+ * исполняется ядром switch. Номера строк берутся из таблицы строк,
+ * загруженной с программой (комментарии "; line N", которые записывает
+ * компилятор Милана, или таблица строк .mbc); если её нет, выборки
+ * собираются по адресам команд. По окончании программы печатаются
+ * самые частые строки, а если folded не равен NULL, в файл folded
+ * записываются стеки (циклы программы и строка) для flamegraph.pl.
+ * Возвращает VM_OK, VM_RUNTIME_ERROR или VM_NO_MEMORY.
+ */
+
+vm_status run_sampled(unsigned long interval, int timer, char const *folded);
+
+/* Запуск программы с трассой исполнения.
+ *
+ * Перед каждой командой адрес, код операции и вершина стека
+ * записываются в кольцевой буфер на size последних команд (размер
+ * округляется вверх до степени двойки). При ошибке времени исполнения
+ * и по сигналу SIGUSR1 буфер записывается в двоичный файл file.
+ * Программа исполняется с проверками, как в run().
+ * Возвращает VM_OK, VM_RUNTIME_ERROR или VM_NO_MEMORY.
+ */
+
+vm_status run_trace(char const *file, unsigned long size);
+
+/* Исполнение программы до места снимка и запись снимка в файл file.
+ *
+ * Снимок делается перед первой командой INPUT, если at_input не равен
+ * 0, перед командой с адресом address (MAX_PROGRAM_SIZE - нет такого
+ * места) или по сигналу SIGUSR2, смотря что наступит раньше; после
+ * записи снимка программа не продолжается. Программа исполняется
+ * с проверками, как в run(). Возвращает VM_OK (в том числе если
+ * программа завершилась раньше), VM_RUNTIME_ERROR или VM_LOAD_ERROR
+ * при ошибке записи.
+ */
+
+vm_status run_checkpoint(char const *file, int at_input, unsigned int address);
+
+/* Восстановление состояния из снимка file и продолжение программы
+ * интерпретатором run() с сохранённой команды. Загружать программу
+ * не нужно. Возвращает VM_OK, VM_RUNTIME_ERROR или VM_LOAD_ERROR,
+ * если снимок не прочитан.
+ */
+
+vm_status run_restore(char const *file);
+
+/* Перевод файла трассы file в текст на стандартное устройство вывода.
+ * Если with_program не равен 0, для команд печатаются аргументы из
+ * загруженной программы. Возвращает 0, если файл не прочитан.
+ */
+
+int decode_trace(char const *file, int with_program);
+
+/* Замер времени исполнения программы всеми ядрами.
+ *
+ * Числа для команд INPUT заранее читаются со стандартного ввода,
+ * вывод программы не печатается. Каждое ядро исполняет программу
+ * runs раз, память данных перед каждым запуском восстанавливается.
+ */
+
+void bench_engines(int runs);
+
+/* Замер времени загрузки текстового файла file: runs загрузок
+ * загрузчиком load_source() и анализатором flex и bison, со сравнением
+ * загруженных программ. Возвращает 0, если программы различаются или
+ * файл не загружен.
+ */
+
+int bench_loaders(char const *file, int runs);
+
+/* Замер аппаратных счётчиков для каждого ядра в bench_engines() */
+
+void set_bench_perf(int enabled);
+
+/* Пакетное исполнение программы program для count входных файлов
+ * inputs в threads рабочих потоках (0 - по числу процессоров).
+ *
+ * Программа загружается и проверяется один раз, потоки используют
+ * общую память команд и собственные память данных и стек. Вывод
+ * каждого входного файла записывается в порядке inputs после строки
+ * "# имя файла", в конце печатается число программ и команд в секунду.
+ * Если budget не равен 0, у каждого входного файла свой контекст,
+ * и программы исполняются планировщиком по очереди квантами по budget
+ * команд, так что зациклившаяся программа не задерживает остальные.
+ * Запуск, исполнивший больше limit команд (0 - без ограничения),
+ * завершается ошибкой. Размер памяти данных - как у контекста
+ * по умолчанию. Возвращает 0, если все запуски завершились без ошибок.
+ */
+
+int run_batch(char const *program, char const **inputs, unsigned int count,
+              int threads, unsigned long budget, unsigned long limit, input_format format);
+
+/* Исполнение программы program для каждой строки файла input ("stdin" -
+ * стандартный ввод): строка - входные данные команд INPUT одного
+ * независимого запуска. Запуски исполняются группами по lanes дорожек
+ * (от 1 до 16) синхронно, векторными командами процессора; дорожка,
+ * на которой возникла ошибка или которой нужна память за первыми
+ * 4096 словами, продолжается интерпретатором с проверками. Вывод каждой
+ * строки записывается после строки "# номер строки", в конце печатается
+ * число запусков и команд в секунду. Возвращает 0, если все запуски
+ * завершились без ошибок.
+ */
+
+int run_lanes(char const *program, char const *input, int lanes);
+
+/* Сервер исполнения программ на локальном сокете Unix path.
+ *
+ * Запрос - одно соединение: строка "PROGRAM <длина> [text|binary]",
+ * за ней текст программы (или образ .mbc) и входные данные для команд
+ * INPUT до конца потока, или строка "HASH <хэш> [text|binary]" для
+ * программы из кэша и входные данные. Ответ - вывод команд PRINT
+ * по числу в строке между строками "# Program <хэш>" и "# OK <число
+ * команд>" или "# Error: <сообщение>". В кэше хранятся programs
+ * разобранных и проверенных программ, запросы исполняются в threads
+ * рабочих потоках (0 - по числу процессоров). Размер памяти данных
+ * программ - как у контекста по умолчанию. Запрос, исполнивший больше
+ * limit команд (0 - без ограничения), завершается ошибкой, а запрос,
+ * клиент которого закрыл соединение, - без ответа. Возвращает
+ * управление только при ошибке.
+ */
+
+int run_server(char const *path, int threads, unsigned int programs, unsigned long limit);
+
+/* Слияние частых последовательностей команд в суперкоманды перед
+ * запуском ядра threaded. Включено по умолчанию.
+ */
+
+void set_fusion(int enabled);
+
+/* Вывод отчёта о слиянии по окончании работы ядра threaded. */
+
+void set_fusion_stats(int enabled);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Пакетное исполнение программы с многими входными файлами.
+ *
+ * Программа загружается и проверяется один раз, рабочие потоки
+ * используют её память команд без копирования (vm_context_share()),
+ * у каждого потока свои память данных и стек. Входные файлы делятся
+ * между потоками поровну непрерывными диапазонами; поток, у которого
+ * задания кончились, забирает половину оставшегося диапазона у самого
+ * загруженного потока. Вывод каждого задания накапливается в памяти
+ * и записывается в порядке входных файлов по мере готовности.
+ *
+ * С ограничением числа команд (mvm --budget) у каждого задания свой
+ * контекст, и задания исполняются планировщиком (vm_schedule.c)
+ * квантами по очереди: долгие и зациклившиеся программы не задерживают
+ * остальные, а результат каждого задания записывается, как только
+ * завершились оно и все задания перед ним. Задание, исполнившее больше
+ * limit команд (mvm --limit), завершается ошибкой.
+ */
+
+#ifdef HAVE_PTHREAD
+#define LOCK(mutex)     pthread_mutex_lock(mutex)
+#define UNLOCK(mutex)   pthread_mutex_unlock(mutex)
+#else
+#define LOCK(mutex)
+#define UNLOCK(mutex)
+#endif
+
+/* Задание: исполнение программы с одним входным файлом */
+typedef struct {
+        char const *input;              /* Входной файл */
+        run_result result;
+        unsigned long instructions;     /* Число исполненных команд */
+        int done;
+        vm_context *vm;                 /* Контекст задания в планировщике */
+        int task;                       /* Номер задачи в планировщике */
+} batch_job;
+
+/* Рабочий поток */
+typedef struct {
+#ifdef HAVE_PTHREAD
+        pthread_t thread;
+        pthread_mutex_t lock;           /* Защищает next и end */
+#endif
+        unsigned int next;              /* Невыполненные задания [next, end) */
+        unsigned int end;
+        vm_context *vm;
+        batch_job *job;                 /* Исполняемое задание */
+        input_source source;
+} batch_worker;
+
+static batch_job *jobs;
+
+static batch_worker *workers;
+static int workers_count;
+
+/* Контекст с загруженной программой */
+static vm_context *master;
+static int verified;
+static input_format batch_format;
+static unsigned long batch_limit;
+
+/* Итоги записанных заданий */
+static unsigned long total_instructions;
+static unsigned int total_errors;
+
+#ifdef HAVE_PTHREAD
+/* Готовность заданий */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_signal = PTHREAD_COND_INITIALIZER;
+#endif
+
+static int batch_read(void *data, int *value)
+{
+        batch_worker *worker = data;
+
+        return read_input(&worker->source, value);
+}
+
+static void batch_write(void *data, int value)
+{
+        append_result(&((batch_worker *) data)->job->result, value);
+}
+
+static void scheduled_write(void *data, int value)
+{
+        append_result(&((batch_job *) data)->result, value);
+}
+
+/* Следующее задание потока self или -1, если заданий не осталось */
+static long take_job(batch_worker *self)
+{
+        batch_worker *victim;
+        unsigned int remaining;
+        unsigned int largest;
+        unsigned int half;
+        unsigned int start;
+        int i;
+
+        for(;;) {
+                LOCK(&self->lock);
+                if(self->next < self->end) {
+                        long index = self->next++;
+
+                        UNLOCK(&self->lock);
+                        return index;
+                }
+                UNLOCK(&self->lock);
+
+                /* Поиск потока с наибольшим остатком */
+                victim = NULL;
+                largest = 0;
+                for(i = 0; i < workers_count; ++i) {
+                        if(&workers[i] == self) {
+                                continue;
+                        }
+                        LOCK(&workers[i].lock);
+                        remaining = workers[i].end - workers[i].next;
+                        UNLOCK(&workers[i].lock);
+                        if(remaining > largest) {
+                                largest = remaining;
+                                victim = &workers[i];
+                        }
+                }
+
+                if(NULL == victim) {
+                        return -1;
+                }
+
+                /* Половина остатка с конца диапазона. Начало взятой части
+                 * запоминается под блокировкой жертвы: после неё конец
+                 * диапазона жертвы может сдвинуть другой поток.
+                 */
+                LOCK(&victim->lock);
+                remaining = victim->end - victim->next;
+                half = (remaining + 1) / 2;
+                victim->end -= half;
+                start = victim->end;
+                UNLOCK(&victim->lock);
+
+                LOCK(&self->lock);
+                self->next = start;
+                self->end = start + half;
+                UNLOCK(&self->lock);
+        }
+}
+
+/* Исполнение задания не более чем batch_limit команд */
+static void run_limited()
+{
+        unsigned long budget = (0 != batch_limit) ? batch_limit : ULONG_MAX;
+        int exceeded = verified ? run_unchecked_budget(budget) : run_budget(budget);
+
+        if(exceeded) {
+                vm_current->status = VM_LIMIT;
+        }
+}
+
+static void run_job(batch_worker *worker, batch_job *job)
+{
+        vm_context *vm = worker->vm;
+
+        vm->stack_pointer = 0;
+        vm->command_pointer = 0;
+        vm->instructions = 0;
+        worker->job = job;
+
+        if(!copy_memory(vm, master)) {
+                job->result.status = VM_NO_MEMORY;
+        }
+        else if(!open_input(&worker->source, job->input, batch_format)) {
+                job->result.status = VM_LOAD_ERROR;
+        }
+        else {
+                job->result.status = run_protected(run_limited);
+                close_input(&worker->source);
+                job->result.error = vm->error;
+                job->result.address = (VM_LIMIT == job->result.status) ?
+                        vm->command_pointer : vm->error_address;
+        }
+        job->instructions = vm->instructions;
+
+        LOCK(&done_lock);
+        job->done = 1;
+#ifdef HAVE_PTHREAD
+        pthread_cond_broadcast(&done_signal);
+#endif
+        UNLOCK(&done_lock);
+}
+
+static void *worker_main(void *data)
+{
+        batch_worker *worker = data;
+        long index;
+
+        vm_current = worker->vm;
+        while((index = take_job(worker)) >= 0) {
+                run_job(worker, &jobs[index]);
+        }
+
+        return NULL;
+}
+
+/* Запись результата задания в выходной поток */
+static void write_job(batch_job *job)
+{
+        write_result(&job->result, job->input);
+
+        /* Результат не ждёт в буфере конца пакета */
+        flush_output();
+
+        total_instructions += job->instructions;
+        total_errors += (VM_OK != job->result.status);
+}
+
+/* Передача входного файла задания в планировщик. Возвращает 0, если
+ * файл не прочитан.
+ */
+static int feed_input(vm_scheduler *scheduler, batch_job *job)
+{
+        input_source source;
+        int values[256];
+        unsigned int count = 0;
+        int ok = 1;
+
+        if(!open_input(&source, job->input, batch_format)) {
+                return 0;
+        }
+
+        /* Число, которое не удалось прочитать, - конец ввода */
+        while(ok && read_input(&source, &values[count])) {
+                if(++count == sizeof(values) / sizeof(values[0])) {
+                        ok = vm_scheduler_input(scheduler, job->task, values, count);
+                        count = 0;
+                }
+        }
+        if(ok && count > 0) {
+                ok = vm_scheduler_input(scheduler, job->task, values, count);
+        }
+        vm_scheduler_close_input(scheduler, job->task);
+        close_input(&source);
+
+        return ok;
+}
+
+/* Исполнение всех заданий планировщиком квантами по budget команд
+ * и запись их результатов по порядку
+ */
+static int run_scheduled(unsigned int count, int threads, unsigned long budget)
+{
+        vm_scheduler *scheduler = vm_scheduler_create(threads, budget);
+        unsigned int i;
+
+        if(NULL == scheduler) {
+                return 0;
+        }
+        vm_scheduler_set_limit(scheduler, batch_limit);
+
+        for(i = 0; i < count; ++i) {
+                batch_job *job = &jobs[i];
+
+                job->vm = vm_context_create();
+                if(NULL == job->vm || VM_OK != vm_context_share(job->vm, master)) {
+                        vm_context_destroy(job->vm);
+                        job->vm = NULL;
+                        job->result.status = VM_NO_MEMORY;
+                        continue;
+                }
+                vm_context_set_io(job->vm, NULL, scheduled_write, job);
+
+                job->task = vm_scheduler_add(scheduler, job->vm);
+                if(job->task < 0) {
+                        job->result.status = VM_NO_MEMORY;
+                }
+                else if(!feed_input(scheduler, job)) {
+                        job->result.status = VM_LOAD_ERROR;
+                }
+        }
+
+        for(i = 0; i < count; ++i) {
+                batch_job *job = &jobs[i];
+
+                if(NULL != job->vm && job->task >= 0) {
+                        vm_scheduler_wait_task(scheduler, job->task);
+
+                        /* Задание с непрочитанным файлом исполнилось без ввода */
+                        if(VM_LOAD_ERROR != job->result.status) {
+                                job->result.status = vm_scheduler_status(scheduler, job->task);
+                        }
+                        job->result.error = job->vm->error;
+                        job->result.address = (VM_LIMIT == job->result.status) ?
+                                job->vm->command_pointer : job->vm->error_address;
+                        job->instructions = job->vm->instructions;
+                }
+                job->done = 1;
+                write_job(job);
+        }
+
+        vm_scheduler_destroy(scheduler);
+        for(i = 0; i < count; ++i) {
+                vm_context_destroy(jobs[i].vm);
+                jobs[i].vm = NULL;
+        }
+
+        return 1;
+}
+
+int run_batch(char const *program, char const **inputs, unsigned int count,
+              int threads, unsigned long budget, unsigned long limit, input_format format)
+{
+        vm_context *previous = vm_current;
+        verify_result result;
+        unsigned int i;
+        double start;
+        double elapsed;
+
+        master = vm_context_create();
+        jobs = calloc(count > 0 ? count : 1, sizeof(batch_job));
+        if(threads <= 0) {
+#ifdef HAVE_PTHREAD
+                threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+                threads = (threads > 0) ? threads : 1;
+        }
+#ifndef HAVE_PTHREAD
+        threads = 1;
+#endif
+        workers = calloc(threads, sizeof(batch_worker));
+        if(NULL == master || NULL == jobs || NULL == workers) {
+                printf("Not enough memory\n");
+                return 1;
+        }
+
+        printf("Reading input from %s\n", program);
+        vm_context_set_memory(master, vm_memory_size);
+        if(VM_OK != vm_context_load(master, program)) {
+                printf("Unable to load %s\n", program);
+                return 1;
+        }
+
+        /* Проверка один раз для всех заданий */
+        vm_current = master;
+        verify_program(&result);
+        verified = (VERIFY_OK == result.status);
+        if(VERIFY_CONFLICT == result.status) {
+                fprintf(stderr, "Verification failed at %u: stack depth depends on the path, "
+                        "using checked engine\n", result.address);
+        }
+        else if(VERIFY_ERROR == result.status) {
+                fprintf(stderr, "Verification failed at %u: %s, using checked engine\n",
+                        result.address, vm_error_message(result.error));
+        }
+
+        batch_format = format;
+        batch_limit = limit;
+        total_instructions = 0;
+        total_errors = 0;
+        for(i = 0; i < count; ++i) {
+                jobs[i].input = inputs[i];
+        }
+
+        /* С ограничением числа команд задания исполняет планировщик */
+        workers_count = (0 != budget) ? 0 : threads;
+        for(i = 0; i < (unsigned int) workers_count; ++i) {
+                batch_worker *worker = &workers[i];
+
+                worker->vm = vm_context_create();
+                if(NULL == worker->vm || VM_OK != vm_context_share(worker->vm, master)) {
+                        printf("Not enough memory\n");
+                        return 1;
+                }
+                vm_context_set_io(worker->vm, batch_read, batch_write, worker);
+                worker->next = (unsigned int) ((unsigned long) count * i / threads);
+                worker->end = (unsigned int) ((unsigned long) count * (i + 1) / threads);
+#ifdef HAVE_PTHREAD
+                pthread_mutex_init(&worker->lock, NULL);
+#endif
+        }
+
+        start = wall_clock();
+
+        if(0 != budget) {
+                if(!run_scheduled(count, threads, budget)) {
+                        printf("Unable to start worker thread\n");
+                        exit(1);
+                }
+        }
+        else {
+#ifdef HAVE_PTHREAD
+                for(i = 0; i < (unsigned int) threads; ++i) {
+                        if(0 != pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+                                printf("Unable to start worker thread\n");
+                                exit(1);
+                        }
+                }
+#else
+                worker_main(&workers[0]);
+#endif
+
+                /* Вывод в порядке входных файлов по мере готовности */
+                for(i = 0; i < count; ++i) {
+                        LOCK(&done_lock);
+#ifdef HAVE_PTHREAD
+                        while(!jobs[i].done) {
+                                pthread_cond_wait(&done_signal, &done_lock);
+                        }
+#endif
+                        UNLOCK(&done_lock);
+
+                        write_job(&jobs[i]);
+                }
+        }
+
+#ifdef HAVE_PTHREAD
+        for(i = 0; i < (unsigned int) workers_count; ++i) {
+                pthread_join(workers[i].thread, NULL);
+        }
+#endif
+
+        elapsed = wall_clock() - start;
+        flush_output();
+
+        printf("Batch: %u inputs, %d threads, %u errors\n", count, threads, total_errors);
+        printf("Time: %.3f s, %.1f programs/s, %.0f instructions/s\n", elapsed,
+               (elapsed > 0) ? count / elapsed : 0.0,
+               (elapsed > 0) ? total_instructions / elapsed : 0.0);
+
+        for(i = 0; i < (unsigned int) workers_count; ++i) {
+                vm_context_destroy(workers[i].vm);
+        }
+        vm_current = previous;
+        vm_context_destroy(master);
+        free(workers);
+        free(jobs);
+
+        return total_errors > 0;
+}
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vm_internal.h"
+
+extern FILE *yyin;
+
+int yyparse();
+void yyrestart(FILE *file);
+
+/* Числа, заранее прочитанные для команд INPUT */
+static int *bench_input = NULL;
+static unsigned int bench_input_size = 0;
+static unsigned int bench_input_position = 0;
+
+/* Число выведенных значений и их контрольная сумма */
+static unsigned long bench_output_count;
+static unsigned long bench_output_sum;
+
+static int bench_perf = 0;
+
+void set_bench_perf(int enabled)
+{
+        bench_perf = enabled;
+}
+
+static int bench_read(void *data, int *value)
+{
+        if(bench_input_position < bench_input_size) {
+                *value = bench_input[bench_input_position++];
+                return 1;
+        }
+
+        return 0;
+}
+
+static void bench_write(void *data, int value)
+{
+        ++bench_output_count;
+        bench_output_sum = bench_output_sum * 31 + (unsigned int) value;
+}
+
+static void read_bench_input()
+{
+        unsigned int capacity = 0;
+        int n;
+
+        while(input_interactive ? 1 == scanf("%d", &n) : input_word(&n)) {
+                if(bench_input_size == capacity) {
+                        capacity = capacity ? 2 * capacity : 256;
+                        bench_input = realloc(bench_input, capacity * sizeof(int));
+                        if(NULL == bench_input) {
+                                milan_error("Not enough memory for benchmark input");
+                        }
+                }
+                bench_input[bench_input_size++] = n;
+        }
+}
+
+void bench_engines(int runs)
+{
+        perf_values *counters = NULL;
+        vm_context *memory_snapshot;
+        unsigned long instructions = 0;
+        double base = 0;
+        unsigned long base_sum = 0;
+        int i;
+        int r;
+
+        if(bench_perf) {
+                counters = calloc(engines_table_size, sizeof(perf_values));
+                if(NULL == counters || 0 == perf_open()) {
+                        printf("Performance counters are not supported\n");
+                        free(counters);
+                        counters = NULL;
+                }
+        }
+
+        read_bench_input();
+
+        /* Память данных перед первым запуском */
+        memory_snapshot = vm_context_create();
+        if(NULL == memory_snapshot || !copy_memory(memory_snapshot, vm_current)) {
+                milan_error("Not enough memory");
+        }
+
+        vm_current->read = bench_read;
+        vm_current->write = bench_write;
+
+        printf("%-10s %12s %12s %8s  %s\n", "Engine", "Total, s", "Run, ms", "Speedup", "Output");
+        for(i = 0; i < engines_table_size; ++i) {
+                clock_t ticks = 0;
+                double elapsed;
+
+                bench_output_count = 0;
+                bench_output_sum = 0;
+
+                /* Восстановление памяти в замер не входит */
+                for(r = 0; r < runs; ++r) {
+                        clock_t start;
+
+                        if(!copy_memory(vm_current, memory_snapshot)) {
+                                milan_error("Not enough memory");
+                        }
+                        vm_stack_pointer = 0;
+                        bench_input_position = 0;
+
+                        start = clock();
+                        if(NULL != counters) {
+                                perf_start();
+                        }
+                        if(VM_OK != run_engine(engines_table[i].engine)) {
+                                print_error(stderr);
+                                milan_error("VM error");
+                        }
+                        if(NULL != counters) {
+                                perf_values values;
+
+                                perf_stop(&values);
+                                perf_add(&counters[i], &values);
+                        }
+                        ticks += clock() - start;
+                }
+                elapsed = (double) ticks / CLOCKS_PER_SEC;
+
+                if(0 == i) {
+                        /* Ядро switch считает исполненные команды */
+                        base = elapsed;
+                        base_sum = bench_output_sum;
+                        instructions = vm_current->instructions * runs;
+                }
+
+                printf("%-10s %12.3f %12.3f %7.2fx  %lu values%s\n",
+                       engines_table[i].name, elapsed, 1000.0 * elapsed / runs,
+                       (elapsed > 0) ? base / elapsed : 0.0, bench_output_count / runs,
+                       (bench_output_sum == base_sum) ? "" : ", differs from switch");
+        }
+
+        if(NULL != counters) {
+                for(i = 0; i < engines_table_size; ++i) {
+                        printf("\n%s:\n", engines_table[i].name);
+                        write_perf_values(stdout, &counters[i], instructions);
+                }
+                perf_close();
+                free(counters);
+        }
+
+        vm_context_destroy(memory_snapshot);
+        vm_current->read = NULL;
+        vm_current->write = NULL;
+}
+
+/* Разбор текста программы из файла in в текущий контекст анализатором
+ * flex и bison. Анализатор хранит состояние в глобальных переменных,
+ * но запускается только из bench_loaders() и только в одном потоке.
+ */
+static void parse_program(FILE *in)
+{
+        jmp_buf on_error;
+
+        vm_current->on_error = &on_error;
+        if(0 == setjmp(on_error)) {
+                yyin = in;
+                yyrestart(in);
+                if(0 != yyparse()) {
+                        vm_current->status = VM_LOAD_ERROR;
+                }
+        }
+        vm_current->on_error = NULL;
+}
+
+/* Загрузка текстового файла file в контекст vm анализатором flex
+ * и bison, которым файлы загружались до load_source().
+ */
+static vm_status load_yacc(vm_context *vm, char const *file)
+{
+        vm_context *previous = vm_current;
+        FILE *in;
+
+        if(!begin_load(vm)) {
+                vm_current = previous;
+                return vm->status;
+        }
+        in = fopen(file, "rt");
+        if(NULL != in) {
+                parse_program(in);
+                fclose(in);
+        }
+        else {
+                vm->status = VM_LOAD_ERROR;
+        }
+
+        if(VM_OK != vm->status) {
+                clear_program();
+        }
+
+        vm_current = previous;
+        return vm->status;
+}
+
+/* Совпадение программ и памяти данных контекстов a и b */
+static int same_program(vm_context const *a, vm_context const *b)
+{
+        unsigned int count = memory_pages(a);
+        unsigned int i;
+
+        if(a->program_size != b->program_size || a->memory_size != b->memory_size ||
+           0 != memcmp(a->program, b->program, a->program_size * sizeof(command))) {
+                return 0;
+        }
+
+        for(i = 0; i < count; ++i) {
+                int const *page_a = memory_page(a, i);
+                int const *page_b = memory_page(b, i);
+
+                if((NULL == page_a) != (NULL == page_b)) {
+                        return 0;
+                }
+                if(NULL != page_a &&
+                   0 != memcmp(page_a, page_b, MEMORY_PAGE_SIZE * sizeof(int))) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+/* Время runs загрузок файла file загрузчиком load в контекст vm */
+static double time_loads(vm_status (*load)(vm_context *, char const *), vm_context *vm,
+                         char const *file, int runs)
+{
+        clock_t start = clock();
+        int r;
+
+        for(r = 0; r < runs; ++r) {
+                if(VM_OK != load(vm, file)) {
+                        return -1;
+                }
+        }
+
+        return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+int bench_loaders(char const *file, int runs)
+{
+        vm_context *text = vm_context_create();
+        vm_context *yacc = vm_context_create();
+        double text_time;
+        double yacc_time;
+        int same = 0;
+
+        if(NULL == text || NULL == yacc) {
+                milan_error("Not enough memory");
+        }
+        vm_context_set_memory(text, vm_current->memory_size);
+        vm_context_set_memory(yacc, vm_current->memory_size);
+
+        printf("%-10s %12s %12s %8s\n", "Loader", "Total, s", "Load, ms", "Speedup");
+
+        yacc_time = time_loads(load_yacc, yacc, file, runs);
+        if(yacc_time < 0) {
+                printf("%-10s %12s\n", "bison", "failed");
+        }
+        else {
+                printf("%-10s %12.3f %12.3f %7.2fx\n", "bison", yacc_time,
+                       1000.0 * yacc_time / runs, 1.0);
+        }
+
+        text_time = time_loads(vm_context_load, text, file, runs);
+        if(text_time < 0) {
+                printf("%-10s %12s\n", "text", "failed");
+        }
+        else {
+                printf("%-10s %12.3f %12.3f %7.2fx\n", "text", text_time,
+                       1000.0 * text_time / runs,
+                       (yacc_time > 0 && text_time > 0) ? yacc_time / text_time : 0.0);
+        }
+
+        if(yacc_time >= 0 && text_time >= 0) {
+                same = same_program(text, yacc);
+                printf("%u commands, programs %s\n", text->program_size,
+                       same ? "are the same" : "differ");
+        }
+
+        vm_context_destroy(text);
+        vm_context_destroy(yacc);
+
+        return same;
+}
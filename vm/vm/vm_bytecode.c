@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Двоичный формат программы (.mbc).
+ *
+ * Файл начинается с заголовка mbc_header, за которым следуют секции:
+ * команды (vm_program_size записей mbc_command), начальные значения
+ * памяти данных (data_count записей mbc_data) и необязательная таблица
+ * строк (номер строки программы на Милане для каждой команды из
+ * комментариев "; line N", 0 - нет сведений). Все числа - 32-разрядные,
+ * в порядке байтов процессора, записавшего файл, секции выровнены
+ * на 8 байт.
+ */
+
+#define MBC_MAGIC       "MVMB"
+#define MBC_VERSION     1
+
+typedef struct {
+        char magic[4];                  /* MBC_MAGIC */
+        unsigned int version;           /* MBC_VERSION */
+        unsigned int code_size;         /* Число команд */
+        unsigned int code_offset;       /* Смещение секции команд */
+        unsigned int data_count;        /* Число начальных значений памяти */
+        unsigned int data_offset;       /* Смещение секции памяти */
+        unsigned int lines_count;       /* 0 или code_size */
+        unsigned int lines_offset;      /* Смещение таблицы строк */
+} mbc_header;
+
+typedef struct {
+        int operation;
+        int arg;
+} mbc_command;
+
+typedef struct {
+        unsigned int address;
+        int value;
+} mbc_data;
+
+unsigned int align_offset(unsigned int offset, unsigned int alignment)
+{
+        return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/* Ненулевые слова памяти данных. Возвращает их число и, если data
+ * не NULL, записывает их в data.
+ */
+static unsigned int collect_data(mbc_data *data)
+{
+        unsigned int pages = memory_pages(vm_current);
+        unsigned int count = 0;
+        unsigned int page;
+        unsigned int i;
+
+        for(page = 0; page < pages; ++page) {
+                int const *words = memory_page(vm_current, page);
+
+                if(NULL == words) {
+                        continue;
+                }
+
+                for(i = 0; i < MEMORY_PAGE_SIZE; ++i) {
+                        if(0 != words[i]) {
+                                if(NULL != data) {
+                                        data[count].address = page * MEMORY_PAGE_SIZE + i;
+                                        data[count].value = words[i];
+                                }
+                                ++count;
+                        }
+                }
+        }
+
+        return count;
+}
+
+int save_bytecode(char const *file)
+{
+        static mbc_command code[MAX_PROGRAM_SIZE];
+        mbc_data *data;
+        char const zeros[SECTION_ALIGN] = { 0 };
+        mbc_header header;
+        unsigned int size = vm_program_size;
+        unsigned int data_count = 0;
+        unsigned int address;
+        unsigned int end;
+        FILE *out;
+        int ok;
+
+        for(address = 0; address < size; ++address) {
+                code[address].operation = vm_program[address].operation;
+                code[address].arg = vm_program[address].arg;
+        }
+
+        data_count = collect_data(NULL);
+        data = malloc(data_count * sizeof(mbc_data) + sizeof(mbc_data));
+        if(NULL == data) {
+                printf("Not enough memory to write %s\n", file);
+                return 0;
+        }
+        collect_data(data);
+
+        memcpy(header.magic, MBC_MAGIC, 4);
+        header.version = MBC_VERSION;
+        header.code_size = size;
+        header.code_offset = align_offset(sizeof(header), SECTION_ALIGN);
+        header.data_count = data_count;
+        header.data_offset = align_offset(header.code_offset + size * sizeof(mbc_command), SECTION_ALIGN);
+        header.lines_count = vm_source_lines_loaded ? size : 0;
+        header.lines_offset = align_offset(header.data_offset + data_count * sizeof(mbc_data), SECTION_ALIGN);
+
+        out = fopen(file, "wb");
+        if(NULL == out) {
+                printf("Unable to write %s\n", file);
+                free(data);
+                return 0;
+        }
+
+        end = sizeof(header);
+        ok = (1 == fwrite(&header, sizeof(header), 1, out));
+        ok = ok && (fwrite(zeros, 1, header.code_offset - end, out) == header.code_offset - end);
+        ok = ok && (fwrite(code, sizeof(mbc_command), size, out) == size);
+
+        end = header.code_offset + size * sizeof(mbc_command);
+        ok = ok && (fwrite(zeros, 1, header.data_offset - end, out) == header.data_offset - end);
+        ok = ok && (fwrite(data, sizeof(mbc_data), data_count, out) == data_count);
+
+        end = header.data_offset + data_count * sizeof(mbc_data);
+        ok = ok && (fwrite(zeros, 1, header.lines_offset - end, out) == header.lines_offset - end);
+        ok = ok && (fwrite(vm_source_line, sizeof(unsigned int), header.lines_count, out) ==
+                    header.lines_count);
+
+        ok = (0 == fclose(out)) && ok;
+        if(!ok) {
+                printf("Unable to write %s\n", file);
+        }
+
+        free(data);
+        return ok;
+}
+
+int section_fits(unsigned int offset, unsigned int count, unsigned int size, size_t length)
+{
+        return offset % SECTION_ALIGN == 0 && offset <= length &&
+               (size_t) count <= (length - offset) / size;
+}
+
+/* Перенос программы из образа файла в память команд и память данных */
+static int load_image(char const *file, unsigned char const *image, size_t length)
+{
+        mbc_header const *header = (mbc_header const *) image;
+        mbc_command const *code;
+        mbc_data const *data;
+        unsigned int i;
+
+        if(header->version != MBC_VERSION) {
+                printf("%s: unsupported bytecode version %u\n", file, header->version);
+                return -1;
+        }
+
+        if(header->code_size > MAX_PROGRAM_SIZE ||
+           !section_fits(header->code_offset, header->code_size, sizeof(mbc_command), length) ||
+           !section_fits(header->data_offset, header->data_count, sizeof(mbc_data), length) ||
+           (0 != header->lines_count && header->lines_count != header->code_size) ||
+           !section_fits(header->lines_offset, header->lines_count, sizeof(unsigned int), length)) {
+                printf("%s: corrupted bytecode file\n", file);
+                return -1;
+        }
+
+        code = (mbc_command const *) (image + header->code_offset);
+        data = (mbc_data const *) (image + header->data_offset);
+
+        for(i = 0; i < header->data_count; ++i) {
+                if(data[i].address >= vm_memory_size) {
+                        printf("%s: data address %u is outside data memory\n", file,
+                               data[i].address);
+                        return -1;
+                }
+        }
+
+        if(sizeof(command) == sizeof(mbc_command)) {
+                memcpy(vm_program, code, header->code_size * sizeof(mbc_command));
+        }
+        else {
+                for(i = 0; i < header->code_size; ++i) {
+                        vm_program[i].operation = (operation) code[i].operation;
+                        vm_program[i].arg = code[i].arg;
+                }
+        }
+        vm_program_size = header->code_size;
+
+        for(i = 0; i < header->data_count; ++i) {
+                unsigned int address = data[i].address;
+
+                STORE_WORD(vm_memory, address, data[i].value);
+        }
+
+        if(0 != header->lines_count) {
+                /* Без таблицы строк программа исполняется так же */
+                if(NULL == vm_source_line) {
+                        vm_source_line = malloc(MAX_PROGRAM_SIZE * sizeof(unsigned int));
+                }
+                if(NULL != vm_source_line) {
+                        memcpy(vm_source_line, image + header->lines_offset,
+                               header->lines_count * sizeof(unsigned int));
+                        vm_source_lines_loaded = 1;
+                }
+        }
+
+        return 1;
+}
+
+int load_bytecode_image(char const *name, void const *image, size_t length)
+{
+        if(length < sizeof(mbc_header) || 0 != memcmp(image, MBC_MAGIC, 4)) {
+                return 0;
+        }
+
+        return load_image(name, image, length);
+}
+
+int load_bytecode(char const *file)
+{
+        unsigned char *image;
+        size_t length;
+        int result;
+#ifdef HAVE_MMAP
+        struct stat info;
+        int fd = open(file, O_RDONLY);
+
+        if(fd < 0) {
+                return 0;
+        }
+
+        if(0 != fstat(fd, &info) || (size_t) info.st_size < sizeof(mbc_header)) {
+                close(fd);
+                return 0;
+        }
+
+        length = info.st_size;
+        image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(MAP_FAILED == image) {
+                return 0;
+        }
+#else
+        FILE *in = fopen(file, "rb");
+
+        if(NULL == in) {
+                return 0;
+        }
+
+        fseek(in, 0, SEEK_END);
+        length = ftell(in);
+        fseek(in, 0, SEEK_SET);
+        image = (length >= sizeof(mbc_header)) ? malloc(length) : NULL;
+        if(NULL == image || fread(image, 1, length, in) != length) {
+                free(image);
+                fclose(in);
+                return 0;
+        }
+        fclose(in);
+#endif
+
+        result = load_bytecode_image(file, image, length);
+
+#ifdef HAVE_MMAP
+        munmap(image, length);
+#else
+        free(image);
+#endif
+
+        return result;
+}
@@ -0,0 +1,430 @@
+#include "vm_internal.h"
+
+/* Интерпретатор с кэшированием вершины стека.
+ *
+ * Одно или два верхних слова стека хранятся в локальных переменных:
+ *
+ *      состояние 0 - все слова в vm_stack[0 .. sp);
+ *      состояние 1 - вершина в a, остальные в vm_stack[0 .. sp);
+ *      состояние 2 - вершина в a, следующее слово в b,
+ *                    остальные в vm_stack[0 .. sp).
+ *
+ * Глубина стека равна sp + состояние. Для каждой пары (команда, состояние)
+ * есть свой обработчик, поэтому ADD в состоянии 2 не обращается к памяти,
+ * а проверки стека сводятся к сравнению sp с константой.
+ */
+
+#define STATES  3
+
+/* Метка обработчика команды op в состоянии state */
+#define ON(op, state)   case (op) * STATES + (state)
+
+/* Выход с ошибкой: кэшированные слова возвращаются в стек */
+#define FAIL(error)                                                     \
+        do {                                                            \
+                flush(&sp, state, a, b);                                \
+                vm_stack_pointer = sp;                                  \
+                vm_command_pointer = cp;                                \
+                vm_error(error);                                        \
+                return;                                                 \
+        } while(0)
+
+/* Проверка, что в стеке есть слово, и загрузка вершины в a */
+#define FILL_TOP()                                                      \
+        do {                                                            \
+                if(0 == sp) {                                           \
+                        FAIL(STACK_EMPTY);                              \
+                }                                                       \
+                a = stack[--sp];                                        \
+                state = 1;                                              \
+        } while(0)
+
+/* Проверка, что в стек с state кэшированными словами можно положить слово */
+#define CHECK_PUSH(cached)                                              \
+        do {                                                            \
+                if(sp + (cached) >= MAX_STACK_SIZE) {                   \
+                        FAIL(STACK_OVERFLOW);                           \
+                }                                                       \
+        } while(0)
+
+/* Заталкивание слова в состояниях 0, 1 и 2 */
+#define PUSH_0(value)   a = (value); state = 1
+#define PUSH_1(value)   b = a; a = (value); state = 2
+#define PUSH_2(value)   stack[sp++] = b; b = a; a = (value)
+
+/* Выталкивание слова в переменную в состояниях 0, 1 и 2 */
+#define POP_0(var)                                                      \
+        do {                                                            \
+                if(0 == sp) {                                           \
+                        FAIL(STACK_EMPTY);                              \
+                }                                                       \
+                var = stack[--sp];                                      \
+        } while(0)
+#define POP_1(var)      var = a; state = 0
+#define POP_2(var)      var = a; a = b; state = 1
+
+/* Обработчики ADD, SUB и MULT: в состояниях 0 и 1 недостающие
+ * операнды загружаются из стека, после чего выполняется обработчик
+ * состояния 2.
+ */
+#define ARITHMETIC(op, expression)                                      \
+        ON(op, 0):                                                      \
+                FILL_TOP();                                             \
+                FALLTHROUGH;                                            \
+        ON(op, 1):                                                      \
+                if(0 == sp) {                                           \
+                        FAIL(STACK_EMPTY);                              \
+                }                                                       \
+                b = stack[--sp];                                        \
+                FALLTHROUGH;                                            \
+        ON(op, 2):                                                      \
+                a = (expression);                                       \
+                state = 1;                                              \
+                break
+
+static void flush(unsigned int *sp, int state, int a, int b)
+{
+        /* Кэшированные слова всегда помещаются в стек (CHECK_PUSH),
+         * проверки границы нужны только компилятору
+         */
+        if(state > 1 && *sp < MAX_STACK_SIZE) {
+                vm_stack[(*sp)++] = b;
+        }
+        if(state > 0 && *sp < MAX_STACK_SIZE) {
+                vm_stack[(*sp)++] = a;
+        }
+}
+
+static int compare(int left, int right, int relation)
+{
+        switch(relation) {
+        case EQ:
+                return left == right;
+
+        case NE:
+                return left != right;
+
+        case LT:
+                return left < right;
+
+        case GT:
+                return left > right;
+
+        case LE:
+                return left <= right;
+
+        default:
+                return left >= right;
+        }
+}
+
+void run_cached()
+{
+        command const *program = vm_program;
+        unsigned int size = vm_program_size;
+        int *memory = vm_memory;
+        unsigned int memory_size = vm_memory_size;
+        int *stack = vm_stack;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int cp = 0;
+        unsigned int address;
+        int state = 0;
+        int a = 0;
+        int b = 0;
+        int data;
+
+        while(cp < size) {
+                unsigned int arg = program[cp].arg;
+
+                switch((unsigned int) program[cp].operation * STATES + state) {
+                ON(NOP, 0):
+                ON(NOP, 1):
+                ON(NOP, 2):
+                        break;
+
+                ON(STOP, 0):
+                ON(STOP, 1):
+                ON(STOP, 2):
+                        flush(&sp, state, a, b);
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = cp;
+                        return;
+
+                ON(LOAD, 0):
+                        if(arg >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        CHECK_PUSH(0);
+                        PUSH_0(LOAD_WORD(memory, arg));
+                        break;
+
+                ON(LOAD, 1):
+                        if(arg >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        CHECK_PUSH(1);
+                        PUSH_1(LOAD_WORD(memory, arg));
+                        break;
+
+                ON(LOAD, 2):
+                        if(arg >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        CHECK_PUSH(2);
+                        PUSH_2(LOAD_WORD(memory, arg));
+                        break;
+
+                ON(STORE, 0):
+                        POP_0(data);
+                        goto store;
+
+                ON(STORE, 1):
+                        POP_1(data);
+                        goto store;
+
+                ON(STORE, 2):
+                        POP_2(data);
+                store:
+                        if(arg >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        STORE_WORD(memory, arg, data);
+                        break;
+
+                ON(BLOAD, 0):
+                        FILL_TOP();
+                        /* Переход к состоянию 1 */
+                        FALLTHROUGH;
+                ON(BLOAD, 1):
+                ON(BLOAD, 2):
+                        address = arg + a;
+                        if(address >= memory_size) {
+                                /* Вершина уже вытолкнута */
+                                a = b;
+                                --state;
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        a = LOAD_WORD(memory, address);
+                        break;
+
+                ON(BSTORE, 0):
+                        FILL_TOP();
+                        /* Переход к состоянию 1 */
+                        FALLTHROUGH;
+                ON(BSTORE, 1):
+                        if(0 == sp) {
+                                state = 0;
+                                FAIL(STACK_EMPTY);
+                        }
+                        b = stack[--sp];
+                        /* Переход к состоянию 2 */
+                        FALLTHROUGH;
+                ON(BSTORE, 2):
+                        address = arg + a;
+                        state = 0;
+                        if(address >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        STORE_WORD(memory, address, b);
+                        break;
+
+                ON(PUSH, 0):
+                        CHECK_PUSH(0);
+                        PUSH_0(arg);
+                        break;
+
+                ON(PUSH, 1):
+                        CHECK_PUSH(1);
+                        PUSH_1(arg);
+                        break;
+
+                ON(PUSH, 2):
+                        CHECK_PUSH(2);
+                        PUSH_2(arg);
+                        break;
+
+                ON(POP, 0):
+                        POP_0(data);
+                        break;
+
+                ON(POP, 1):
+                        state = 0;
+                        break;
+
+                ON(POP, 2):
+                        a = b;
+                        state = 1;
+                        break;
+
+                ON(DUP, 0):
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(sp >= MAX_STACK_SIZE) {
+                                FAIL(STACK_OVERFLOW);
+                        }
+                        a = b = stack[--sp];
+                        state = 2;
+                        break;
+
+                ON(DUP, 1):
+                        CHECK_PUSH(1);
+                        b = a;
+                        state = 2;
+                        break;
+
+                ON(DUP, 2):
+                        CHECK_PUSH(2);
+                        stack[sp++] = b;
+                        b = a;
+                        break;
+
+                ON(INVERT, 0):
+                        FILL_TOP();
+                        /* Переход к состоянию 1 */
+                        FALLTHROUGH;
+                ON(INVERT, 1):
+                ON(INVERT, 2):
+                        a = -a;
+                        break;
+
+                ARITHMETIC(ADD, b + a);
+                ARITHMETIC(SUB, b - a);
+                ARITHMETIC(MULT, b * a);
+
+                ON(DIV, 0):
+                        FILL_TOP();
+                        /* Переход к состоянию 1 */
+                        FALLTHROUGH;
+                ON(DIV, 1):
+                        if(0 == a) {
+                                FAIL(DIVISION_BY_ZERO);
+                        }
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(DIVISION_OVERFLOWS(stack[sp - 1], a)) {
+                                FAIL(DIVISION_OVERFLOW);
+                        }
+                        a = stack[--sp] / a;
+                        break;
+
+                ON(DIV, 2):
+                        if(0 == a) {
+                                FAIL(DIVISION_BY_ZERO);
+                        }
+                        if(DIVISION_OVERFLOWS(b, a)) {
+                                FAIL(DIVISION_OVERFLOW);
+                        }
+                        a = b / a;
+                        state = 1;
+                        break;
+
+                ON(COMPARE, 0):
+                        FILL_TOP();
+                        /* Переход к состоянию 1 */
+                        FALLTHROUGH;
+                ON(COMPARE, 1):
+                        if(arg > GE) {
+                                FAIL(BAD_RELATION);
+                        }
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        a = compare(stack[--sp], a, arg);
+                        break;
+
+                ON(COMPARE, 2):
+                        if(arg > GE) {
+                                FAIL(BAD_RELATION);
+                        }
+                        a = compare(b, a, arg);
+                        state = 1;
+                        break;
+
+                ON(JUMP, 0):
+                ON(JUMP, 1):
+                ON(JUMP, 2):
+                        if(arg >= MAX_PROGRAM_SIZE) {
+                                FAIL(BAD_CODE_ADDRESS);
+                        }
+                        cp = arg;
+                        continue;
+
+                ON(JUMP_YES, 0):
+                ON(JUMP_NO, 0):
+                        if(arg >= MAX_PROGRAM_SIZE) {
+                                FAIL(BAD_CODE_ADDRESS);
+                        }
+                        POP_0(data);
+                        goto branch;
+
+                ON(JUMP_YES, 1):
+                ON(JUMP_NO, 1):
+                        if(arg >= MAX_PROGRAM_SIZE) {
+                                FAIL(BAD_CODE_ADDRESS);
+                        }
+                        POP_1(data);
+                        goto branch;
+
+                ON(JUMP_YES, 2):
+                ON(JUMP_NO, 2):
+                        if(arg >= MAX_PROGRAM_SIZE) {
+                                FAIL(BAD_CODE_ADDRESS);
+                        }
+                        POP_2(data);
+                branch:
+                        if((0 != data) == (JUMP_YES == program[cp].operation)) {
+                                cp = arg;
+                                continue;
+                        }
+                        break;
+
+                ON(INPUT, 0):
+                        vm_command_pointer = cp;
+                        data = vm_read();
+                        CHECK_PUSH(0);
+                        PUSH_0(data);
+                        break;
+
+                ON(INPUT, 1):
+                        vm_command_pointer = cp;
+                        data = vm_read();
+                        CHECK_PUSH(1);
+                        PUSH_1(data);
+                        break;
+
+                ON(INPUT, 2):
+                        vm_command_pointer = cp;
+                        data = vm_read();
+                        CHECK_PUSH(2);
+                        PUSH_2(data);
+                        break;
+
+                ON(PRINT, 0):
+                        POP_0(data);
+                        vm_write(data);
+                        break;
+
+                ON(PRINT, 1):
+                        POP_1(data);
+                        vm_write(data);
+                        break;
+
+                ON(PRINT, 2):
+                        POP_2(data);
+                        vm_write(data);
+                        break;
+
+                default:
+                        FAIL(UNKNOWN_COMMAND);
+                }
+
+                ++cp;
+        }
+
+        /* Дальше в памяти команд только NOP */
+        flush(&sp, state, a, b);
+        vm_stack_pointer = sp;
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+}
@@ -0,0 +1,385 @@
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#define HAVE_SIGNALS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Снимок состояния виртуальной машины (mvm --checkpoint, --restore).
+ *
+ * Файл снимка начинается с заголовка snapshot_header, за которым
+ * следуют секции: команды (как в .mbc), стек, номера ненулевых страниц
+ * памяти данных и сами страницы по SNAPSHOT_PAGE слов. Страницы
+ * выровнены на 4096 байт, так что файл можно отобразить в память
+ * и копировать страницы прямо из отображения; нулевые страницы в файл
+ * не пишутся, размер памяти данных записан в заголовке. Числа
+ * 32-разрядные, кроме 64-разрядного числа исполненных команд
+ * в заголовке, и записаны в порядке байтов процессора, записавшего
+ * снимок.
+ */
+
+#define SNAPSHOT_MAGIC          "MVMS"
+#define SNAPSHOT_VERSION        2
+
+/* Страница памяти данных в снимке: число слов и выравнивание в файле */
+#define SNAPSHOT_PAGE           1024
+#define SNAPSHOT_PAGE_ALIGN     4096
+
+/* Число страниц снимка в странице памяти данных */
+#define SNAPSHOT_PAGES_PER_PAGE (MEMORY_PAGE_SIZE / SNAPSHOT_PAGE)
+
+typedef struct {
+        char magic[4];                  /* SNAPSHOT_MAGIC */
+        unsigned int version;           /* SNAPSHOT_VERSION */
+        unsigned int code_size;         /* Число команд */
+        unsigned int code_offset;       /* Смещение секции команд */
+        unsigned int stack_size;        /* Глубина стека */
+        unsigned int stack_offset;
+        unsigned int pages_count;       /* Число ненулевых страниц памяти */
+        unsigned int index_offset;      /* Смещение номеров страниц */
+        unsigned int pages_offset;      /* Смещение страниц */
+        unsigned int command_pointer;   /* Следующая команда */
+        unsigned long long instructions;        /* Исполнено до снимка */
+        unsigned int memory_size;       /* Размер памяти данных (с версии 2) */
+} snapshot_header;
+
+typedef struct {
+        int operation;
+        int arg;
+} snapshot_command;
+
+/* Признак сигнала SIGUSR2: снимок перед следующей командой */
+static volatile sig_atomic_t snapshot_requested = 0;
+
+/* Место снимка для run_until_snapshot() */
+static unsigned int snapshot_address;
+static int snapshot_at_input;
+static int snapshot_reached;
+
+/* Слова страницы снимка с номером page или NULL, если все они нулевые */
+static int const *snapshot_page(unsigned int page)
+{
+        int const *words = memory_page(vm_current, page / SNAPSHOT_PAGES_PER_PAGE);
+        unsigned int i;
+
+        if(NULL == words) {
+                return NULL;
+        }
+
+        words += (page % SNAPSHOT_PAGES_PER_PAGE) * SNAPSHOT_PAGE;
+        for(i = 0; i < SNAPSHOT_PAGE; ++i) {
+                if(0 != words[i]) {
+                        return words;
+                }
+        }
+
+        return NULL;
+}
+
+/* Запись нулевых байтов до смещения offset */
+static int pad_to(FILE *out, unsigned int *end, unsigned int offset)
+{
+        static char const zeros[SNAPSHOT_PAGE_ALIGN] = { 0 };
+        unsigned int length = offset - *end;
+
+        *end = offset;
+        return fwrite(zeros, 1, length, out) == length;
+}
+
+int save_snapshot(char const *file)
+{
+        static snapshot_command code[MAX_PROGRAM_SIZE];
+        unsigned int *pages;
+        snapshot_header header;
+        unsigned int size = vm_program_size;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int count = memory_pages(vm_current) * SNAPSHOT_PAGES_PER_PAGE;
+        unsigned int end;
+        unsigned int i;
+        FILE *out;
+        int ok;
+
+        for(i = 0; i < size; ++i) {
+                code[i].operation = vm_program[i].operation;
+                code[i].arg = vm_program[i].arg;
+        }
+
+        pages = malloc(count * sizeof(unsigned int));
+        if(NULL == pages) {
+                printf("Not enough memory to write %s\n", file);
+                return 0;
+        }
+
+        memset(&header, 0, sizeof(header));
+        for(i = 0; i < count; ++i) {
+                if(NULL != snapshot_page(i)) {
+                        pages[header.pages_count++] = i;
+                }
+        }
+
+        memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+        header.version = SNAPSHOT_VERSION;
+        header.code_size = size;
+        header.code_offset = align_offset(sizeof(header), SECTION_ALIGN);
+        header.stack_size = sp;
+        header.stack_offset = align_offset(header.code_offset + size * sizeof(snapshot_command),
+                                           SECTION_ALIGN);
+        header.index_offset = align_offset(header.stack_offset + sp * sizeof(int), SECTION_ALIGN);
+        header.pages_offset = align_offset(header.index_offset +
+                                           header.pages_count * sizeof(unsigned int),
+                                           SNAPSHOT_PAGE_ALIGN);
+        header.command_pointer = vm_command_pointer;
+        header.instructions = vm_current->instructions;
+        header.memory_size = vm_memory_size;
+
+        out = fopen(file, "wb");
+        if(NULL == out) {
+                printf("Unable to write %s\n", file);
+                free(pages);
+                return 0;
+        }
+
+        end = sizeof(header);
+        ok = (1 == fwrite(&header, sizeof(header), 1, out));
+        ok = ok && pad_to(out, &end, header.code_offset);
+        ok = ok && (fwrite(code, sizeof(snapshot_command), size, out) == size);
+        end += size * sizeof(snapshot_command);
+
+        ok = ok && pad_to(out, &end, header.stack_offset);
+        ok = ok && (fwrite(vm_stack, sizeof(int), sp, out) == sp);
+        end += sp * sizeof(int);
+
+        ok = ok && pad_to(out, &end, header.index_offset);
+        ok = ok && (fwrite(pages, sizeof(unsigned int), header.pages_count, out) ==
+                    header.pages_count);
+        end += header.pages_count * sizeof(unsigned int);
+
+        ok = ok && pad_to(out, &end, header.pages_offset);
+        for(i = 0; ok && i < header.pages_count; ++i) {
+                ok = (fwrite(snapshot_page(pages[i]), sizeof(int), SNAPSHOT_PAGE, out) ==
+                      SNAPSHOT_PAGE);
+        }
+
+        ok = (0 == fclose(out)) && ok;
+        if(!ok) {
+                printf("Unable to write %s\n", file);
+        }
+
+        free(pages);
+        return ok;
+}
+
+/* Перенос состояния из образа файла в текущий контекст */
+static int restore_image(char const *file, unsigned char const *image, size_t length)
+{
+        snapshot_header const *header = (snapshot_header const *) image;
+        snapshot_command const *code;
+        unsigned int const *pages;
+        int const *words;
+        unsigned int memory_size;
+        unsigned int i;
+
+        if(length < sizeof(snapshot_header) || 0 != memcmp(header->magic, SNAPSHOT_MAGIC, 4)) {
+                printf("%s is not a snapshot file\n", file);
+                return 0;
+        }
+        if(header->version < 1 || header->version > SNAPSHOT_VERSION) {
+                printf("%s: unsupported snapshot version %u\n", file, header->version);
+                return 0;
+        }
+
+        /* В снимках версии 1 память данных - MAX_MEMORY_SIZE слов */
+        memory_size = (header->version >= 2) ? header->memory_size : MAX_MEMORY_SIZE;
+
+        if(header->code_size > MAX_PROGRAM_SIZE || header->stack_size > MAX_STACK_SIZE ||
+           memory_size < MIN_MEMORY_SIZE || memory_size > MEMORY_SIZE_LIMIT ||
+           header->pages_count > (memory_size + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE ||
+           (header->command_pointer > header->code_size &&
+            MAX_PROGRAM_SIZE != header->command_pointer) ||
+           !section_fits(header->code_offset, header->code_size, sizeof(snapshot_command), length) ||
+           !section_fits(header->stack_offset, header->stack_size, sizeof(int), length) ||
+           !section_fits(header->index_offset, header->pages_count, sizeof(unsigned int), length) ||
+           !section_fits(header->pages_offset, header->pages_count,
+                         SNAPSHOT_PAGE * sizeof(int), length)) {
+                printf("%s: corrupted snapshot file\n", file);
+                return 0;
+        }
+
+        pages = (unsigned int const *) (image + header->index_offset);
+        for(i = 0; i < header->pages_count; ++i) {
+                if(pages[i] >= (memory_size + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE) {
+                        printf("%s: corrupted snapshot file\n", file);
+                        return 0;
+                }
+        }
+
+        code = (snapshot_command const *) (image + header->code_offset);
+        memset(vm_program, 0, vm_program_size * sizeof(command));
+        for(i = 0; i < header->code_size; ++i) {
+                vm_program[i].operation = (operation) code[i].operation;
+                vm_program[i].arg = code[i].arg;
+        }
+        vm_program_size = header->code_size;
+        vm_source_lines_loaded = 0;
+
+        memcpy(vm_stack, image + header->stack_offset, header->stack_size * sizeof(int));
+        vm_stack_pointer = header->stack_size;
+        vm_command_pointer = header->command_pointer;
+
+        clear_memory(vm_current);
+        vm_memory_size = memory_size;
+        words = (int const *) (image + header->pages_offset);
+        for(i = 0; i < header->pages_count; ++i) {
+                memcpy(memory_word(pages[i] * SNAPSHOT_PAGE), &words[i * SNAPSHOT_PAGE],
+                       SNAPSHOT_PAGE * sizeof(int));
+        }
+
+        vm_current->instructions = (unsigned long) header->instructions;
+        return 1;
+}
+
+int restore_snapshot(char const *file)
+{
+        unsigned char *image;
+        size_t length;
+        int result;
+#ifdef HAVE_MMAP
+        struct stat info;
+        int fd = open(file, O_RDONLY);
+
+        if(fd < 0 || 0 != fstat(fd, &info) || 0 == info.st_size) {
+                if(fd >= 0) {
+                        close(fd);
+                }
+                printf("Unable to read %s\n", file);
+                return 0;
+        }
+
+        length = info.st_size;
+        image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(MAP_FAILED == image) {
+                printf("Unable to read %s\n", file);
+                return 0;
+        }
+#else
+        FILE *in = fopen(file, "rb");
+
+        if(NULL == in) {
+                printf("Unable to read %s\n", file);
+                return 0;
+        }
+
+        fseek(in, 0, SEEK_END);
+        length = ftell(in);
+        fseek(in, 0, SEEK_SET);
+        image = malloc(length + 1);
+        if(NULL == image || fread(image, 1, length, in) != length) {
+                free(image);
+                fclose(in);
+                printf("Unable to read %s\n", file);
+                return 0;
+        }
+        fclose(in);
+#endif
+
+        result = restore_image(file, image, length);
+
+#ifdef HAVE_MMAP
+        munmap(image, length);
+#else
+        free(image);
+#endif
+
+        return result;
+}
+
+#ifdef HAVE_SIGNALS
+static void on_snapshot_signal(int signal)
+{
+        snapshot_requested = 1;
+}
+#endif
+
+/* Исполнение до места снимка, как в run() */
+static void run_until_snapshot()
+{
+        unsigned int size = vm_program_size;
+
+        vm_command_pointer = 0;
+        vm_current->instructions = 0;
+        while(vm_command_pointer < size) {
+                if(vm_command_pointer == snapshot_address || snapshot_requested ||
+                   (snapshot_at_input && INPUT == vm_program[vm_command_pointer].operation)) {
+                        snapshot_reached = 1;
+                        return;
+                }
+
+                ++vm_current->instructions;
+                if(!vm_run_command()) {
+                        return;
+                }
+        }
+
+        /* Дальше в памяти команд только NOP */
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+}
+
+vm_status run_checkpoint(char const *file, int at_input, unsigned int address)
+{
+        vm_status status;
+
+        snapshot_address = address;
+        snapshot_at_input = at_input;
+        snapshot_reached = 0;
+        snapshot_requested = 0;
+
+#ifdef HAVE_SIGNALS
+        signal(SIGUSR2, on_snapshot_signal);
+#endif
+        status = run_protected(run_until_snapshot);
+#ifdef HAVE_SIGNALS
+        signal(SIGUSR2, SIG_DFL);
+#endif
+
+        if(VM_OK != status) {
+                return status;
+        }
+
+        if(!snapshot_reached) {
+                printf("Program finished before the checkpoint, no snapshot written\n");
+                return VM_OK;
+        }
+
+        if(!save_snapshot(file)) {
+                return VM_LOAD_ERROR;
+        }
+        printf("Snapshot written to %s at %u after %lu instructions\n", file,
+               vm_command_pointer, vm_current->instructions);
+
+        return VM_OK;
+}
+
+/* Продолжение программы после restore_snapshot() */
+static void run_restored()
+{
+        run_budget(ULONG_MAX);
+}
+
+vm_status run_restore(char const *file)
+{
+        if(!restore_snapshot(file)) {
+                return VM_LOAD_ERROR;
+        }
+
+        return run_protected(run_restored);
+}
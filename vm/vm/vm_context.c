@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+/* Контексты виртуальной машины.
+ *
+ * Всё состояние машины хранится в структуре vm_context, ядра обращаются
+ * к нему через vm_current. Функции vm_context_* делают контекст текущим
+ * на время своей работы, поэтому в разных потоках одновременно могут
+ * исполняться программы разных контекстов. Ошибки не завершают процесс:
+ * vm_fail() возвращает управление в vm_context_load() или run_engine()
+ * через longjmp(), и они возвращают код результата.
+ */
+
+/* Программа контекста, в который ещё ничего не загружали. Она никогда
+ * не изменяется: перед загрузкой контекст получает свою память команд.
+ */
+static command empty_program[MAX_PROGRAM_SIZE];
+
+/* Память команд контекста по умолчанию, в который программы загружают
+ * mvm и ms2c.
+ */
+static command default_program[MAX_PROGRAM_SIZE];
+
+static vm_context default_context = {
+        .program = default_program,
+        .own_program = default_program,
+        .memory_size = MAX_MEMORY_SIZE
+};
+
+VM_THREAD_LOCAL vm_context *vm_current = &default_context;
+
+void *vm_allocate(size_t size)
+{
+        void *memory = calloc(1, size);
+
+        if(NULL == memory) {
+                vm_fail(VM_NO_MEMORY, "Not enough memory");
+        }
+
+        return memory;
+}
+
+void vm_fail(vm_status status, char const *message)
+{
+        vm_current->status = status;
+        if(NULL != vm_current->on_error) {
+                longjmp(*vm_current->on_error, 1);
+        }
+
+        /* Без milan_error(), чтобы библиотека не требовала её от программы */
+        if(VM_RUNTIME_ERROR == status) {
+                print_error(stderr);
+        }
+        fprintf(stderr, "%s", message);
+        exit(1);
+}
+
+vm_context *vm_context_create()
+{
+        vm_context *vm = calloc(1, sizeof(vm_context));
+
+        if(NULL != vm) {
+                vm->program = empty_program;
+                vm->memory_size = MAX_MEMORY_SIZE;
+        }
+
+        return vm;
+}
+
+void vm_context_destroy(vm_context *vm)
+{
+        if(NULL == vm) {
+                return;
+        }
+
+        release_memory(vm);
+        release_register(vm);
+        release_jit(vm);
+        release_trace(vm);
+        release_output(vm);
+        free(vm->own_program);
+        free(vm->source_line);
+        free(vm->fuse);
+        free(vm->verify);
+        free(vm->threaded);
+        free(vm->packed);
+        free(vm->profile);
+        free(vm->sample);
+        free(vm);
+}
+
+void clear_program()
+{
+        memset(vm_program, 0, vm_program_size * sizeof(command));
+        vm_program_size = 0;
+        vm_source_lines_loaded = 0;
+        clear_memory(vm_current);
+        vm_stack_pointer = 0;
+        vm_command_pointer = 0;
+}
+
+int begin_load(vm_context *vm)
+{
+        vm_current = vm;
+        vm->status = VM_OK;
+
+        if(NULL == vm->own_program) {
+                vm->own_program = calloc(MAX_PROGRAM_SIZE, sizeof(command));
+                if(NULL == vm->own_program) {
+                        /* Прежняя программа контекста больше не исполняется */
+                        vm->program = empty_program;
+                        vm->program_size = 0;
+                        clear_program();
+                        vm->status = VM_NO_MEMORY;
+                        return 0;
+                }
+                vm->program = vm->own_program;
+                vm->program_size = 0;
+        }
+        else if(vm->program != vm->own_program) {
+                /* Общая программа остаётся у её владельца */
+                vm->program = vm->own_program;
+                vm->program_size = MAX_PROGRAM_SIZE;
+        }
+
+        clear_program();
+        return 1;
+}
+
+/* Загрузка текста программы из файла file или, если text не NULL,
+ * из length байт по адресу text в текущий контекст.
+ */
+static void parse_text(char const *file, char const *text, size_t length)
+{
+        jmp_buf on_error;
+
+        vm_current->on_error = &on_error;
+        if(0 == setjmp(on_error)) {
+                int loaded = (NULL != text) ?
+                        (load_source_text("program", text, length) ? 1 : -1) :
+                        load_source(file);
+
+                if(loaded <= 0) {
+                        vm_current->status = VM_LOAD_ERROR;
+                }
+        }
+        vm_current->on_error = NULL;
+}
+
+/* Загрузка текста программы, если loaded (результат загрузки двоичного
+ * образа) равен 0, и возврат к контексту previous.
+ */
+static vm_status end_load(vm_context *vm, vm_context *previous, int loaded,
+                          char const *file, char const *text, size_t length)
+{
+        if(loaded < 0) {
+                vm->status = VM_LOAD_ERROR;
+        }
+        else if(0 == loaded) {
+                parse_text(file, text, length);
+        }
+
+        if(VM_OK != vm->status) {
+                clear_program();
+        }
+
+        vm_current = previous;
+        return vm->status;
+}
+
+vm_status vm_context_load(vm_context *vm, char const *file)
+{
+        vm_context *previous = vm_current;
+
+        if(!begin_load(vm)) {
+                vm_current = previous;
+                return vm->status;
+        }
+        return end_load(vm, previous, load_bytecode(file), file, NULL, 0);
+}
+
+vm_status vm_context_load_memory(vm_context *vm, void const *data, size_t length)
+{
+        vm_context *previous = vm_current;
+
+        if(!begin_load(vm)) {
+                vm_current = previous;
+                return vm->status;
+        }
+        return end_load(vm, previous, load_bytecode_image("program", data, length),
+                        NULL, (NULL != data) ? data : "", length);
+}
+
+vm_status vm_context_load_program(vm_context *vm, command const *program,
+                                  unsigned int count)
+{
+        vm_context *previous = vm_current;
+
+        if(!begin_load(vm)) {
+                vm_current = previous;
+                return vm->status;
+        }
+
+        if(count > MAX_PROGRAM_SIZE || (0 != count && NULL == program)) {
+                vm->status = VM_LOAD_ERROR;
+        }
+        else {
+                memcpy(vm_program, program, count * sizeof(command));
+                vm_program_size = count;
+        }
+
+        vm_current = previous;
+        return vm->status;
+}
+
+vm_status vm_context_share(vm_context *vm, vm_context const *source)
+{
+        vm->program = source->program;
+        vm->program_size = source->program_size;
+        vm->source_lines_loaded = 0;
+        vm->stack_pointer = 0;
+        vm->command_pointer = 0;
+
+        return copy_memory(vm, source) ? VM_OK : VM_NO_MEMORY;
+}
+
+int vm_context_set_memory(vm_context *vm, unsigned int words)
+{
+        if(words < MIN_MEMORY_SIZE || words > MEMORY_SIZE_LIMIT) {
+                return 0;
+        }
+
+        release_memory(vm);
+        vm->memory_size = words;
+        return 1;
+}
+
+int set_memory_size(unsigned int words)
+{
+        return vm_context_set_memory(&default_context, words);
+}
+
+void vm_context_set_io(vm_context *vm, int (*read)(void *data, int *value),
+                       void (*write)(void *data, int value), void *data)
+{
+        vm->read = read;
+        vm->write = write;
+        vm->io_data = data;
+}
+
+vm_status vm_context_run(vm_context *vm, vm_engine engine)
+{
+        vm_context *previous = vm_current;
+        vm_status status;
+
+        vm_current = vm;
+        vm_stack_pointer = 0;
+        status = run_engine(engine);
+        vm_current = previous;
+
+        return status;
+}
+
+/* Ядро для vm_context_resume() */
+static void run_slice()
+{
+        if(run_budget(vm_current->budget)) {
+                vm_current->status = VM_YIELD;
+        }
+}
+
+vm_status vm_context_resume(vm_context *vm, unsigned long budget)
+{
+        vm_context *previous = vm_current;
+        vm_status status;
+
+        vm_current = vm;
+        vm->budget = budget;
+        vm->resumable = 1;
+        status = run_protected(run_slice);
+        vm->resumable = 0;
+        if(VM_WAIT_INPUT == status) {
+                /* Команда INPUT не исполнена */
+                --vm->instructions;
+        }
+        vm_current = previous;
+
+        return status;
+}
+
+vm_status vm_context_save(vm_context *vm, char const *file)
+{
+        vm_context *previous = vm_current;
+        int saved;
+
+        vm_current = vm;
+        saved = save_snapshot(file);
+        vm_current = previous;
+
+        return saved ? VM_OK : VM_LOAD_ERROR;
+}
+
+vm_status vm_context_restore(vm_context *vm, char const *file)
+{
+        vm_context *previous = vm_current;
+
+        if(!begin_load(vm)) {
+                vm_current = previous;
+                return vm->status;
+        }
+
+        if(!restore_snapshot(file)) {
+                vm->status = VM_LOAD_ERROR;
+                clear_program();
+        }
+        vm_current = previous;
+
+        return vm->status;
+}
+
+char const *vm_context_error(vm_context const *vm, unsigned int *address)
+{
+        if(VM_RUNTIME_ERROR != vm->status) {
+                return NULL;
+        }
+
+        if(NULL != address) {
+                *address = vm->error_address;
+        }
+
+        return vm_error_message(vm->error);
+}
@@ -0,0 +1,274 @@
+#include "vm_internal.h"
+
+int fusion_enabled = 1;
+int fusion_stats = 0;
+
+/* Образец последовательности команд, заменяемой суперкомандой */
+typedef struct {
+        super_operation operation;      /* Суперкоманда */
+        char const *name;               /* Название для отчёта */
+        unsigned int length;            /* Число исходных команд */
+        operation sequence[4];          /* Исходные команды */
+} fusion_pattern;
+
+/* Образцы проверяются по порядку, поэтому более длинные идут первыми */
+static fusion_pattern patterns[] = {
+        {LOAD_PUSH_COMPARE_JUMP_YES, "LOAD PUSH COMPARE JUMP_YES", 4, {LOAD, PUSH, COMPARE, JUMP_YES}},
+        {LOAD_PUSH_COMPARE_JUMP_NO,  "LOAD PUSH COMPARE JUMP_NO",  4, {LOAD, PUSH, COMPARE, JUMP_NO}},
+        {LOAD_LOAD_COMPARE_JUMP_YES, "LOAD LOAD COMPARE JUMP_YES", 4, {LOAD, LOAD, COMPARE, JUMP_YES}},
+        {LOAD_LOAD_COMPARE_JUMP_NO,  "LOAD LOAD COMPARE JUMP_NO",  4, {LOAD, LOAD, COMPARE, JUMP_NO}},
+        {LOAD_LOAD_ADD_STORE,        "LOAD LOAD ADD STORE",        4, {LOAD, LOAD, ADD, STORE}},
+        {LOAD_LOAD_SUB_STORE,        "LOAD LOAD SUB STORE",        4, {LOAD, LOAD, SUB, STORE}},
+        {LOAD_LOAD_MULT_STORE,       "LOAD LOAD MULT STORE",       4, {LOAD, LOAD, MULT, STORE}},
+        {LOAD_PUSH_ADD_STORE,        "LOAD PUSH ADD STORE",        4, {LOAD, PUSH, ADD, STORE}},
+        {LOAD_PUSH_SUB_STORE,        "LOAD PUSH SUB STORE",        4, {LOAD, PUSH, SUB, STORE}},
+        {LOAD_PUSH_MULT_STORE,       "LOAD PUSH MULT STORE",       4, {LOAD, PUSH, MULT, STORE}},
+        {LOAD_LOAD_ADD,              "LOAD LOAD ADD",              3, {LOAD, LOAD, ADD}},
+        {LOAD_LOAD_SUB,              "LOAD LOAD SUB",              3, {LOAD, LOAD, SUB}},
+        {LOAD_LOAD_MULT,             "LOAD LOAD MULT",             3, {LOAD, LOAD, MULT}},
+        {LOAD_PUSH_ADD,              "LOAD PUSH ADD",              3, {LOAD, PUSH, ADD}},
+        {LOAD_PUSH_SUB,              "LOAD PUSH SUB",              3, {LOAD, PUSH, SUB}},
+        {LOAD_PUSH_MULT,             "LOAD PUSH MULT",             3, {LOAD, PUSH, MULT}},
+        {COMPARE_JUMP_YES,           "COMPARE JUMP_YES",           2, {COMPARE, JUMP_YES}},
+        {COMPARE_JUMP_NO,            "COMPARE JUMP_NO",            2, {COMPARE, JUMP_NO}},
+        {LOAD_STORE,                 "LOAD STORE",                 2, {LOAD, STORE}},
+        {PUSH_STORE,                 "PUSH STORE",                 2, {PUSH, STORE}}
+};
+
+static int patterns_count = sizeof(patterns) / sizeof(fusion_pattern);
+
+#define is_leader       (vm_current->fuse->is_leader)
+#define super_index     (vm_current->fuse->index)
+
+void set_fusion(int enabled)
+{
+        fusion_enabled = enabled;
+}
+
+void set_fusion_stats(int enabled)
+{
+        fusion_stats = enabled;
+}
+
+static int is_jump(operation op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op;
+}
+
+/* Проверка, что последовательность с адреса address совпадает
+ * с образцом и может быть слита: внутрь неё нет переходов,
+ * а все аргументы допустимы, так что суперкоманде остаётся
+ * проверять только стек. Адреса данных должны лежать в плотной
+ * странице памяти.
+ */
+static int pattern_matches(fusion_pattern const *pattern, unsigned int address)
+{
+        unsigned int i;
+
+        if(address + pattern->length > vm_program_size) {
+                return 0;
+        }
+
+        for(i = 0; i < pattern->length; ++i) {
+                command const *cmd = &vm_program[address + i];
+                unsigned int arg = cmd->arg;
+
+                if(cmd->operation != pattern->sequence[i]) {
+                        return 0;
+                }
+
+                if(i > 0 && is_leader[address + i]) {
+                        return 0;
+                }
+
+                switch(cmd->operation) {
+                case LOAD:
+                case STORE:
+                        if(arg >= DENSE_MEMORY_SIZE) {
+                                return 0;
+                        }
+                        break;
+
+                case COMPARE:
+                        if(arg > GE) {
+                                return 0;
+                        }
+                        break;
+
+                case JUMP_YES:
+                case JUMP_NO:
+                        if(arg >= MAX_PROGRAM_SIZE) {
+                                return 0;
+                        }
+                        break;
+
+                default:
+                        break;
+                }
+        }
+
+        return 1;
+}
+
+/* Запись аргументов слитых команд в суперкоманду */
+static void fuse_arguments(super_command *super, unsigned int address, unsigned int length)
+{
+        unsigned int i;
+        int operands = 0;
+
+        for(i = 0; i < length; ++i) {
+                command const *cmd = &vm_program[address + i];
+
+                switch(cmd->operation) {
+                case LOAD:
+                case PUSH:
+                        if(0 == operands++) {
+                                super->arg = cmd->arg;
+                        }
+                        else {
+                                super->arg2 = cmd->arg;
+                        }
+                        break;
+
+                case STORE:
+                case COMPARE:
+                        super->arg3 = cmd->arg;
+                        break;
+
+                case JUMP_YES:
+                case JUMP_NO:
+                        super->arg4 = cmd->arg;
+                        break;
+
+                default:
+                        break;
+                }
+        }
+}
+
+/* Перевод адреса перехода в индекс super_program */
+static int remap_target(unsigned int target)
+{
+        return (target < vm_program_size) ? super_index[target] : super_program_size;
+}
+
+void fuse_program()
+{
+        unsigned int size = vm_program_size;
+        unsigned int address;
+        unsigned int count = 0;
+        int i;
+
+        if(NULL == vm_current->fuse) {
+                vm_current->fuse = vm_allocate(sizeof(fuse_workspace));
+        }
+
+        for(address = 0; address < size; ++address) {
+                is_leader[address] = 0;
+        }
+
+        for(address = 0; address < size; ++address) {
+                unsigned int target = vm_program[address].arg;
+
+                if(is_jump(vm_program[address].operation) && target < size) {
+                        is_leader[target] = 1;
+                }
+        }
+
+        address = 0;
+        while(address < size) {
+                super_command *super = &super_program[count];
+                unsigned int length = 1;
+                operation op = vm_program[address].operation;
+
+                super->operation = op;
+                super->arg = vm_program[address].arg;
+                super->arg2 = super->arg3 = super->arg4 = 0;
+                super->address = address;
+
+                if((unsigned int) op > PRINT) {
+                        super->operation = UNKNOWN_OPERATION;
+                }
+                else if(is_jump(op) && (unsigned int) super->arg >= MAX_PROGRAM_SIZE) {
+                        super->operation = BAD_JUMP;
+                }
+                else if(fusion_enabled) {
+                        for(i = 0; i < patterns_count; ++i) {
+                                if(pattern_matches(&patterns[i], address)) {
+                                        super->operation = patterns[i].operation;
+                                        super->arg = 0;
+                                        fuse_arguments(super, address, patterns[i].length);
+                                        length = patterns[i].length;
+                                        break;
+                                }
+                        }
+                }
+
+                super_index[address] = count++;
+                address += length;
+        }
+
+        super_program_size = count;
+        super_program[count].operation = HALT;
+        super_program[count].arg = 0;
+        super_program[count].arg2 = super_program[count].arg3 = super_program[count].arg4 = 0;
+        super_program[count].address = MAX_PROGRAM_SIZE;
+
+        /* Цели переходов становятся индексами в super_program */
+        for(i = 0; i < (int) count; ++i) {
+                super_command *super = &super_program[i];
+
+                switch(super->operation) {
+                case JUMP:
+                case JUMP_YES:
+                case JUMP_NO:
+                        super->arg = remap_target(super->arg);
+                        break;
+
+                case COMPARE_JUMP_YES:
+                case COMPARE_JUMP_NO:
+                case LOAD_PUSH_COMPARE_JUMP_YES:
+                case LOAD_PUSH_COMPARE_JUMP_NO:
+                case LOAD_LOAD_COMPARE_JUMP_YES:
+                case LOAD_LOAD_COMPARE_JUMP_NO:
+                        super->arg4 = remap_target(super->arg4);
+                        break;
+
+                default:
+                        break;
+                }
+        }
+}
+
+void fusion_report(FILE *stream)
+{
+        unsigned long sites[SUPER_OPERATIONS_COUNT];
+        unsigned long dispatches = 0;
+        unsigned long instructions = 0;
+        unsigned int i;
+        int op;
+
+        for(op = 0; op < SUPER_OPERATIONS_COUNT; ++op) {
+                sites[op] = 0;
+        }
+
+        for(i = 0; i < super_program_size; ++i) {
+                ++sites[super_program[i].operation];
+        }
+
+        for(op = 0; op < SUPER_OPERATIONS_COUNT; ++op) {
+                dispatches += super_hits[op];
+                if(op != HALT) {
+                        instructions += super_hits[op];
+                }
+        }
+
+        fprintf(stream, "%-28s %8s %14s\n", "Superinstruction", "Sites", "Executed");
+        for(i = 0; i < (unsigned int) patterns_count; ++i) {
+                op = patterns[i].operation;
+                instructions += super_hits[op] * (patterns[i].length - 1);
+                fprintf(stream, "%-28s %8lu %14lu\n", patterns[i].name, sites[op], super_hits[op]);
+        }
+
+        fprintf(stream, "Instructions: %lu, dispatches: %lu\n", instructions, dispatches);
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#define HAVE_PTHREAD
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Неинтерактивный ввод команды INPUT.
+ *
+ * Входной файл отображается в память целиком (если это обычный файл)
+ * или читается блоками по INPUT_BLOCK_SIZE байт, числа разбираются без
+ * обращения к scanf(), приглашение не выводится. Ошибка разбора или
+ * конец входных данных приводят к ошибке BAD_INPUT для команды INPUT,
+ * которая пыталась прочитать число.
+ */
+
+/* Источник для mvm --input; stream == NULL - интерактивный ввод */
+static input_source standard_input;
+
+#ifdef HAVE_PTHREAD
+/* Источник общий для всех контекстов без функции ввода, поэтому числа
+ * из него читаются по одному.
+ */
+static pthread_mutex_t standard_input_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int input_interactive = 1;
+
+int open_input(input_source *source, char const *name, input_format format)
+{
+        FILE *stream;
+
+        if(0 == strcmp(name, "stdin")) {
+                stream = stdin;
+        }
+        else {
+                stream = fopen(name, "rb");
+                if(NULL == stream) {
+                        return 0;
+                }
+        }
+
+        source->stream = stream;
+        source->format = format;
+        source->position = source->end = source->block;
+        source->mapping = NULL;
+        source->mapping_length = 0;
+
+#ifdef HAVE_MMAP
+        if(stdin != stream) {
+                struct stat info;
+
+                if(0 == fstat(fileno(stream), &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+                        void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+                                             fileno(stream), 0);
+
+                        if(MAP_FAILED != mapping) {
+                                source->mapping = mapping;
+                                source->mapping_length = info.st_size;
+                                source->position = mapping;
+                                source->end = source->position + info.st_size;
+                        }
+                }
+        }
+#endif
+
+        return 1;
+}
+
+void open_input_memory(input_source *source, void const *data, size_t length,
+                       input_format format)
+{
+        source->stream = NULL;
+        source->format = format;
+        source->position = data;
+        source->end = source->position + length;
+        source->mapping = NULL;
+        source->mapping_length = 0;
+}
+
+void close_input(input_source *source)
+{
+#ifdef HAVE_MMAP
+        if(NULL != source->mapping) {
+                munmap(source->mapping, source->mapping_length);
+        }
+#endif
+        if(NULL != source->stream && stdin != source->stream) {
+                fclose(source->stream);
+        }
+
+        source->stream = NULL;
+        source->mapping = NULL;
+        source->position = source->end = source->block;
+}
+
+int set_input(char const *name)
+{
+        close_input(&standard_input);
+        if(!open_input(&standard_input, name, standard_input.format)) {
+                return 0;
+        }
+
+        input_interactive = 0;
+        return 1;
+}
+
+void set_input_format(input_format format)
+{
+        standard_input.format = format;
+        if(NULL == standard_input.stream) {
+                set_input("stdin");
+        }
+}
+
+/* Чтение следующего блока. Возвращает 0 в конце входных данных. */
+static int refill(input_source *source)
+{
+        size_t length;
+
+        if(NULL != source->mapping || NULL == source->stream) {
+                return 0;
+        }
+
+        length = fread(source->block, 1, INPUT_BLOCK_SIZE, source->stream);
+        source->position = source->block;
+        source->end = source->block + length;
+        return length > 0;
+}
+
+/* Следующий байт входных данных или -1 в конце */
+#define NEXT_BYTE()     ((source->position < source->end || refill(source)) ? \
+                         *source->position++ : -1)
+
+/* Следующий байт без его извлечения или -1 в конце */
+#define PEEK_BYTE()     ((source->position < source->end || refill(source)) ? \
+                         *source->position : -1)
+
+static int is_space(int c)
+{
+        return ' ' == c || '\n' == c || '\t' == c || '\r' == c || '\v' == c || '\f' == c;
+}
+
+int read_input(input_source *source, int *value)
+{
+        unsigned int result = 0;
+        int negative = 0;
+        int c;
+
+        if(INPUT_BINARY == source->format) {
+                int i;
+
+                for(i = 0; i < 4; ++i) {
+                        c = NEXT_BYTE();
+                        if(c < 0) {
+                                return 0;
+                        }
+                        result |= (unsigned int) c << (8 * i);
+                }
+
+                *value = (int) result;
+                return 1;
+        }
+
+        do {
+                c = NEXT_BYTE();
+        } while(is_space(c));
+
+        if('-' == c || '+' == c) {
+                negative = ('-' == c);
+                c = NEXT_BYTE();
+        }
+
+        if(c < '0' || c > '9') {
+                return 0;
+        }
+
+        result = c - '0';
+        while((c = PEEK_BYTE()) >= '0' && c <= '9') {
+                result = result * 10 + (c - '0');
+                ++source->position;
+        }
+
+        *value = (int) (negative ? 0u - result : result);
+        return 1;
+}
+
+int input_word(int *value)
+{
+        int result;
+
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&standard_input_lock);
+#endif
+        result = read_input(&standard_input, value);
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&standard_input_lock);
+#endif
+
+        return result;
+}
@@ -0,0 +1,647 @@
+#ifndef _MILAN_VM_INTERNAL_H
+#define _MILAN_VM_INTERNAL_H
+
+#include <limits.h>
+#include <setjmp.h>
+#include "vm.h"
+
+/* Внутреннее состояние виртуальной машины, общее для всех
+ * исполняющих ядер. Вне виртуальной машины не используется.
+ */
+
+/* Ошибки времени исполнения */
+typedef enum {
+        BAD_DATA_ADDRESS,
+        BAD_CODE_ADDRESS,
+        BAD_RELATION,
+        STACK_OVERFLOW,
+        STACK_EMPTY,
+        DIVISION_BY_ZERO,
+        BAD_INPUT,
+        UNKNOWN_COMMAND,
+        DIVISION_OVERFLOW
+} runtime_error;
+
+/* Частное dividend / divisor не помещается в int (INT_MIN / -1) */
+#define DIVISION_OVERFLOWS(dividend, divisor)   (-1 == (divisor) && INT_MIN == (dividend))
+
+/* Память данных: плотная страница в контексте и страницы по
+ * MEMORY_PAGE_SIZE слов, выделяемые при первой записи (vm_memory.c).
+ */
+#define MEMORY_PAGE_BITS        12
+#define MEMORY_PAGE_SIZE        (1 << MEMORY_PAGE_BITS)
+#define DENSE_MEMORY_SIZE       MIN_MEMORY_SIZE
+
+/* Переменная, своя для каждого потока */
+#ifdef __GNUC__
+#define VM_THREAD_LOCAL __thread
+#else
+#define VM_THREAD_LOCAL _Thread_local
+#endif
+
+/* Намеренный переход к следующей метке case */
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define FALLTHROUGH     __attribute__((fallthrough))
+#else
+#define FALLTHROUGH     ((void) 0)
+#endif
+
+/* Рабочие данные ядер. Создаются при первом запуске ядра в контексте
+ * и освобождаются вместе с ним.
+ */
+typedef struct fuse_workspace fuse_workspace;
+typedef struct verify_workspace verify_workspace;
+typedef struct threaded_workspace threaded_workspace;
+typedef struct packed_workspace packed_workspace;
+typedef struct register_workspace register_workspace;
+typedef struct jit_workspace jit_workspace;
+typedef struct profile_workspace profile_workspace;
+typedef struct sample_workspace sample_workspace;
+typedef struct trace_workspace trace_workspace;
+
+/* Буфер вывода команды PRINT в стандартный поток (vm_output.c) */
+typedef struct output_buffer output_buffer;
+
+/* Контекст виртуальной машины: программа, память, стек и всё, что
+ * нужно ядрам для её исполнения.
+ */
+struct vm_context {
+        /* Память команд: own_program, программа другого контекста,
+         * общая с ним (vm_context_share()), или пустая программа
+         * из одних NOP, если контекст ещё ничего не загружал.
+         */
+        command *program;
+
+        /* Своя память команд из MAX_PROGRAM_SIZE команд. Выделяется
+         * при первой загрузке программы в контекст, поэтому контексты,
+         * которые только используют чужую программу, её не занимают.
+         */
+        command *own_program;
+
+        /* Адрес, следующий за последней записанной командой. За ним
+         * в памяти команд находятся только команды NOP.
+         */
+        unsigned int program_size;
+
+        /* Номера строк программы на Милане для каждой команды
+         * (0 - неизвестен). Заполняются при загрузке текста
+         * с комментариями "; line N" и двоичного файла с таблицей строк.
+         */
+        unsigned int *source_line;
+        int source_lines_loaded;
+
+        /* Память данных из memory_size слов. Первые DENSE_MEMORY_SIZE
+         * слов (плотная страница) лежат в memory, остальные - в pages:
+         * pages[i] - страница с адресами от i * MEMORY_PAGE_SIZE или NULL,
+         * если в неё ничего не записывали. pages[0] не используется.
+         */
+        int memory[DENSE_MEMORY_SIZE];
+        int **pages;
+        unsigned int memory_size;
+
+        int stack[MAX_STACK_SIZE];
+
+        unsigned int stack_pointer;
+        unsigned int command_pointer;
+
+        /* Ввод и вывод; NULL - стандартные потоки */
+        int (*read)(void *data, int *value);
+        void (*write)(void *data, int value);
+        void *io_data;
+
+        /* Вывод в стандартный поток, накопленный этим контекстом.
+         * Выделяется при первом выводе.
+         */
+        output_buffer *output;
+
+        /* Число команд, исполненных последним запуском ядер switch
+         * и verified.
+         */
+        unsigned long instructions;
+
+        /* Запуск vm_context_resume(): остаток команд и признак того,
+         * что INPUT может ждать данных.
+         */
+        unsigned long budget;
+        int resumable;
+
+        /* Результат последней загрузки или запуска */
+        vm_status status;
+        runtime_error error;            /* Ошибка при VM_RUNTIME_ERROR */
+        unsigned int error_address;     /* Адрес команды с ошибкой */
+
+        /* Точка возврата из vm_fail(); NULL вне загрузки и запуска */
+        jmp_buf *on_error;
+
+        fuse_workspace *fuse;
+        verify_workspace *verify;
+        threaded_workspace *threaded;
+        packed_workspace *packed;
+        register_workspace *register_form;
+        jit_workspace *jit;
+        profile_workspace *profile;
+        sample_workspace *sample;
+        trace_workspace *trace;
+};
+
+/* Контекст, с которым работают ядра и функции загрузки в текущем
+ * потоке. Вне vm_context_load() и vm_context_run() - контекст
+ * по умолчанию, с которым работают mvm и ms2c.
+ */
+extern VM_THREAD_LOCAL vm_context *vm_current;
+
+#define vm_program              (vm_current->program)
+#define vm_program_size         (vm_current->program_size)
+#define vm_source_line          (vm_current->source_line)
+#define vm_source_lines_loaded  (vm_current->source_lines_loaded)
+#define vm_memory               (vm_current->memory)
+#define vm_memory_size          (vm_current->memory_size)
+#define vm_stack                (vm_current->stack)
+#define vm_stack_pointer        (vm_current->stack_pointer)
+#define vm_command_pointer      (vm_current->command_pointer)
+
+/* Выделение обнулённой памяти под рабочие данные ядра. При нехватке
+ * памяти загрузка или запуск завершается с результатом VM_NO_MEMORY.
+ */
+
+void *vm_allocate(size_t size);
+
+/* Завершение загрузки или запуска с результатом status (не VM_OK).
+ * Вне vm_context_load() и run_engine() выводит сообщение message
+ * (при VM_RUNTIME_ERROR - и сообщение об ошибке) и завершает работу.
+ */
+
+void vm_fail(vm_status status, char const *message);
+
+/* Адрес слова памяти данных текущего контекста (address меньше
+ * vm_memory_size). Выделяет страницу слова, если её ещё нет, поэтому
+ * адрес не меняется до очистки памяти.
+ */
+
+int *memory_word(unsigned int address);
+
+/* Память данных за плотной страницей: address не меньше
+ * DENSE_MEMORY_SIZE и меньше vm_memory_size. Слова страниц, в которые
+ * ничего не записывали, читаются как 0; первая запись в страницу
+ * выделяет её. Функции встраиваются в ядра, так как обращения
+ * за плотную страницу в программах с большими массивами часты.
+ */
+
+static inline int load_paged(unsigned int address)
+{
+        int const *page;
+
+        if(NULL == vm_current->pages) {
+                return 0;
+        }
+
+        page = vm_current->pages[address >> MEMORY_PAGE_BITS];
+        return (NULL != page) ? page[address & (MEMORY_PAGE_SIZE - 1)] : 0;
+}
+
+static inline void store_paged(unsigned int address, int word)
+{
+        int *page = (NULL != vm_current->pages) ?
+                vm_current->pages[address >> MEMORY_PAGE_BITS] : NULL;
+
+        if(NULL != page) {
+                page[address & (MEMORY_PAGE_SIZE - 1)] = word;
+        }
+        else {
+                *memory_word(address) = word;
+        }
+}
+
+/* Чтение и запись слова по адресу, уже проверенному на выход за
+ * пределы памяти; memory - vm_memory. Плотная страница читается
+ * напрямую.
+ */
+#define LOAD_WORD(memory, address)                                      \
+        (((address) < DENSE_MEMORY_SIZE) ? (memory)[address] : load_paged(address))
+
+#define STORE_WORD(memory, address, word)                               \
+        do {                                                            \
+                if((address) < DENSE_MEMORY_SIZE)                       \
+                        (memory)[address] = (word);                     \
+                else                                                    \
+                        store_paged((address), (word));                 \
+        } while(0)
+
+/* Число страниц памяти данных контекста vm (вместе с плотной) и
+ * страница с номером index: NULL, если в неё ничего не записывали.
+ */
+
+unsigned int memory_pages(vm_context const *vm);
+int const *memory_page(vm_context const *vm, unsigned int index);
+
+/* Очистка памяти данных: плотная страница обнуляется, остальные
+ * освобождаются. release_memory() только освобождает страницы.
+ */
+
+void clear_memory(vm_context *vm);
+void release_memory(vm_context *vm);
+
+/* Копирование памяти данных и её размера из source в vm. Возвращает 0,
+ * если не хватило памяти под страницы.
+ */
+
+int copy_memory(vm_context *vm, vm_context const *source);
+
+/* Загрузка программы из образа файла .mbc в памяти (length байт
+ * по адресу image) в текущий контекст; name - имя для сообщений.
+ * Возвращает то же, что load_bytecode().
+ */
+
+int load_bytecode_image(char const *name, void const *image, size_t length);
+
+/* Выравнивание секций файлов .mbc и снимков состояния */
+#define SECTION_ALIGN           8
+
+/* offset, округлённое вверх до кратного alignment (степени двойки) */
+
+unsigned int align_offset(unsigned int offset, unsigned int alignment);
+
+/* Проверка, что секция из count записей размера size по смещению offset
+ * выровнена на SECTION_ALIGN и целиком лежит в файле длины length.
+ */
+
+int section_fits(unsigned int offset, unsigned int count, unsigned int size, size_t length);
+
+/* Загрузка программы из текста (length байт по адресу text) в текущий
+ * контекст; name - имя для сообщений. Возвращает 0 при ошибке
+ * (сообщение с номером строки уже выведено).
+ */
+
+int load_source_text(char const *name, char const *text, size_t length);
+
+/* Подготовка контекста vm к загрузке: контекст становится текущим,
+ * его память команд и память данных очищаются. Возвращает 0, если
+ * не хватило памяти для памяти команд (результат VM_NO_MEMORY).
+ */
+
+int begin_load(vm_context *vm);
+
+/* Очистка памяти команд и памяти данных текущего контекста */
+
+void clear_program();
+
+/* Суперкоманды. Кодируют команды виртуальной машины и их часто
+ * встречающиеся последовательности; нумерация продолжает operation.
+ */
+typedef enum {
+        HALT = PRINT + 1,               /* Конец программы */
+        BAD_JUMP,                       /* Переход по недопустимому адресу */
+        UNKNOWN_OPERATION,              /* Неизвестный код команды */
+        LOAD_LOAD_ADD,                  /* LOAD a; LOAD b; ADD */
+        LOAD_LOAD_SUB,                  /* LOAD a; LOAD b; SUB */
+        LOAD_LOAD_MULT,                 /* LOAD a; LOAD b; MULT */
+        LOAD_PUSH_ADD,                  /* LOAD a; PUSH c; ADD */
+        LOAD_PUSH_SUB,                  /* LOAD a; PUSH c; SUB */
+        LOAD_PUSH_MULT,                 /* LOAD a; PUSH c; MULT */
+        LOAD_LOAD_ADD_STORE,            /* LOAD a; LOAD b; ADD; STORE d */
+        LOAD_LOAD_SUB_STORE,            /* LOAD a; LOAD b; SUB; STORE d */
+        LOAD_LOAD_MULT_STORE,           /* LOAD a; LOAD b; MULT; STORE d */
+        LOAD_PUSH_ADD_STORE,            /* LOAD a; PUSH c; ADD; STORE d */
+        LOAD_PUSH_SUB_STORE,            /* LOAD a; PUSH c; SUB; STORE d */
+        LOAD_PUSH_MULT_STORE,           /* LOAD a; PUSH c; MULT; STORE d */
+        LOAD_STORE,                     /* LOAD a; STORE d */
+        PUSH_STORE,                     /* PUSH c; STORE d */
+        COMPARE_JUMP_YES,               /* COMPARE k; JUMP_YES t */
+        COMPARE_JUMP_NO,                /* COMPARE k; JUMP_NO t */
+        LOAD_PUSH_COMPARE_JUMP_YES,     /* LOAD a; PUSH c; COMPARE k; JUMP_YES t */
+        LOAD_PUSH_COMPARE_JUMP_NO,      /* LOAD a; PUSH c; COMPARE k; JUMP_NO t */
+        LOAD_LOAD_COMPARE_JUMP_YES,     /* LOAD a; LOAD b; COMPARE k; JUMP_YES t */
+        LOAD_LOAD_COMPARE_JUMP_NO,      /* LOAD a; LOAD b; COMPARE k; JUMP_NO t */
+        SUPER_OPERATIONS_COUNT
+} super_operation;
+
+/* Команда программы после слияния.
+ *
+ * Аргументы суперкоманды следуют в порядке аргументов исходных команд:
+ * адреса и константы в arg и arg2, код сравнения или адрес записи
+ * в arg3, цель перехода в arg4. Цели переходов указывают на индекс
+ * в super_program, а не на адрес в памяти команд.
+ */
+typedef struct {
+        int operation;          /* operation или super_operation */
+        int arg;
+        int arg2;
+        int arg3;
+        int arg4;
+        unsigned int address;   /* Адрес первой исходной команды */
+} super_command;
+
+/* Рабочие данные слияния */
+struct fuse_workspace {
+        /* Программа после слияния. За последней командой стоит HALT. */
+        super_command program[MAX_PROGRAM_SIZE + 1];
+        unsigned int size;
+
+        /* Счётчики исполнений по кодам команд и суперкоманд.
+         * Заполняются ядром threaded, если включён отчёт о слиянии.
+         */
+        unsigned long hits[SUPER_OPERATIONS_COUNT];
+
+        /* Признак начала базового блока: на адрес есть переход */
+        unsigned char is_leader[MAX_PROGRAM_SIZE];
+
+        /* Индекс в program для каждого адреса начала команды */
+        unsigned int index[MAX_PROGRAM_SIZE];
+};
+
+#define super_program           (vm_current->fuse->program)
+#define super_program_size      (vm_current->fuse->size)
+#define super_hits              (vm_current->fuse->hits)
+
+extern int fusion_enabled;
+extern int fusion_stats;
+
+/* Построение super_program по памяти команд. Если слияние выключено,
+ * каждая команда переносится без изменений. Рабочие данные слияния
+ * создаются при первом вызове.
+ */
+
+void fuse_program();
+
+/* Вывод отчёта о слиянии: число мест и исполнений каждой суперкоманды. */
+
+void fusion_report(FILE *stream);
+
+/* Описание исполняющего ядра */
+typedef struct {
+        char const *name;       /* Имя ядра в командной строке */
+        vm_engine engine;
+} engine_info;
+
+extern engine_info engines_table[];
+extern int engines_table_size;
+
+/* Результат проверки программы */
+typedef enum {
+        VERIFY_OK,              /* Ошибки стека, адресов и кодов команд невозможны */
+        VERIFY_ERROR,           /* Достижимая команда всегда заканчивается ошибкой */
+        VERIFY_CONFLICT         /* Глубина стека перед командой зависит от пути */
+} verify_status;
+
+typedef struct {
+        verify_status status;
+        unsigned int address;   /* Адрес команды, на которой проверка не прошла */
+        runtime_error error;    /* Ошибка этой команды при VERIFY_ERROR */
+        int max_depth;          /* Наибольшая глубина стека */
+} verify_result;
+
+/* Рабочие данные проверки */
+struct verify_workspace {
+        /* Глубина стека перед каждой командой, вычисленная
+         * verify_program(); -1 для недостижимых команд.
+         */
+        int depth[MAX_PROGRAM_SIZE];
+
+        /* Адреса команд, ожидающих обработки */
+        unsigned int worklist[MAX_PROGRAM_SIZE];
+};
+
+#define vm_stack_depth          (vm_current->verify->depth)
+
+/* Глубина стека после исполнения команды по адресу address при глубине
+ * depth перед ней. Возвращает -1, если при такой глубине команда всегда
+ * заканчивается ошибкой, и записывает ошибку в *error. Ошибки проверяются
+ * в том же порядке, что и в run(); ошибки, зависящие от данных (деление
+ * на ноль, адрес BLOAD и BSTORE, ввод), не учитываются.
+ */
+
+int stack_effect(unsigned int address, int depth, runtime_error *error);
+
+/* Проверка программы абстрактным исполнением: вычисление глубины стека
+ * перед каждой достижимой командой и поиск команд, которые всегда
+ * заканчиваются ошибкой. При VERIFY_ERROR указывается команда
+ * с наименьшим адресом, при VERIFY_CONFLICT vm_stack_depth заполнен
+ * не полностью.
+ */
+
+void verify_program(verify_result *result);
+
+/* Интерпретатор для проверенных программ (VERIFY_OK). Глубина стека
+ * перед каждой командой доказана, адреса LOAD, STORE и переходов
+ * допустимы, поэтому проверяются только деление на ноль, адреса BLOAD
+ * и BSTORE и ввод.
+ */
+
+void run_unchecked();
+
+/* run_unchecked(), начиная с vm_command_pointer. Число исполненных команд
+ * сравнивается с budget только на переходах, поэтому исполняется от budget
+ * до budget + vm_program_size команд. Возвращает 1, если исполнено budget
+ * команд, и 0, если исполнена команда STOP или программа закончилась.
+ */
+
+int run_unchecked_budget(unsigned long budget);
+
+/* Запуск ядра engine в текущем контексте: ошибки, переданные vm_fail(),
+ * возвращаются результатом.
+ */
+
+vm_status run_protected(void (*engine)());
+
+/* Исполнение одной команды по адресу vm_command_pointer интерпретатором
+ * run(). Возвращает 0, если исполнена команда STOP.
+ */
+
+int vm_run_command();
+
+/* Исполнение команд интерпретатором run(), начиная с vm_command_pointer,
+ * не более budget команд. Возвращает 1, если исполнено budget команд,
+ * и 0, если исполнена команда STOP или программа закончилась.
+ */
+
+int run_budget(unsigned long budget);
+
+/* Исполнение команд интерпретатором run(), начиная с vm_command_pointer,
+ * до начала базового блока (leaders[адрес] != 0). Используется ядрами,
+ * которые передают интерпретатору блоки, не исполнимые ими самими.
+ * Возвращает 0, если исполнена команда STOP или программа закончилась.
+ */
+
+int run_until_leader(unsigned char const *leaders);
+
+/* Сообщение о фатальной ошибке и завершение работы. Определяется
+ * в mvm и ms2c, в libmilan не используется.
+ */
+
+void milan_error(char const *msg);
+
+/* Текст сообщения об ошибке error или NULL, если ошибка неизвестна */
+
+char const *vm_error_message(runtime_error error);
+
+/* Ошибка error в команде по адресу vm_command_pointer: запуск
+ * завершается с результатом VM_RUNTIME_ERROR.
+ */
+
+void vm_error(runtime_error error);
+
+/* Освобождение рабочих данных регистрового ядра, ядра jit и трассы */
+
+void release_register(vm_context *vm);
+void release_jit(vm_context *vm);
+void release_trace(vm_context *vm);
+
+/* Запись накопленного вывода контекста vm и освобождение буфера */
+
+void release_output(vm_context *vm);
+
+/* Чтение числа функцией ввода контекста или со стандартного
+ * устройства ввода.
+ */
+
+int vm_read();
+
+/* Вывод числа n функцией вывода контекста или на стандартное
+ * устройство вывода.
+ */
+
+void vm_write(int n);
+
+/* Размер блока, которым читаются входные данные */
+#define INPUT_BLOCK_SIZE        65536
+
+/* Источник входных данных неинтерактивного ввода */
+typedef struct {
+        FILE *stream;                   /* NULL - источник не открыт */
+        input_format format;
+
+        /* Непрочитанная часть данных: в mapping или в block */
+        unsigned char const *position;
+        unsigned char const *end;
+
+        void *mapping;                  /* Отображённый в память файл */
+        size_t mapping_length;
+        unsigned char block[INPUT_BLOCK_SIZE];
+} input_source;
+
+/* Открытие источника "stdin" или файла name. Обычный файл отображается
+ * в память. Возвращает 0, если файл не удалось открыть.
+ */
+
+int open_input(input_source *source, char const *name, input_format format);
+
+/* Открытие источника с данными в памяти (length байт по адресу data).
+ * Данные не копируются и должны существовать, пока источник открыт.
+ */
+
+void open_input_memory(input_source *source, void const *data, size_t length,
+                       input_format format);
+
+/* Закрытие источника */
+
+void close_input(input_source *source);
+
+/* Чтение числа из источника. Возвращает 0 при ошибке разбора или
+ * в конце входных данных.
+ */
+
+int read_input(input_source *source, int *value);
+
+/* Признак интерактивного ввода (с приглашением, через scanf) */
+extern int input_interactive;
+
+/* Чтение числа в неинтерактивном режиме. Возвращает 0 при ошибке
+ * разбора или в конце входных данных.
+ */
+
+int input_word(int *value);
+
+/* Запись числа n в буфер вывода команды PRINT. */
+
+void output_word(int n);
+
+/* Запись строки line и перевода строки в буфер вывода. В двоичном
+ * формате вывода строка не записывается и функция возвращает 0.
+ */
+
+int output_line(char const *line);
+
+/* Результат запуска программы с одними входными данными в пакетном
+ * режиме и в режиме дорожек
+ */
+typedef struct {
+        int *values;                    /* Вывод команды PRINT */
+        unsigned int count;
+        unsigned int capacity;
+        vm_status status;
+        runtime_error error;            /* Ошибка при VM_RUNTIME_ERROR */
+        unsigned int address;           /* Адрес команды с ошибкой */
+} run_result;
+
+/* Запись числа в вывод результата result. При нехватке памяти
+ * вызывает vm_fail().
+ */
+
+void append_result(run_result *result, int value);
+
+/* Запись результата в выходной поток: строка "# name", вывод программы
+ * и сообщение об ошибке. В двоичном формате вывода сообщение
+ * печатается на стандартный вывод. Вывод результата освобождается.
+ */
+
+void write_result(run_result *result, char const *name);
+
+/* Время в секундах от произвольного момента */
+
+double wall_clock();
+
+/* Запись состояния текущего контекста (память команд, память данных,
+ * стек, номер следующей команды) в файл снимка. Возвращает 0 при
+ * ошибке записи.
+ */
+
+int save_snapshot(char const *file);
+
+/* Восстановление состояния текущего контекста из файла снимка.
+ * Возвращает 0, если файл не прочитан или повреждён (сообщение
+ * уже выведено).
+ */
+
+int restore_snapshot(char const *file);
+
+/* Аппаратные счётчики (vm_perf.c) */
+typedef enum {
+        COUNTER_CYCLES = 0,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_BRANCH_MISSES,
+        COUNTER_CACHE_MISSES,
+        COUNTERS_COUNT
+} perf_counter;
+
+typedef struct {
+        unsigned long long value[COUNTERS_COUNT];
+        int valid[COUNTERS_COUNT];      /* 0 - счётчик не поддерживается */
+} perf_values;
+
+/* Открытие счётчиков для текущего потока. Возвращает число счётчиков,
+ * которые удалось открыть.
+ */
+
+int perf_open();
+
+void perf_close();
+
+/* Обнуление и включение открытых счётчиков */
+
+void perf_start();
+
+/* Выключение счётчиков и чтение их значений */
+
+void perf_stop(perf_values *values);
+
+/* Сложение значений счётчиков нескольких запусков */
+
+void perf_add(perf_values *total, perf_values const *values);
+
+/* Вывод значений счётчиков и их отношения к числу instructions
+ * исполненных команд виртуальной машины (0 - число неизвестно).
+ */
+
+void write_perf_values(FILE *stream, perf_values const *values, unsigned long instructions);
+
+#endif
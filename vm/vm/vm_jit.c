@@ -0,0 +1,740 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include "vm_internal.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+/* Компиляция программы в машинный код x86-64.
+ *
+ * Стек виртуальной машины остаётся в vm_stack, поэтому на границе
+ * любой команды состояние машины совпадает с состоянием интерпретатора
+ * и исполнение можно передать run() с любого адреса. Регистры
+ * в скомпилированном коде:
+ *
+ *      rbx  - адрес vm_stack
+ *      r12d - указатель стека (число слов в стеке)
+ *      r13  - адрес vm_memory (плотной страницы памяти данных)
+ *      r14  - адрес структуры jit_state
+ *
+ * Каждый базовый блок начинается с проверки глубины стека. Если её
+ * не хватает для исполнения блока без ошибок стека, блок исполняется
+ * интерпретатором, который и сообщает об ошибке.
+ */
+
+/* Причина выхода из скомпилированного кода */
+typedef enum {
+        JIT_STOP,               /* Команда STOP или конец программы */
+        JIT_ERROR,              /* Ошибка времени исполнения */
+        JIT_FALLBACK            /* Продолжение в интерпретаторе */
+} jit_exit;
+
+/* Состояние, передаваемое скомпилированному коду */
+typedef struct {
+        int *stack;
+        int *memory;
+        unsigned int sp;        /* Указатель стека */
+        unsigned int pc;        /* Адрес команды при выходе */
+        int status;             /* jit_exit */
+        int error;              /* runtime_error при JIT_ERROR */
+} jit_state;
+
+/* Регистры x86-64 */
+enum {
+        RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* Коды условий x86; условие с кодом cc ^ 1 противоположно cc */
+enum {
+        CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+        CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+/* Условие x86 для кода сравнения виртуальной машины */
+static int const relation_cc[] = { CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE };
+
+/* Число слов, снимаемых и кладущихся в стек каждой командой */
+static int const stack_pops[]   = { 0, 0, 0, 1, 1, 2, 0, 1, 1, 1, 2, 2, 2, 2, 2, 0, 1, 1, 0, 1 };
+static int const stack_pushes[] = { 0, 0, 1, 0, 1, 0, 1, 0, 2, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0 };
+
+/* Место для перехода, адрес которого станет известен позже */
+typedef struct {
+        unsigned int offset;    /* Смещение поля rel32 в буфере */
+        unsigned int target;    /* Адрес команды назначения */
+} jit_fixup;
+
+/* Рабочие данные компилятора */
+struct jit_workspace {
+        unsigned char *buffer;          /* Исполняемая память */
+        size_t buffer_size;
+        size_t position;
+
+        jit_fixup fixups[MAX_PROGRAM_SIZE];
+        unsigned int fixups_count;
+
+        unsigned char is_leader[MAX_PROGRAM_SIZE];
+        size_t block_offset[MAX_PROGRAM_SIZE];
+
+        size_t exit_offset;             /* Общий выход из скомпилированного кода */
+        size_t halt_offset;             /* Остановка за концом программы */
+};
+
+void release_jit(vm_context *vm)
+{
+        if(NULL != vm->jit) {
+                if(NULL != vm->jit->buffer) {
+                        munmap(vm->jit->buffer, vm->jit->buffer_size);
+                }
+                free(vm->jit);
+                vm->jit = NULL;
+        }
+}
+
+/* Рабочие данные текущего контекста */
+#define buffer          (vm_current->jit->buffer)
+#define buffer_size     (vm_current->jit->buffer_size)
+#define position        (vm_current->jit->position)
+#define fixups          (vm_current->jit->fixups)
+#define fixups_count    (vm_current->jit->fixups_count)
+#define is_leader       (vm_current->jit->is_leader)
+#define block_offset    (vm_current->jit->block_offset)
+#define exit_offset     (vm_current->jit->exit_offset)
+#define halt_offset     (vm_current->jit->halt_offset)
+
+static void emit_byte(int byte)
+{
+        buffer[position++] = (unsigned char) byte;
+}
+
+static void emit_int(int value)
+{
+        unsigned int bits = value;
+
+        emit_byte(bits);
+        emit_byte(bits >> 8);
+        emit_byte(bits >> 16);
+        emit_byte(bits >> 24);
+}
+
+static void patch_int(size_t offset, int value)
+{
+        unsigned int bits = value;
+
+        buffer[offset] = bits;
+        buffer[offset + 1] = bits >> 8;
+        buffer[offset + 2] = bits >> 16;
+        buffer[offset + 3] = bits >> 24;
+}
+
+static void emit_rex(int wide, int reg, int index, int base)
+{
+        int rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+
+        if(0x40 != rex) {
+                emit_byte(rex);
+        }
+}
+
+/* Инструкция с операндом в памяти [base + index * 4 + disp]
+ * (index < 0 - без индекса).
+ */
+static void emit_mem(int wide, int opcode, int reg, int base, int index, int disp)
+{
+        int mod = (0 == disp && (base & 7) != RBP) ? 0 :
+                  (disp >= -128 && disp <= 127) ? 1 : 2;
+
+        emit_rex(wide, reg, (index < 0) ? 0 : index, base);
+        if(opcode > 0xFF) {
+                emit_byte(opcode >> 8);
+        }
+        emit_byte(opcode);
+
+        if(index >= 0 || (base & 7) == RSP) {
+                emit_byte((mod << 6) | ((reg & 7) << 3) | 4);
+                emit_byte((2 << 6) | (((index < 0) ? RSP : index) & 7) << 3 | (base & 7));
+        }
+        else {
+                emit_byte((mod << 6) | ((reg & 7) << 3) | (base & 7));
+        }
+
+        if(1 == mod) {
+                emit_byte(disp);
+        }
+        else if(2 == mod) {
+                emit_int(disp);
+        }
+}
+
+/* Инструкция с двумя регистрами: opcode reg, rm */
+static void emit_reg(int wide, int opcode, int reg, int rm)
+{
+        emit_rex(wide, reg, 0, rm);
+        if(opcode > 0xFF) {
+                emit_byte(opcode >> 8);
+        }
+        emit_byte(opcode);
+        emit_byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Слово стека на depth позиций ниже вершины: [rbx + r12 * 4 - depth * 4] */
+#define STACK_SLOT(depth)       RBX, R12, -4 * (depth)
+
+static void emit_mov_imm(int reg, int value)
+{
+        emit_rex(0, 0, 0, reg);
+        emit_byte(0xB8 + (reg & 7));
+        emit_int(value);
+}
+
+/* sp := sp + delta */
+static void emit_adjust_sp(int delta)
+{
+        if(1 == delta) {
+                emit_reg(0, 0xFF, 0, R12);              /* inc r12d */
+        }
+        else if(-1 == delta) {
+                emit_reg(0, 0xFF, 1, R12);              /* dec r12d */
+        }
+        else if(delta > 0) {
+                emit_reg(0, 0x83, 0, R12);              /* add r12d, imm8 */
+                emit_byte(delta);
+        }
+        else if(delta < 0) {
+                emit_reg(0, 0x83, 5, R12);              /* sub r12d, imm8 */
+                emit_byte(-delta);
+        }
+}
+
+static void emit_call(void const *function)
+{
+        emit_byte(0x48);                                /* mov rax, imm64 */
+        emit_byte(0xB8);
+        emit_int((int) (size_t) function);
+        emit_int((int) ((size_t) function >> 32));
+        emit_byte(0xFF);                                /* call rax */
+        emit_byte(0xD0);
+}
+
+/* Переход к команде target: rel32 заполняется после компиляции всех блоков */
+static void emit_jump(int cc, unsigned int target)
+{
+        if(cc < 0) {
+                emit_byte(0xE9);
+        }
+        else {
+                emit_byte(0x0F);
+                emit_byte(0x80 + cc);
+        }
+
+        fixups[fixups_count].offset = position;
+        fixups[fixups_count].target = target;
+        ++fixups_count;
+        emit_int(0);
+}
+
+static void emit_jump_to(int cc, size_t offset)
+{
+        if(cc < 0) {
+                emit_byte(0xE9);
+        }
+        else {
+                emit_byte(0x0F);
+                emit_byte(0x80 + cc);
+        }
+        emit_int((int) (offset - (position + 4)));
+}
+
+/* Выход из скомпилированного кода с причиной status */
+static void emit_exit(jit_exit status, int error, unsigned int address)
+{
+        emit_mov_imm(RAX, status);
+        emit_mov_imm(RCX, error);
+        emit_mov_imm(RDX, address);
+        emit_jump_to(-1, exit_offset);
+}
+
+/* Выход с ошибкой, если условие cc не выполнено */
+static void emit_check(int cc, runtime_error error, unsigned int address)
+{
+        size_t skip;
+
+        emit_byte(0x70 + cc);                           /* jcc rel8 */
+        skip = position;
+        emit_byte(0);
+        emit_exit(JIT_ERROR, error, address);
+        buffer[skip] = (unsigned char) (position - skip - 1);
+}
+
+/* Вход в скомпилированный код: jit_enter(state, code) */
+static void emit_prologue()
+{
+        emit_byte(0x53);                                /* push rbx */
+        emit_byte(0x55);                                /* push rbp */
+        emit_byte(0x41); emit_byte(0x54);               /* push r12 */
+        emit_byte(0x41); emit_byte(0x55);               /* push r13 */
+        emit_byte(0x41); emit_byte(0x56);               /* push r14 */
+        emit_byte(0x41); emit_byte(0x57);               /* push r15 */
+        emit_reg(1, 0x83, 5, RSP);                      /* sub rsp, 8 */
+        emit_byte(8);
+        emit_reg(1, 0x89, RDI, R14);                    /* mov r14, rdi */
+        emit_mem(1, 0x8B, RBX, R14, -1, offsetof(jit_state, stack));
+        emit_mem(1, 0x8B, R13, R14, -1, offsetof(jit_state, memory));
+        emit_mem(0, 0x8B, R12, R14, -1, offsetof(jit_state, sp));
+        emit_byte(0xFF);                                /* jmp rsi */
+        emit_byte(0xE6);
+
+        /* Выход: eax - причина, ecx - ошибка, edx - адрес команды */
+        exit_offset = position;
+        emit_mem(0, 0x89, R12, R14, -1, offsetof(jit_state, sp));
+        emit_mem(0, 0x89, RAX, R14, -1, offsetof(jit_state, status));
+        emit_mem(0, 0x89, RCX, R14, -1, offsetof(jit_state, error));
+        emit_mem(0, 0x89, RDX, R14, -1, offsetof(jit_state, pc));
+        emit_reg(1, 0x83, 0, RSP);                      /* add rsp, 8 */
+        emit_byte(8);
+        emit_byte(0x41); emit_byte(0x5F);               /* pop r15 */
+        emit_byte(0x41); emit_byte(0x5E);               /* pop r14 */
+        emit_byte(0x41); emit_byte(0x5D);               /* pop r13 */
+        emit_byte(0x41); emit_byte(0x5C);               /* pop r12 */
+        emit_byte(0x5D);                                /* pop rbp */
+        emit_byte(0x5B);                                /* pop rbx */
+        emit_byte(0xC3);                                /* ret */
+
+        halt_offset = position;
+        emit_exit(JIT_STOP, 0, MAX_PROGRAM_SIZE);
+}
+
+/* Проверка глубины стека на входе в блок [start, end) */
+static void emit_block_entry(unsigned int start, unsigned int end)
+{
+        unsigned int address;
+        int depth = 0;
+        int lowest = 0;
+        int highest = 0;
+        size_t fallback;
+        size_t body;
+
+        for(address = start; address < end; ++address) {
+                unsigned int op = vm_program[address].operation;
+
+                if(op > PRINT) {
+                        break;
+                }
+
+                depth -= stack_pops[op];
+                if(depth < lowest) {
+                        lowest = depth;
+                }
+
+                depth += stack_pushes[op];
+                if(depth > highest) {
+                        highest = depth;
+                }
+        }
+
+        if(highest > MAX_STACK_SIZE) {
+                emit_exit(JIT_FALLBACK, 0, start);
+                return;
+        }
+
+        if(lowest < 0) {
+                emit_reg(0, 0x81, 7, R12);              /* cmp r12d, -lowest */
+                emit_int(-lowest);
+                emit_byte(0x70 + CC_B);                 /* jb fallback */
+                fallback = position;
+                emit_byte(0);
+        }
+        else {
+                fallback = 0;
+        }
+
+        emit_reg(0, 0x81, 7, R12);                      /* cmp r12d, MAX - highest */
+        emit_int(MAX_STACK_SIZE - highest);
+        emit_byte(0x70 + CC_BE);                        /* jbe body */
+        body = position;
+        emit_byte(0);
+
+        if(fallback) {
+                buffer[fallback] = (unsigned char) (position - fallback - 1);
+        }
+        emit_exit(JIT_FALLBACK, 0, start);
+        buffer[body] = (unsigned char) (position - body - 1);
+}
+
+/* Проверка адреса данных в eax для BLOAD и BSTORE: выход с ошибкой
+ * за пределами памяти. Адрес в плотной странице ведёт к переходу,
+ * смещение которого (возвращаемая позиция) заполняет вызывающий;
+ * за переходом следует обращение к странице через load_paged()
+ * или store_paged().
+ */
+static size_t emit_paged_check(unsigned int address)
+{
+        size_t dense;
+
+        emit_byte(0x3D);                                /* cmp eax, DENSE */
+        emit_int(DENSE_MEMORY_SIZE);
+        emit_byte(0x70 + CC_B);                         /* jb dense */
+        dense = position;
+        emit_byte(0);
+        emit_byte(0x3D);                                /* cmp eax, size */
+        emit_int(vm_memory_size);
+        emit_check(CC_B, BAD_DATA_ADDRESS, address);
+
+        return dense;
+}
+
+static int jit_input(unsigned int address)
+{
+        vm_command_pointer = address;
+        return vm_read();
+}
+
+/* Компиляция команды по адресу address. Возвращает число
+ * скомпилированных команд (2, если COMPARE слит с переходом).
+ */
+static unsigned int compile_command(unsigned int address)
+{
+        operation op = vm_program[address].operation;
+        int arg = vm_program[address].arg;
+        unsigned int size = vm_program_size;
+        unsigned int next;
+        size_t dense;
+        size_t done;
+        size_t skip;
+
+        switch(op) {
+        case NOP:
+                break;
+
+        case STOP:
+                emit_exit(JIT_STOP, 0, address);
+                break;
+
+        case LOAD:
+                if((unsigned int) arg >= vm_memory_size) {
+                        emit_exit(JIT_ERROR, BAD_DATA_ADDRESS, address);
+                        break;
+                }
+                if(arg < DENSE_MEMORY_SIZE) {
+                        emit_mem(0, 0x8B, RAX, R13, -1, 4 * arg);       /* mov eax, [mem] */
+                }
+                else {
+                        emit_mov_imm(RDI, arg);
+                        emit_call((void const *) load_paged);
+                }
+                emit_mem(0, 0x89, RAX, STACK_SLOT(0));          /* mov [top], eax */
+                emit_adjust_sp(1);
+                break;
+
+        case STORE:
+                if((unsigned int) arg >= vm_memory_size) {
+                        emit_exit(JIT_ERROR, BAD_DATA_ADDRESS, address);
+                        break;
+                }
+                emit_adjust_sp(-1);
+                if(arg < DENSE_MEMORY_SIZE) {
+                        emit_mem(0, 0x8B, RAX, STACK_SLOT(0));
+                        emit_mem(0, 0x89, RAX, R13, -1, 4 * arg);
+                }
+                else {
+                        emit_mem(0, 0x8B, RSI, STACK_SLOT(0));
+                        emit_mov_imm(RDI, arg);
+                        emit_call((void const *) store_paged);
+                }
+                break;
+
+        case BLOAD:
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(1));
+                emit_byte(0x05);                                /* add eax, arg */
+                emit_int(arg);
+                dense = emit_paged_check(address);
+                emit_reg(0, 0x89, RAX, RDI);                    /* mov edi, eax */
+                emit_call((void const *) load_paged);
+                emit_byte(0xEB);                                /* jmp done */
+                done = position;
+                emit_byte(0);
+                buffer[dense] = (unsigned char) (position - dense - 1);
+                emit_mem(0, 0x8B, RAX, R13, RAX, 0);            /* mov eax, [r13 + rax * 4] */
+                buffer[done] = (unsigned char) (position - done - 1);
+                emit_mem(0, 0x89, RAX, STACK_SLOT(1));
+                break;
+
+        case BSTORE:
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(1));
+                emit_byte(0x05);
+                emit_int(arg);
+                emit_mem(0, 0x8B, RCX, STACK_SLOT(2));
+                dense = emit_paged_check(address);
+                emit_reg(0, 0x89, RAX, RDI);                    /* mov edi, eax */
+                emit_reg(0, 0x89, RCX, RSI);                    /* mov esi, ecx */
+                emit_call((void const *) store_paged);
+                emit_byte(0xEB);
+                done = position;
+                emit_byte(0);
+                buffer[dense] = (unsigned char) (position - dense - 1);
+                emit_mem(0, 0x89, RCX, R13, RAX, 0);            /* mov [r13 + rax * 4], ecx */
+                buffer[done] = (unsigned char) (position - done - 1);
+                emit_adjust_sp(-2);
+                break;
+
+        case PUSH:
+                emit_mem(0, 0xC7, 0, STACK_SLOT(0));            /* mov dword [top], arg */
+                emit_int(arg);
+                emit_adjust_sp(1);
+                break;
+
+        case POP:
+                emit_adjust_sp(-1);
+                break;
+
+        case DUP:
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(1));
+                emit_mem(0, 0x89, RAX, STACK_SLOT(0));
+                emit_adjust_sp(1);
+                break;
+
+        case INVERT:
+                emit_mem(0, 0xF7, 3, STACK_SLOT(1));            /* neg dword [top - 1] */
+                break;
+
+        case ADD:
+        case SUB:
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(0));
+                emit_mem(0, (ADD == op) ? 0x01 : 0x29, RAX, STACK_SLOT(1));
+                break;
+
+        case MULT:
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(1));
+                emit_mem(0, 0x0FAF, RAX, STACK_SLOT(0));        /* imul eax, [top] */
+                emit_mem(0, 0x89, RAX, STACK_SLOT(1));
+                break;
+
+        case DIV:
+                emit_mem(0, 0x8B, RCX, STACK_SLOT(1));
+                emit_reg(0, 0x85, RCX, RCX);                    /* test ecx, ecx */
+                emit_check(CC_NE, DIVISION_BY_ZERO, address);
+                emit_reg(0, 0x83, 7, RCX);                      /* cmp ecx, -1 */
+                emit_byte(0xFF);
+                emit_byte(0x70 + CC_NE);                        /* jne после проверки */
+                skip = position;
+                emit_byte(0);
+                emit_mem(0, 0x81, 7, STACK_SLOT(2));            /* cmp [делимое], INT_MIN */
+                emit_int(INT_MIN);
+                emit_check(CC_NE, DIVISION_OVERFLOW, address);
+                buffer[skip] = (unsigned char) (position - skip - 1);
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(1));
+                emit_byte(0x99);                                /* cdq */
+                emit_reg(0, 0xF7, 7, RCX);                      /* idiv ecx */
+                emit_mem(0, 0x89, RAX, STACK_SLOT(1));
+                break;
+
+        case COMPARE:
+                if((unsigned int) arg > GE) {
+                        emit_exit(JIT_ERROR, BAD_RELATION, address);
+                        break;
+                }
+
+                next = address + 1;
+                if(next < size && !is_leader[next] &&
+                   (JUMP_YES == vm_program[next].operation || JUMP_NO == vm_program[next].operation) &&
+                   (unsigned int) vm_program[next].arg < MAX_PROGRAM_SIZE) {
+                        /* COMPARE k; JUMP_* t - сравнение и условный переход */
+                        int cc = relation_cc[arg];
+
+                        emit_adjust_sp(-2);
+                        emit_mem(0, 0x8B, RAX, STACK_SLOT(-1));
+                        emit_mem(0, 0x39, RAX, STACK_SLOT(0));  /* cmp [left], eax */
+                        emit_jump((JUMP_YES == vm_program[next].operation) ? cc : cc ^ 1,
+                                  vm_program[next].arg);
+                        return 2;
+                }
+
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(0));
+                emit_mem(0, 0x39, RAX, STACK_SLOT(1));
+                emit_byte(0x0F);                                /* setcc al */
+                emit_byte(0x90 + relation_cc[arg]);
+                emit_byte(0xC0);
+                emit_reg(0, 0x0FB6, RAX, RAX);                  /* movzx eax, al */
+                emit_mem(0, 0x89, RAX, STACK_SLOT(1));
+                break;
+
+        case JUMP:
+                if((unsigned int) arg >= MAX_PROGRAM_SIZE) {
+                        emit_exit(JIT_ERROR, BAD_CODE_ADDRESS, address);
+                        break;
+                }
+                emit_jump(-1, arg);
+                break;
+
+        case JUMP_YES:
+        case JUMP_NO:
+                if((unsigned int) arg >= MAX_PROGRAM_SIZE) {
+                        emit_exit(JIT_ERROR, BAD_CODE_ADDRESS, address);
+                        break;
+                }
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RAX, STACK_SLOT(0));
+                emit_reg(0, 0x85, RAX, RAX);                    /* test eax, eax */
+                emit_jump((JUMP_YES == op) ? CC_NE : CC_E, arg);
+                break;
+
+        case INPUT:
+                emit_mov_imm(RDI, address);
+                emit_call((void const *) jit_input);
+                emit_mem(0, 0x89, RAX, STACK_SLOT(0));
+                emit_adjust_sp(1);
+                break;
+
+        case PRINT:
+                emit_adjust_sp(-1);
+                emit_mem(0, 0x8B, RDI, STACK_SLOT(0));
+                emit_call((void const *) vm_write);
+                break;
+
+        default:
+                /* Неизвестную команду исполняет интерпретатор */
+                emit_exit(JIT_FALLBACK, 0, address);
+        }
+
+        return 1;
+}
+
+static int is_jump(operation op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op;
+}
+
+/* Компиляция программы. Возвращает 0, если не удалось выделить
+ * исполняемую память.
+ */
+static int jit_compile()
+{
+        unsigned int size = vm_program_size;
+        unsigned int address;
+        unsigned int end;
+        unsigned int i;
+        size_t needed = 96 * (size_t) size + 512;
+
+        if(needed > buffer_size) {
+                if(NULL != buffer) {
+                        munmap(buffer, buffer_size);
+                }
+                buffer = mmap(NULL, needed, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(MAP_FAILED == buffer) {
+                        buffer = NULL;
+                        buffer_size = 0;
+                        return 0;
+                }
+                buffer_size = needed;
+        }
+        else if(0 != mprotect(buffer, buffer_size, PROT_READ | PROT_WRITE)) {
+                return 0;
+        }
+
+        for(address = 0; address < size; ++address) {
+                is_leader[address] = (0 == address);
+        }
+
+        for(address = 0; address < size; ++address) {
+                operation op = vm_program[address].operation;
+                unsigned int target = vm_program[address].arg;
+
+                if(is_jump(op) && target < size) {
+                        is_leader[target] = 1;
+                }
+                if((is_jump(op) || STOP == op) && address + 1 < size) {
+                        is_leader[address + 1] = 1;
+                }
+        }
+
+        position = 0;
+        fixups_count = 0;
+        emit_prologue();
+
+        for(address = 0; address < size; address = end) {
+                for(end = address + 1; end < size && !is_leader[end]; ++end)
+                        ;
+
+                block_offset[address] = position;
+                emit_block_entry(address, end);
+                for(i = address; i < end; ) {
+                        i += compile_command(i);
+                }
+        }
+        emit_jump_to(-1, halt_offset);
+
+        for(i = 0; i < fixups_count; ++i) {
+                size_t target = (fixups[i].target < size) ? block_offset[fixups[i].target] : halt_offset;
+
+                patch_int(fixups[i].offset, (int) (target - (fixups[i].offset + 4)));
+        }
+
+        return 0 == mprotect(buffer, buffer_size, PROT_READ | PROT_EXEC);
+}
+
+void run_jit()
+{
+        void (*jit_enter)(jit_state *, void const *);
+        jit_state state;
+
+        if(NULL == vm_current->jit) {
+                vm_current->jit = vm_allocate(sizeof(jit_workspace));
+        }
+
+        if(!jit_compile()) {
+                run_threaded();
+                return;
+        }
+
+        jit_enter = (void (*)(jit_state *, void const *)) buffer;
+        state.stack = vm_stack;
+        state.memory = vm_memory;
+        state.sp = vm_stack_pointer;
+        state.pc = 0;
+
+        for(;;) {
+                jit_enter(&state, buffer + ((state.pc < vm_program_size) ?
+                                            block_offset[state.pc] : halt_offset));
+
+                vm_stack_pointer = state.sp;
+                vm_command_pointer = state.pc;
+
+                switch(state.status) {
+                case JIT_STOP:
+                        return;
+
+                case JIT_ERROR:
+                        vm_error(state.error);
+                        return;
+
+                default:
+                        /* Блок, который нельзя исполнить без ошибок стека,
+                         * или команда, не поддержанная компилятором.
+                         */
+                        if(!run_until_leader(is_leader)) {
+                                return;
+                        }
+                        state.sp = vm_stack_pointer;
+                        state.pc = vm_command_pointer;
+                }
+        }
+}
+
+#else
+
+void run_jit()
+{
+        run_threaded();
+}
+
+void release_jit(vm_context *vm)
+{
+}
+
+#endif
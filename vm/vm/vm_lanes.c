@@ -0,0 +1,797 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+/* Исполнение одной программы для многих входных записей в синхронных
+ * дорожках (mvm --lanes).
+ *
+ * Запись - строка входного файла с входными данными одного независимого
+ * запуска программы. Запуски исполняются группой из VECTOR_LANES
+ * дорожек, каждая команда исполняется сразу для всех дорожек группы
+ * векторными операциями. Дорожка, закончившая запись, сразу начинает
+ * следующую, поэтому программы с разным числом повторений циклов
+ * не оставляют дорожки пустыми. Стек и память данных группы хранятся строками:
+ * строка - слово стека или памяти всех дорожек, у каждой дорожки свой
+ * столбец. У проверенной программы глубина стека перед командой
+ * не зависит от пути (verify_program()), поэтому указатель стека общий
+ * для всех дорожек и берётся из vm_stack_depth.
+ *
+ * У каждой дорожки свой адрес следующей команды. Исполняются дорожки
+ * с наименьшим адресом (маска исполняемых дорожек), остальные ждут.
+ * Дорожки, разошедшиеся на JUMP_YES или JUMP_NO, снова исполняются
+ * вместе, когда отставшие дойдут до адреса ожидающих: после ветвления -
+ * на его конце, после цикла - на выходе из него. Запись в стек и память
+ * меняет только столбцы дорожек из маски.
+ *
+ * INPUT и PRINT исполняются по одной дорожке: число читается из своей
+ * записи и выводится в свой буфер. Дорожка, на которой команда
+ * закончилась бы ошибкой (деление на ноль, адрес вне строк памяти
+ * группы, ошибка ввода), выходит из группы: её стек и память переносятся
+ * в обычный контекст, и программа продолжается с той же команды
+ * интерпретатором с проверками. Он и сообщает об ошибке, или продолжает
+ * исполнение, например для адреса за плотной страницей памяти данных.
+ *
+ * Векторные операции записаны векторными типами GCC, функция исполнения
+ * группы собирается в вариантах для AVX-512, AVX2 и базового набора
+ * команд процессора, вариант выбирается при запуске. Без векторных типов
+ * компилятора и для непроверенных программ записи исполняются по одной.
+ */
+
+#define VECTOR_LANES    16
+
+/* Число записей, вывод которых записывается вместе */
+#define LANES_CHUNK     4096
+
+/* Адрес дорожки, которая не ждёт исполнения */
+#define NO_ADDRESS      UINT_MAX
+
+#ifdef __GNUC__
+#define HAVE_VECTOR
+typedef int lane_vector __attribute__((vector_size(VECTOR_LANES * sizeof(int))));
+#endif
+
+#if defined(HAVE_VECTOR) && defined(__x86_64__) && defined(__linux__) && \
+    !defined(__clang__) && __GNUC__ >= 6
+#define HAVE_CLONES
+#define LANES_TARGETS   __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LANES_TARGETS
+#endif
+
+/* Запись и результат её запуска */
+typedef struct {
+        unsigned char const *start;     /* Текст записи */
+        unsigned char const *end;
+        run_result result;
+} lane_record;
+
+/* Дорожка группы */
+typedef struct {
+        lane_record *record;
+        input_source source;            /* Непрочитанная часть записи */
+} lane;
+
+typedef struct {
+        lane lanes[VECTOR_LANES];
+        /* Адрес следующей команды дорожки, NO_ADDRESS - дорожка свободна */
+        unsigned int address[VECTOR_LANES];
+        unsigned int active;            /* Маска незавершённых дорожек */
+        unsigned int width;             /* Маска дорожек группы (--lanes) */
+
+        /* Записи, ещё не начатые на дорожках: [next, end) */
+        lane_record *next;
+        lane_record *end;
+
+#ifdef HAVE_VECTOR
+        lane_vector *stack;             /* stack_rows строк стека */
+        lane_vector *memory;            /* memory_rows строк памяти данных */
+#endif
+        void *rows;                     /* Выделенная память строк */
+
+        /* Контекст для дорожек, вышедших из группы */
+        vm_context *scalar;
+
+        unsigned long steps;            /* Команды, исполненные группами */
+        unsigned long lockstep;         /* Команды дорожек в группах */
+        unsigned long instructions;     /* Все команды дорожек */
+        unsigned long left;             /* Дорожки, вышедшие из групп */
+} lane_group;
+
+/* Контекст с загруженной программой */
+static vm_context *master;
+
+/* Программа исполняется группами: проверена и есть векторные типы */
+static int lockstep;
+
+/* Число слов памяти данных и стека в строках группы. Если в программе
+ * нет BLOAD и BSTORE, память группы кончается на наибольшем адресе
+ * LOAD и STORE, и начальные значения копируются только для него.
+ */
+static unsigned int memory_rows;
+static unsigned int stack_rows;
+
+static int lane_read(void *data, int *value)
+{
+        return read_input(&((lane *) data)->source, value);
+}
+
+static void lane_write(void *data, int value)
+{
+        append_result(&((lane *) data)->record->result, value);
+}
+
+/* Продолжение программы дорожки index с команды address
+ * интерпретатором с проверками.
+ */
+static void run_scalar(lane_group *group, unsigned int index, unsigned int address)
+{
+        vm_context *vm = group->scalar;
+        lane *current = &group->lanes[index];
+        run_result *result = &current->record->result;
+
+        if(!copy_memory(vm, master)) {
+                result->status = VM_NO_MEMORY;
+                return;
+        }
+
+        vm->stack_pointer = 0;
+#ifdef HAVE_VECTOR
+        if(lockstep) {
+                unsigned int depth = master->verify->depth[address];
+                unsigned int i;
+
+                for(i = 0; i < memory_rows; ++i) {
+                        vm->memory[i] = group->memory[i][index];
+                }
+                for(i = 0; i < depth; ++i) {
+                        vm->stack[i] = group->stack[i][index];
+                }
+                vm->stack_pointer = depth;
+        }
+#endif
+        vm->command_pointer = address;
+        vm->instructions = 0;
+        vm_context_set_io(vm, lane_read, lane_write, current);
+
+        result->status = vm_context_resume(vm, ULONG_MAX);
+        result->error = vm->error;
+        result->address = vm->error_address;
+        group->instructions += vm->instructions;
+}
+
+/* Выход дорожек bits из группы перед командой address */
+static void leave_group(lane_group *group, unsigned int bits, unsigned int address)
+{
+        unsigned int i;
+
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                if(bits & (1u << i)) {
+                        run_scalar(group, i, address);
+                        group->address[i] = NO_ADDRESS;
+                        ++group->left;
+                }
+        }
+        group->active &= ~bits;
+}
+
+/* Начало следующих записей на свободных дорожках группы */
+static void fill_lanes(lane_group *group)
+{
+        unsigned int i;
+
+        for(i = 0; i < VECTOR_LANES && group->next < group->end; ++i) {
+                unsigned int bit = 1u << i;
+                lane_record *record;
+
+                if(0 == (group->width & bit) || 0 != (group->active & bit)) {
+                        continue;
+                }
+
+                record = group->next++;
+                group->lanes[i].record = record;
+                open_input_memory(&group->lanes[i].source, record->start,
+                                  record->end - record->start, INPUT_TEXT);
+                group->address[i] = 0;
+                group->active |= bit;
+
+#ifdef HAVE_VECTOR
+                if(lockstep) {
+                        unsigned int j;
+
+                        for(j = 0; j < memory_rows; ++j) {
+                                group->memory[j][i] = master->memory[j];
+                        }
+                }
+#endif
+        }
+}
+
+#ifdef HAVE_VECTOR
+
+/* Запись адреса address для дорожек bits */
+static inline void set_address(lane_group *group, unsigned int bits, unsigned int address)
+{
+        int i;
+
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                group->address[i] = (bits & (1u << i)) ? address : group->address[i];
+        }
+}
+
+/* Выбор исполняемых дорожек: дорожки с наименьшим адресом. Возвращает
+ * этот адрес (NO_ADDRESS, если дорожек не осталось), маску дорожек
+ * в *bits и наименьший адрес остальных дорожек в *next. Циклы без
+ * ветвлений по данным дорожек собираются в векторные команды.
+ */
+static inline unsigned int schedule(lane_group const *group, unsigned int *bits,
+                                    unsigned int *next)
+{
+        unsigned int const *address = group->address;
+        unsigned int lowest = NO_ADDRESS;
+        unsigned int second = NO_ADDRESS;
+        unsigned int lanes = 0;
+        int i;
+
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                lowest = (address[i] < lowest) ? address[i] : lowest;
+        }
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                lanes |= (unsigned int) (address[i] == lowest) << i;
+        }
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                unsigned int other = (address[i] != lowest) ? address[i] : NO_ADDRESS;
+
+                second = (other < second) ? other : second;
+        }
+
+        *bits = (NO_ADDRESS != lowest) ? lanes : 0;
+        *next = second;
+        return lowest;
+}
+
+/* Смешивание: слова new в дорожках mask, old - в остальных */
+#define BLEND(mask, new, old)   (((new) & (mask)) | ((old) & ~(mask)))
+
+/* Маска дорожек с ненулевым словом в строке row */
+static inline unsigned int nonzero_lanes(lane_vector const *row)
+{
+        unsigned int bits = 0;
+        int i;
+
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                bits |= (unsigned int) ((*row)[i] != 0) << i;
+        }
+
+        return bits;
+}
+
+/* Бит каждой дорожки в маске */
+static lane_vector const lane_bits = {
+        1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+        1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15
+};
+
+/* Вектор маски bits: -1 в дорожках маски, 0 в остальных */
+#define MASK_VECTOR(bits)       ((lane_bits & (int) (bits)) != 0)
+
+/* Исполнение записей [group->next, group->end) группой. Дорожка,
+ * завершившая свою запись, начинает следующую; новая дорожка исполняется
+ * одна, пока не догонит остальные.
+ */
+static LANES_TARGETS void run_group(lane_group *group)
+{
+        command const *program = master->program;
+        unsigned int size = master->program_size;
+        int const *depth = master->verify->depth;
+        lane_vector *stack = group->stack;
+        lane_vector *memory = group->memory;
+        unsigned int rows = memory_rows;
+        unsigned long steps = 0;
+        unsigned long instructions = 0;
+        unsigned int executing;
+        unsigned int bits;
+        unsigned int next;
+        unsigned int pc;
+        lane_vector mask;
+
+        fill_lanes(group);
+        pc = schedule(group, &bits, &next);
+        mask = MASK_VECTOR(bits);
+        executing = __builtin_popcount(bits);
+
+        while(NO_ADDRESS != pc) {
+                command const *cmd;
+                lane_vector *top;
+                unsigned int address;
+                unsigned int drop = 0;
+                unsigned int taken;
+                int value;
+                int i;
+
+                if(pc >= size) {
+                        /* Дальше в памяти команд только NOP */
+                        group->active &= ~bits;
+                        set_address(group, bits, NO_ADDRESS);
+                        goto reschedule;
+                }
+
+                cmd = &program[pc];
+                top = stack + depth[pc];
+                ++steps;
+                instructions += executing;
+
+                switch(cmd->operation) {
+                case STOP:
+                        group->active &= ~bits;
+                        set_address(group, bits, NO_ADDRESS);
+                        goto reschedule;
+
+                case LOAD:
+                        address = cmd->arg;
+                        if(address >= rows) {
+                                drop = bits;
+                                break;
+                        }
+                        top[0] = BLEND(mask, memory[address], top[0]);
+                        break;
+
+                case STORE:
+                        address = cmd->arg;
+                        if(address >= rows) {
+                                drop = bits;
+                                break;
+                        }
+                        memory[address] = BLEND(mask, top[-1], memory[address]);
+                        break;
+
+                case BLOAD:
+                        for(i = 0; i < VECTOR_LANES; ++i) {
+                                if(bits & (1u << i)) {
+                                        address = (unsigned int) cmd->arg + top[-1][i];
+                                        if(address >= rows) {
+                                                drop |= 1u << i;
+                                        }
+                                        else {
+                                                top[-1][i] = memory[address][i];
+                                        }
+                                }
+                        }
+                        break;
+
+                case BSTORE:
+                        for(i = 0; i < VECTOR_LANES; ++i) {
+                                if(bits & (1u << i)) {
+                                        address = (unsigned int) cmd->arg + top[-1][i];
+                                        if(address >= rows) {
+                                                drop |= 1u << i;
+                                        }
+                                        else {
+                                                memory[address][i] = top[-2][i];
+                                        }
+                                }
+                        }
+                        break;
+
+                case PUSH:
+                        top[0] = BLEND(mask, (lane_vector) {0} + cmd->arg, top[0]);
+                        break;
+
+                case DUP:
+                        top[0] = BLEND(mask, top[-1], top[0]);
+                        break;
+
+                case INVERT:
+                        top[-1] = BLEND(mask, -top[-1], top[-1]);
+                        break;
+
+                case ADD:
+                        top[-2] = BLEND(mask, top[-2] + top[-1], top[-2]);
+                        break;
+
+                case SUB:
+                        top[-2] = BLEND(mask, top[-2] - top[-1], top[-2]);
+                        break;
+
+                case MULT:
+                        top[-2] = BLEND(mask, top[-2] * top[-1], top[-2]);
+                        break;
+
+                case DIV:
+                        /* Векторного деления целых нет */
+                        for(i = 0; i < VECTOR_LANES; ++i) {
+                                if(bits & (1u << i)) {
+                                        if(0 == top[-1][i] ||
+                                           DIVISION_OVERFLOWS(top[-2][i], top[-1][i])) {
+                                                drop |= 1u << i;
+                                        }
+                                        else {
+                                                top[-2][i] /= top[-1][i];
+                                        }
+                                }
+                        }
+                        break;
+
+                case COMPARE:
+                        switch(cmd->arg) {
+                        case EQ:
+                                top[-2] = BLEND(mask, -(top[-2] == top[-1]), top[-2]);
+                                break;
+
+                        case NE:
+                                top[-2] = BLEND(mask, -(top[-2] != top[-1]), top[-2]);
+                                break;
+
+                        case LT:
+                                top[-2] = BLEND(mask, -(top[-2] < top[-1]), top[-2]);
+                                break;
+
+                        case GT:
+                                top[-2] = BLEND(mask, -(top[-2] > top[-1]), top[-2]);
+                                break;
+
+                        case LE:
+                                top[-2] = BLEND(mask, -(top[-2] <= top[-1]), top[-2]);
+                                break;
+
+                        default:
+                                top[-2] = BLEND(mask, -(top[-2] >= top[-1]), top[-2]);
+                        }
+                        break;
+
+                case JUMP:
+                        taken = bits;
+                        goto jump;
+
+                case JUMP_YES:
+                        taken = nonzero_lanes(&top[-1]) & bits;
+                        goto jump;
+
+                case JUMP_NO:
+                        taken = ~nonzero_lanes(&top[-1]) & bits;
+                        goto jump;
+
+                case INPUT:
+                        for(i = 0; i < VECTOR_LANES; ++i) {
+                                if(bits & (1u << i)) {
+                                        input_source *source = &group->lanes[i].source;
+                                        unsigned char const *position = source->position;
+
+                                        if(read_input(source, &value)) {
+                                                top[0][i] = value;
+                                        }
+                                        else {
+                                                /* Интерпретатор прочитает число заново */
+                                                source->position = position;
+                                                drop |= 1u << i;
+                                        }
+                                }
+                        }
+                        break;
+
+                case PRINT:
+                        for(i = 0; i < VECTOR_LANES; ++i) {
+                                if(bits & (1u << i)) {
+                                        append_result(&group->lanes[i].record->result, top[-1][i]);
+                                }
+                        }
+                        break;
+
+                default:
+                        break;
+                }
+
+                if(0 != drop) {
+                        /* Команда не исполнена на дорожках drop */
+                        instructions -= __builtin_popcount(drop);
+                        leave_group(group, drop, pc);
+                        bits &= ~drop;
+                        if(0 == bits) {
+                                goto reschedule;
+                        }
+                        mask = MASK_VECTOR(bits);
+                        executing = __builtin_popcount(bits);
+                }
+
+                ++pc;
+                if(pc < next) {
+                        continue;
+                }
+                set_address(group, bits, pc);
+                goto reschedule;
+
+        jump:
+                if(taken == bits && (unsigned int) cmd->arg < next) {
+                        pc = cmd->arg;
+                        continue;
+                }
+                if(0 == taken && pc + 1 < next) {
+                        ++pc;
+                        continue;
+                }
+                set_address(group, taken, cmd->arg);
+                set_address(group, bits & ~taken, pc + 1);
+
+        reschedule:
+                if(group->active != group->width && group->next < group->end) {
+                        fill_lanes(group);
+                }
+                pc = schedule(group, &bits, &next);
+                mask = MASK_VECTOR(bits);
+                executing = __builtin_popcount(bits);
+        }
+
+        group->steps += steps;
+        group->lockstep += instructions;
+        group->instructions += instructions;
+}
+
+/* Наибольший адрес памяти данных, к которому обращаются дорожки группы */
+static unsigned int count_memory_rows()
+{
+        unsigned int rows = 0;
+        unsigned int i;
+
+        for(i = 0; i < master->program_size; ++i) {
+                command const *cmd = &master->program[i];
+
+                if(BLOAD == cmd->operation || BSTORE == cmd->operation) {
+                        return DENSE_MEMORY_SIZE;
+                }
+                if((LOAD == cmd->operation || STORE == cmd->operation) &&
+                   (unsigned int) cmd->arg < DENSE_MEMORY_SIZE && (unsigned int) cmd->arg >= rows) {
+                        rows = cmd->arg + 1;
+                }
+        }
+
+        return rows;
+}
+
+/* Выделение строк группы, выровненных на размер вектора */
+static int allocate_rows(lane_group *group)
+{
+        size_t count = stack_rows + memory_rows;
+        char *rows = malloc((count + 1) * sizeof(lane_vector));
+
+        if(NULL == rows) {
+                return 0;
+        }
+
+        group->rows = rows;
+        rows += sizeof(lane_vector) - (size_t) rows % sizeof(lane_vector);
+        group->stack = (lane_vector *) rows;
+        group->memory = group->stack + stack_rows;
+        return 1;
+}
+
+#else
+
+static void run_group(lane_group *group)
+{
+}
+
+static unsigned int count_memory_rows()
+{
+        return 0;
+}
+
+static int allocate_rows(lane_group *group)
+{
+        group->rows = NULL;
+        return 1;
+}
+
+#endif
+
+/* Набор команд процессора, на котором исполняются группы */
+static char const *lanes_target()
+{
+        if(!lockstep) {
+                return "scalar";
+        }
+#ifdef HAVE_CLONES
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")) {
+                return "avx512f";
+        }
+        if(__builtin_cpu_supports("avx2")) {
+                return "avx2";
+        }
+#endif
+        return "generic";
+}
+
+/* Чтение файла name ("stdin" - стандартный ввод) целиком */
+static unsigned char *read_all(char const *name, size_t *length)
+{
+        FILE *stream = (0 == strcmp(name, "stdin")) ? stdin : fopen(name, "rb");
+        unsigned char *data = NULL;
+        size_t capacity = 0;
+        size_t used = 0;
+
+        if(NULL == stream) {
+                return NULL;
+        }
+
+        for(;;) {
+                if(used == capacity) {
+                        unsigned char *larger;
+
+                        capacity = capacity ? 2 * capacity : INPUT_BLOCK_SIZE;
+                        larger = realloc(data, capacity);
+                        if(NULL == larger) {
+                                free(data);
+                                data = NULL;
+                                break;
+                        }
+                        data = larger;
+                }
+
+                used += fread(data + used, 1, capacity - used, stream);
+                if(used < capacity) {
+                        break;
+                }
+        }
+
+        if(stdin != stream) {
+                fclose(stream);
+        }
+
+        *length = used;
+        return data;
+}
+
+/* Разбиение текста на записи по строкам. Возвращает число записей
+ * или 0, если не хватило памяти (*records == NULL).
+ */
+static unsigned long split_records(unsigned char const *text, size_t length,
+                                   lane_record **records)
+{
+        unsigned char const *end = text + length;
+        unsigned char const *p;
+        unsigned long count = 0;
+        unsigned long i = 0;
+
+        for(p = text; p < end; ++p) {
+                count += ('\n' == *p);
+        }
+        if(length > 0 && '\n' != end[-1]) {
+                ++count;
+        }
+
+        *records = calloc(count > 0 ? count : 1, sizeof(lane_record));
+        if(NULL == *records) {
+                return 0;
+        }
+
+        for(p = text; p < end; ++i) {
+                unsigned char const *line = memchr(p, '\n', end - p);
+
+                (*records)[i].start = p;
+                (*records)[i].end = (NULL != line) ? line : end;
+                p = (NULL != line) ? line + 1 : end;
+        }
+
+        return count;
+}
+
+int run_lanes(char const *program, char const *input, int lanes)
+{
+        vm_context *previous = vm_current;
+        verify_result result;
+        lane_group *group;
+        lane_record *records;
+        unsigned char *text;
+        size_t length = 0;
+        unsigned long count;
+        unsigned long errors = 0;
+        unsigned long first;
+        unsigned long i;
+        double start;
+        double elapsed;
+
+        if(lanes <= 0 || lanes > VECTOR_LANES) {
+                lanes = VECTOR_LANES;
+        }
+
+        master = vm_context_create();
+        group = calloc(1, sizeof(lane_group));
+        if(NULL == master || NULL == group) {
+                printf("Not enough memory\n");
+                return 1;
+        }
+
+        printf("Reading input from %s\n", program);
+        vm_context_set_memory(master, vm_memory_size);
+        if(VM_OK != vm_context_load(master, program)) {
+                printf("Unable to load %s\n", program);
+                return 1;
+        }
+
+        vm_current = master;
+        verify_program(&result);
+        vm_current = previous;
+        if(VERIFY_CONFLICT == result.status) {
+                fprintf(stderr, "Verification failed at %u: stack depth depends on the path, "
+                        "running records one by one\n", result.address);
+        }
+        else if(VERIFY_ERROR == result.status) {
+                fprintf(stderr, "Verification failed at %u: %s, running records one by one\n",
+                        result.address, vm_error_message(result.error));
+        }
+#ifdef HAVE_VECTOR
+        lockstep = (VERIFY_OK == result.status);
+#endif
+        if(!lockstep) {
+                lanes = 1;
+        }
+
+        text = read_all(input, &length);
+        if(NULL == text) {
+                printf("Unable to read %s\n", input);
+                return 1;
+        }
+        count = split_records(text, length, &records);
+
+        memory_rows = lockstep ? count_memory_rows() : 0;
+        stack_rows = lockstep ? result.max_depth + 1 : 0;
+        group->scalar = vm_context_create();
+        if(NULL == records || NULL == group->scalar ||
+           VM_OK != vm_context_share(group->scalar, master) || !allocate_rows(group)) {
+                printf("Not enough memory\n");
+                return 1;
+        }
+
+        start = wall_clock();
+
+        group->width = (1u << lanes) - 1;
+        for(i = 0; i < VECTOR_LANES; ++i) {
+                group->address[i] = NO_ADDRESS;
+        }
+        for(first = 0; first < count; first += LANES_CHUNK) {
+                unsigned long last = (count - first < LANES_CHUNK) ? count : first + LANES_CHUNK;
+
+                group->next = records + first;
+                group->end = records + last;
+                if(lockstep) {
+                        run_group(group);
+                }
+                else {
+                        while(group->next < group->end) {
+                                fill_lanes(group);
+                                leave_group(group, group->active, 0);
+                        }
+                }
+
+                for(i = first; i < last; ++i) {
+                        char number[32];
+
+                        sprintf(number, "%lu", i + 1);
+                        errors += (VM_OK != records[i].result.status);
+                        write_result(&records[i].result, number);
+                }
+        }
+
+        elapsed = wall_clock() - start;
+        flush_output();
+
+        printf("Lanes: %lu records, %d lanes (%s), %lu errors, %lu left lockstep\n",
+               count, lanes, lanes_target(), errors, lockstep ? group->left : 0);
+        printf("Time: %.3f s, %.1f records/s, %.0f instructions/s\n", elapsed,
+               (elapsed > 0) ? count / elapsed : 0.0,
+               (elapsed > 0) ? group->instructions / elapsed : 0.0);
+        if(0 != group->steps) {
+                printf("Lockstep: %lu commands, %.2f lanes per command\n", group->steps,
+                       (double) group->lockstep / group->steps);
+        }
+
+        vm_context_destroy(group->scalar);
+        vm_context_destroy(master);
+        free(group->rows);
+        free(group);
+        free(records);
+        free(text);
+
+        return errors > 0;
+}
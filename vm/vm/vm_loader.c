@@ -0,0 +1,416 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Загрузка программы из текста (.ms).
+ *
+ * Текст разбирается за один проход прямо в отображённом в память файле,
+ * без копирования и без глобального состояния, поэтому файлы могут
+ * загружаться одновременно в разных потоках. Грамматика та же, что
+ * в vmlex.l и vmparse.y: программа - непустая последовательность строк
+ *
+ *      адрес: команда [аргумент]
+ *      SET адрес значение
+ *
+ * Лексемы разделяются пробелами, табуляциями и переводами строк (в том
+ * числе внутри строки программы), комментарий - от ';' до конца строки.
+ * Как и в vmlex.l, из букв берётся самое длинное ключевое слово,
+ * а число переводится функцией atoi(). Ошибка сообщается с номером
+ * строки, после неё загрузка прекращается.
+ *
+ * Комментарий "; line N" сразу после команды (его пишет компилятор
+ * Милана) записывается в таблицу строк контекста.
+ */
+
+/* Лексемы */
+typedef enum {
+        TOKEN_END,              /* Конец текста */
+        TOKEN_INT,              /* Число */
+        TOKEN_COLON,            /* : */
+        TOKEN_SET,              /* SET */
+        TOKEN_OPERATION,        /* Код команды */
+        TOKEN_BAD               /* Символ, с которого не начинается лексема */
+} token_kind;
+
+typedef struct {
+        char const *position;
+        char const *end;
+        unsigned int line;      /* Строка текущей лексемы */
+        int value;              /* Число или код команды текущей лексемы */
+} scanner;
+
+/* Число со знаком в начале текста: как atoi(), при переполнении
+ * long берётся LONG_MAX или LONG_MIN.
+ */
+static int scan_int(scanner *s)
+{
+        char const *p = s->position;
+        unsigned long value = 0;
+        int negative = 0;
+        int overflow = 0;
+
+        if('-' == *p) {
+                negative = 1;
+                ++p;
+        }
+
+        for(; p < s->end && *p >= '0' && *p <= '9'; ++p) {
+                unsigned int digit = *p - '0';
+
+                if(value > ((unsigned long) LONG_MAX - digit) / 10) {
+                        overflow = 1;
+                }
+                else {
+                        value = value * 10 + digit;
+                }
+        }
+        s->position = p;
+
+        if(overflow) {
+                return (int) (negative ? LONG_MIN : LONG_MAX);
+        }
+        return (int) (negative ? -(long) value : (long) value);
+}
+
+/* Ключевые слова; op - код команды или -1 для SET */
+static struct {
+        char const *name;
+        size_t length;
+        int op;
+} const keywords[] = {
+        {"NOP",      3, NOP},
+        {"STOP",     4, STOP},
+        {"LOAD",     4, LOAD},
+        {"STORE",    5, STORE},
+        {"BLOAD",    5, BLOAD},
+        {"BSTORE",   6, BSTORE},
+        {"PUSH",     4, PUSH},
+        {"POP",      3, POP},
+        {"DUP",      3, DUP},
+        {"INVERT",   6, INVERT},
+        {"ADD",      3, ADD},
+        {"SUB",      3, SUB},
+        {"MULT",     4, MULT},
+        {"DIV",      3, DIV},
+        {"COMPARE",  7, COMPARE},
+        {"JUMP",     4, JUMP},
+        {"JUMP_YES", 8, JUMP_YES},
+        {"JUMP_NO",  7, JUMP_NO},
+        {"INPUT",    5, INPUT},
+        {"PRINT",    5, PRINT},
+        {"SET",      3, -1}
+};
+
+#define KEYWORDS_COUNT  (sizeof(keywords) / sizeof(keywords[0]))
+
+static token_kind keyword_token(scanner *s, unsigned int k)
+{
+        s->position += keywords[k].length;
+        if(keywords[k].op < 0) {
+                return TOKEN_SET;
+        }
+
+        s->value = keywords[k].op;
+        return TOKEN_OPERATION;
+}
+
+/* Ключевое слово в начале текста. Обычно оно совпадает со всем словом
+ * из букв и '_'; иначе, как в vmlex.l, берётся самое длинное ключевое
+ * слово, которым начинается текст.
+ */
+static token_kind scan_keyword(scanner *s)
+{
+        char const *p = s->position;
+        size_t available = s->end - p;
+        size_t length = 0;
+        size_t longest = 0;
+        unsigned int found = KEYWORDS_COUNT;
+        unsigned int k;
+
+        while(length < available && (('A' <= p[length] && p[length] <= 'Z') || '_' == p[length])) {
+                ++length;
+        }
+
+        for(k = 0; k < KEYWORDS_COUNT; ++k) {
+                if(keywords[k].length == length && keywords[k].name[0] == p[0] &&
+                   0 == memcmp(keywords[k].name, p, length)) {
+                        return keyword_token(s, k);
+                }
+        }
+
+        for(k = 0; k < KEYWORDS_COUNT; ++k) {
+                if(keywords[k].length > longest && keywords[k].length <= available &&
+                   0 == memcmp(keywords[k].name, p, keywords[k].length)) {
+                        longest = keywords[k].length;
+                        found = k;
+                }
+        }
+
+        return (found < KEYWORDS_COUNT) ? keyword_token(s, found) : TOKEN_BAD;
+}
+
+/* Следующая лексема */
+static token_kind next_token(scanner *s)
+{
+        char const *p = s->position;
+        char const *end = s->end;
+
+        for(;;) {
+                while(p < end && (' ' == *p || '\t' == *p || '\r' == *p)) {
+                        ++p;
+                }
+                if(p == end) {
+                        s->position = p;
+                        return TOKEN_END;
+                }
+
+                if('\n' == *p) {
+                        ++s->line;
+                        ++p;
+                }
+                else if(';' == *p) {
+                        p = memchr(p, '\n', end - p);
+                        if(NULL == p) {
+                                p = end;
+                        }
+                }
+                else {
+                        break;
+                }
+        }
+
+        s->position = p;
+
+        if(*p >= '0' && *p <= '9') {
+                s->value = scan_int(s);
+                return TOKEN_INT;
+        }
+        if('-' == *p && p + 1 < end && p[1] >= '0' && p[1] <= '9') {
+                s->value = scan_int(s);
+                return TOKEN_INT;
+        }
+        if(':' == *p) {
+                ++s->position;
+                return TOKEN_COLON;
+        }
+        if(*p >= 'A' && *p <= 'Z') {
+                return scan_keyword(s);
+        }
+
+        return TOKEN_BAD;
+}
+
+/* Номер строки N из комментария "; line N" в начале текста после
+ * пробелов или 0, если такого комментария нет.
+ */
+static unsigned int comment_line(scanner const *s)
+{
+        char const *p = s->position;
+        char const *end = s->end;
+        unsigned int line = 0;
+
+        while(p < end && (' ' == *p || '\t' == *p || '\r' == *p)) {
+                ++p;
+        }
+        if(end - p < 7 || 0 != memcmp(p, "; line ", 7)) {
+                return 0;
+        }
+
+        for(p += 7; p < end && *p >= '0' && *p <= '9' && line < UINT_MAX / 10; ++p) {
+                line = 10 * line + (*p - '0');
+        }
+
+        return line;
+}
+
+/* Запись строки line в таблицу строк для команды address */
+static void set_source_line(unsigned int address, unsigned int line)
+{
+        if(!vm_source_lines_loaded) {
+                /* Без таблицы строк программа исполняется так же */
+                if(NULL == vm_source_line) {
+                        vm_source_line = malloc(MAX_PROGRAM_SIZE * sizeof(unsigned int));
+                        if(NULL == vm_source_line) {
+                                return;
+                        }
+                }
+                memset(vm_source_line, 0, MAX_PROGRAM_SIZE * sizeof(unsigned int));
+                vm_source_lines_loaded = 1;
+        }
+
+        vm_source_line[address] = line;
+}
+
+static int load_error(char const *name, unsigned int line, char const *message)
+{
+        printf("Error: %s in %s at line %u\n", message, name, line);
+        return 0;
+}
+
+/* Число после команды или адреса SET */
+static int expect_int(scanner *s, int *value)
+{
+        if(TOKEN_INT != next_token(s)) {
+                return 0;
+        }
+
+        *value = s->value;
+        return 1;
+}
+
+int load_source_text(char const *name, char const *text, size_t length)
+{
+        scanner s;
+        token_kind token;
+
+        s.position = text;
+        s.end = text + length;
+        s.line = 1;
+
+        token = next_token(&s);
+        if(TOKEN_END == token) {
+                return load_error(name, s.line, "empty program");
+        }
+
+        do {
+                unsigned int line = s.line;
+                int address = s.value;
+                int value = 0;
+
+                if(TOKEN_SET == token) {
+                        if(!expect_int(&s, &address) || !expect_int(&s, &value)) {
+                                return load_error(name, s.line, "syntax error");
+                        }
+                        if((unsigned int) address >= vm_memory_size) {
+                                return load_error(name, line, "illegal address in SET");
+                        }
+                        set_mem(address, value);
+                }
+                else if(TOKEN_INT == token) {
+                        operation op;
+                        unsigned int source_line;
+
+                        if(TOKEN_COLON != next_token(&s) ||
+                           TOKEN_OPERATION != next_token(&s)) {
+                                return load_error(name, s.line, "syntax error");
+                        }
+
+                        op = (operation) s.value;
+                        if(operation_info(op)->need_arg && !expect_int(&s, &value)) {
+                                return load_error(name, s.line, "syntax error");
+                        }
+                        if((unsigned int) address >= MAX_PROGRAM_SIZE) {
+                                return load_error(name, line, "illegal command address");
+                        }
+                        put_command(address, op, value);
+
+                        source_line = comment_line(&s);
+                        if(0 != source_line) {
+                                set_source_line(address, source_line);
+                        }
+                }
+                else {
+                        return load_error(name, s.line, "syntax error");
+                }
+
+                token = next_token(&s);
+        } while(TOKEN_END != token);
+
+        return 1;
+}
+
+/* Чтение всего потока in в память, выделенную malloc() */
+static char *read_stream(FILE *in, size_t *length)
+{
+        char *text = NULL;
+        size_t capacity = 0;
+        size_t size = 0;
+        size_t count;
+
+        do {
+                if(size == capacity) {
+                        char *grown;
+
+                        capacity = capacity ? 2 * capacity : INPUT_BLOCK_SIZE;
+                        grown = realloc(text, capacity);
+                        if(NULL == grown) {
+                                free(text);
+                                return NULL;
+                        }
+                        text = grown;
+                }
+                count = fread(text + size, 1, capacity - size, in);
+                size += count;
+        } while(count > 0);
+
+        *length = size;
+        return text;
+}
+
+int load_source(char const *file)
+{
+        char const *name = (NULL != file) ? file : "stdin";
+        char *text = NULL;
+        size_t length = 0;
+        int mapped = 0;
+        int result;
+
+#ifdef HAVE_MMAP
+        if(NULL != file) {
+                struct stat info;
+                int fd = open(file, O_RDONLY);
+
+                if(fd < 0) {
+                        return 0;
+                }
+
+                /* Пустой файл не отображается, его читает read_stream() */
+                if(0 == fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+                        text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if(MAP_FAILED != text) {
+                                length = info.st_size;
+                                mapped = 1;
+                        }
+                }
+                close(fd);
+        }
+#endif
+
+        if(!mapped) {
+                FILE *in = (NULL != file) ? fopen(file, "rb") : stdin;
+
+                if(NULL == in) {
+                        return 0;
+                }
+                text = read_stream(in, &length);
+                if(in != stdin) {
+                        fclose(in);
+                }
+                if(NULL == text) {
+                        printf("Not enough memory to read %s\n", name);
+                        return -1;
+                }
+        }
+
+        result = load_source_text(name, text, length) ? 1 : -1;
+
+#ifdef HAVE_MMAP
+        if(mapped) {
+                munmap(text, length);
+                return result;
+        }
+#endif
+        free(text);
+
+        return result;
+}
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+/* Память данных.
+ *
+ * Слова с адресами меньше DENSE_MEMORY_SIZE лежат в массиве memory
+ * контекста (плотная страница), ядра читают и пишут их напрямую.
+ * Остальная память, до vm_memory_size слов, разбита на страницы
+ * по MEMORY_PAGE_SIZE слов. Страница выделяется при первой записи
+ * в неё, до этого все её слова читаются как 0; таблица страниц
+ * выделяется при первой записи за плотной страницей. Поэтому контекст,
+ * программе которого хватает плотной страницы, не тратит памяти
+ * на остальное адресное пространство, каким бы большим оно ни было.
+ *
+ * Страницы освобождаются только при очистке памяти (загрузка программы,
+ * смена размера памяти), поэтому во время запуска адреса слов
+ * не меняются и ядра могут хранить указатели на них.
+ */
+
+#define PAGE_MASK       (MEMORY_PAGE_SIZE - 1)
+
+unsigned int memory_pages(vm_context const *vm)
+{
+        return (vm->memory_size + PAGE_MASK) >> MEMORY_PAGE_BITS;
+}
+
+int const *memory_page(vm_context const *vm, unsigned int index)
+{
+        if(0 == index) {
+                return vm->memory;
+        }
+
+        return (NULL != vm->pages) ? vm->pages[index] : NULL;
+}
+
+void release_memory(vm_context *vm)
+{
+        unsigned int count = memory_pages(vm);
+        unsigned int i;
+
+        if(NULL == vm->pages) {
+                return;
+        }
+
+        for(i = 1; i < count; ++i) {
+                free(vm->pages[i]);
+        }
+        free(vm->pages);
+        vm->pages = NULL;
+}
+
+void clear_memory(vm_context *vm)
+{
+        memset(vm->memory, 0, sizeof(vm->memory));
+        release_memory(vm);
+}
+
+int *memory_word(unsigned int address)
+{
+        unsigned int index = address >> MEMORY_PAGE_BITS;
+
+        if(0 == index) {
+                return &vm_memory[address];
+        }
+
+        if(NULL == vm_current->pages) {
+                vm_current->pages = vm_allocate(memory_pages(vm_current) * sizeof(int *));
+        }
+        if(NULL == vm_current->pages[index]) {
+                vm_current->pages[index] = vm_allocate(MEMORY_PAGE_SIZE * sizeof(int));
+        }
+
+        return &vm_current->pages[index][address & PAGE_MASK];
+}
+
+int copy_memory(vm_context *vm, vm_context const *source)
+{
+        unsigned int count;
+        unsigned int i;
+
+        if(vm->memory_size != source->memory_size) {
+                release_memory(vm);
+                vm->memory_size = source->memory_size;
+        }
+
+        memcpy(vm->memory, source->memory, sizeof(vm->memory));
+
+        count = memory_pages(vm);
+        if(NULL == source->pages) {
+                /* Страницы остаются выделенными для следующих запусков */
+                for(i = 1; NULL != vm->pages && i < count; ++i) {
+                        if(NULL != vm->pages[i]) {
+                                memset(vm->pages[i], 0, MEMORY_PAGE_SIZE * sizeof(int));
+                        }
+                }
+                return 1;
+        }
+
+        if(NULL == vm->pages) {
+                vm->pages = calloc(count, sizeof(int *));
+                if(NULL == vm->pages) {
+                        return 0;
+                }
+        }
+
+        for(i = 1; i < count; ++i) {
+                if(NULL != source->pages[i]) {
+                        if(NULL == vm->pages[i]) {
+                                vm->pages[i] = malloc(MEMORY_PAGE_SIZE * sizeof(int));
+                                if(NULL == vm->pages[i]) {
+                                        return 0;
+                                }
+                        }
+                        memcpy(vm->pages[i], source->pages[i], MEMORY_PAGE_SIZE * sizeof(int));
+                }
+                else if(NULL != vm->pages[i]) {
+                        memset(vm->pages[i], 0, MEMORY_PAGE_SIZE * sizeof(int));
+                }
+        }
+
+        return 1;
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include "vm_internal.h"
+#include "vm_milan.h"
+
+/* Команда виртуальной машины для каждого номера enum Instruction
+ * (CodeGen.hpp): INVERT там стоит после DIV, а не после DUP.
+ */
+static operation const operations[] = {
+        NOP,
+        STOP,
+        LOAD,
+        STORE,
+        BLOAD,
+        BSTORE,
+        PUSH,
+        POP,
+        DUP,
+        ADD,
+        SUB,
+        MULT,
+        DIV,
+        INVERT,
+        COMPARE,
+        JUMP,
+        JUMP_YES,
+        JUMP_NO,
+        INPUT,
+        PRINT
+};
+
+#define OPERATIONS_COUNT        (sizeof(operations) / sizeof(operations[0]))
+
+vm_context *vm_milan_create()
+{
+        return vm_context_create();
+}
+
+void vm_milan_destroy(vm_context *vm)
+{
+        vm_context_destroy(vm);
+}
+
+int vm_milan_load(vm_context *vm, milan_command const *commands, unsigned int count)
+{
+        command *program;
+        unsigned int i;
+        vm_status status;
+
+        if(count > MAX_PROGRAM_SIZE) {
+                return 0;
+        }
+
+        program = malloc((count ? count : 1) * sizeof(command));
+        if(NULL == program) {
+                return 0;
+        }
+
+        for(i = 0; i < count; ++i) {
+                if(commands[i].op < 0 || (unsigned int) commands[i].op >= OPERATIONS_COUNT) {
+                        free(program);
+                        return 0;
+                }
+                program[i].operation = operations[commands[i].op];
+                program[i].arg = commands[i].arg;
+        }
+
+        status = vm_context_load_program(vm, program, count);
+        free(program);
+        return VM_OK == status;
+}
+
+int vm_milan_engine(char const *name, int *engine)
+{
+        vm_engine found;
+
+        if(!engine_by_name(name, &found)) {
+                return 0;
+        }
+
+        *engine = found;
+        return 1;
+}
+
+int vm_milan_run(vm_context *vm, vm_context const *loaded, int engine,
+                 int (*input)(void *data, int *value),
+                 void (*output)(void *data, int value), void *data)
+{
+        /* Переменные прошлого запуска не должны быть видны */
+        if(VM_OK != vm_context_share(vm, loaded)) {
+                vm->status = VM_NO_MEMORY;
+                return 0;
+        }
+
+        vm_context_set_io(vm, input, output, data);
+        return VM_OK == vm_context_run(vm, (vm_engine) engine);
+}
+
+void vm_milan_error(vm_context const *vm, char *text, size_t size)
+{
+        unsigned int address = 0;
+        char const *message = vm_context_error(vm, &address);
+
+        if(NULL != message) {
+                snprintf(text, size, "%s at address %u", message, address);
+        }
+        else if(VM_NO_MEMORY == vm->status) {
+                snprintf(text, size, "Not enough memory");
+        }
+        else {
+                snprintf(text, size, "VM error %d", (int) vm->status);
+        }
+}
@@ -0,0 +1,67 @@
+#ifndef _MILAN_VM_MILAN_H
+#define _MILAN_VM_MILAN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Виртуальная машина для компилятора Милана на C++ (Milan.cpp).
+ *
+ * Имена команд в vm.h совпадают с именами enum Instruction
+ * из CodeGen.hpp, поэтому компилятор не включает vm.h, а работает
+ * с машиной через эти функции: команды передаются парами чисел,
+ * контекст - неполным типом.
+ */
+
+struct vm_context;
+
+/* Команда компилятора: номер в enum Instruction и аргумент */
+typedef struct {
+        int op;
+        int arg;
+} milan_command;
+
+/* Создание пустого контекста. Возвращает NULL, если не хватило памяти. */
+
+struct vm_context *vm_milan_create();
+
+/* Уничтожение контекста (vm может быть NULL) */
+
+void vm_milan_destroy(struct vm_context *vm);
+
+/* Загрузка count команд компилятора в память команд контекста vm.
+ * Возвращает 0, если программа слишком длинная, в ней неизвестная
+ * команда или не хватило памяти.
+ */
+
+int vm_milan_load(struct vm_context *vm, milan_command const *commands, unsigned int count);
+
+/* Номер ядра по имени ("switch", "threaded", ...) в *engine.
+ * Возвращает 0, если такого ядра нет.
+ */
+
+int vm_milan_engine(char const *name, int *engine);
+
+/* Запуск программы контекста loaded в контексте vm ядром engine
+ * с памятью данных, какой она была сразу после загрузки. Команды
+ * INPUT и PRINT вызывают input и output с data. Возвращает 0 при
+ * ошибке, её текст - vm_milan_error().
+ */
+
+int vm_milan_run(struct vm_context *vm, struct vm_context const *loaded, int engine,
+                 int (*input)(void *data, int *value),
+                 void (*output)(void *data, int value), void *data);
+
+/* Текст ошибки последнего запуска в контексте vm с адресом команды
+ * (не больше size байт в text).
+ */
+
+void vm_milan_error(struct vm_context const *vm, char *text, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vm_internal.h"
+
+/* Буферизованный вывод команды PRINT.
+ *
+ * Числа накапливаются в буфере и записываются в выходной поток, когда
+ * буфер заполнен, перед чтением числа командой INPUT, перед сообщением
+ * об ошибке и по окончании работы программы. Поэтому порядок вывода
+ * в потоке ошибок не меняется, а вывод каждого числа не требует
+ * обращения к стандартной библиотеке.
+ *
+ * Буфер свой у каждого контекста, в выходной поток он записывается
+ * целиком одним вызовом fwrite(), поэтому контексты, одновременно
+ * исполняемые в разных потоках, не мешают друг другу, и вывод каждого
+ * из них не перемешивается с чужим внутри буфера. Выходной поток
+ * и формат вывода общие для процесса и задаются до запуска программ.
+ */
+
+#define OUTPUT_BUFFER_SIZE      65536
+
+/* Наибольшая длина записи одного числа: знак, 10 цифр и перевод строки */
+#define MAX_WORD_LENGTH         12
+
+struct output_buffer {
+        size_t used;
+        unsigned char data[OUTPUT_BUFFER_SIZE];
+};
+
+static FILE *target = NULL;
+static int need_close = 0;
+static output_format format = OUTPUT_TEXT;
+
+int set_output(char const *name)
+{
+        FILE *stream;
+
+        if(0 == strcmp(name, "stderr")) {
+                stream = stderr;
+        }
+        else if(0 == strcmp(name, "stdout")) {
+                stream = stdout;
+        }
+        else {
+                stream = fopen(name, "wb");
+                if(NULL == stream) {
+                        return 0;
+                }
+        }
+
+        flush_output();
+        if(need_close) {
+                fclose(target);
+        }
+
+        target = stream;
+        need_close = (stream != stderr && stream != stdout);
+        return 1;
+}
+
+void set_output_format(output_format new_format)
+{
+        flush_output();
+        format = new_format;
+}
+
+/* Буфер текущего контекста */
+static output_buffer *current_buffer()
+{
+        if(NULL == vm_current->output) {
+                vm_current->output = vm_allocate(sizeof(output_buffer));
+        }
+
+        return vm_current->output;
+}
+
+static void write_buffer(output_buffer *out)
+{
+        FILE *stream = (NULL != target) ? target : stderr;
+
+        if(NULL != out && out->used > 0) {
+                fwrite(out->data, 1, out->used, stream);
+                out->used = 0;
+        }
+        fflush(stream);
+}
+
+void flush_output()
+{
+        write_buffer(vm_current->output);
+}
+
+void release_output(vm_context *vm)
+{
+        if(NULL != vm->output) {
+                write_buffer(vm->output);
+                free(vm->output);
+                vm->output = NULL;
+        }
+}
+
+void output_word(int n)
+{
+        output_buffer *out = current_buffer();
+        unsigned char *buffer = out->data;
+        unsigned char digits[MAX_WORD_LENGTH];
+        unsigned char *end = digits + MAX_WORD_LENGTH;
+        unsigned char *p = end;
+        unsigned int value = n;
+        size_t used = out->used;
+
+        if(used + MAX_WORD_LENGTH > OUTPUT_BUFFER_SIZE) {
+                write_buffer(out);
+                used = 0;
+        }
+
+        if(OUTPUT_BINARY == format) {
+                buffer[used++] = (unsigned char) value;
+                buffer[used++] = (unsigned char) (value >> 8);
+                buffer[used++] = (unsigned char) (value >> 16);
+                buffer[used++] = (unsigned char) (value >> 24);
+                out->used = used;
+                return;
+        }
+
+        if(n < 0) {
+                value = 0u - value;
+        }
+
+        *--p = '\n';
+        do {
+                *--p = (unsigned char) ('0' + value % 10);
+                value /= 10;
+        } while(0 != value);
+
+        if(n < 0) {
+                *--p = '-';
+        }
+
+        memcpy(buffer + used, p, end - p);
+        out->used = used + (end - p);
+}
+
+int output_line(char const *line)
+{
+        output_buffer *out;
+        size_t length = strlen(line);
+
+        if(OUTPUT_BINARY == format) {
+                return 0;
+        }
+
+        out = current_buffer();
+        if(out->used + length + 1 > OUTPUT_BUFFER_SIZE) {
+                write_buffer(out);
+        }
+        if(length + 1 > OUTPUT_BUFFER_SIZE) {
+                fwrite(line, 1, length, (NULL != target) ? target : stderr);
+                length = 0;
+        }
+
+        memcpy(out->data + out->used, line, length);
+        out->used += length;
+        out->data[out->used++] = '\n';
+        return 1;
+}
+
+void append_result(run_result *result, int value)
+{
+        if(result->count == result->capacity) {
+                int *values;
+
+                result->capacity = result->capacity ? 2 * result->capacity : 16;
+                values = realloc(result->values, result->capacity * sizeof(int));
+                if(NULL == values) {
+                        vm_fail(VM_NO_MEMORY, "Not enough memory for program output");
+                }
+                result->values = values;
+        }
+
+        result->values[result->count++] = value;
+}
+
+void write_result(run_result *result, char const *name)
+{
+        char line[FILENAME_MAX + 128];
+        unsigned int i;
+
+        sprintf(line, "# %.*s", FILENAME_MAX, name);
+        output_line(line);
+        for(i = 0; i < result->count; ++i) {
+                output_word(result->values[i]);
+        }
+
+        if(VM_OK != result->status) {
+                if(VM_LOAD_ERROR == result->status) {
+                        sprintf(line, "# Unable to read %.*s", FILENAME_MAX, name);
+                }
+                else if(VM_RUNTIME_ERROR == result->status) {
+                        sprintf(line, "# Error: %s at %u", vm_error_message(result->error),
+                                result->address);
+                }
+                else if(VM_LIMIT == result->status) {
+                        sprintf(line, "# Error: instruction limit exceeded at %u", result->address);
+                }
+                else {
+                        sprintf(line, "# Error: not enough memory");
+                }
+
+                /* В двоичном выводе нет места для сообщений */
+                if(!output_line(line)) {
+                        printf("%s: %s\n", name, line + 2);
+                }
+        }
+
+        free(result->values);
+        result->values = NULL;
+}
+
+double wall_clock()
+{
+#ifdef CLOCK_MONOTONIC
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+#else
+        return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
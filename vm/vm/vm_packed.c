@@ -0,0 +1,592 @@
+#include <string.h>
+#include "vm_internal.h"
+
+/* Интерпретатор упакованного кода.
+ *
+ * Перед запуском память команд переводится в последовательность байтов:
+ * команда - байт кода, за которым идёт непосредственный операнд
+ * переменной длины. Байт кода задаёт операцию и длину операнда
+ * (от 0 до 4 байт), операнд записан младшим байтом первым и
+ * расширяется знаком. Команды без аргумента занимают один байт, LOAD,
+ * STORE, BLOAD, BSTORE и PUSH с небольшим аргументом - два, переходы -
+ * четыре: адрес перехода записывается смещением в упакованном коде
+ * в 24 битах. Команды NOP не записываются.
+ *
+ * Сравнения разрешаются при упаковке: COMPARE k становится одной из
+ * шести команд COMPARE_EQ ... COMPARE_GE без операнда, а пара
+ * COMPARE k; JUMP_YES t или COMPARE k; JUMP_NO t, на вторую команду
+ * которой нет переходов, - переходом по сравнению JUMP_EQ ... JUMP_GE.
+ * Такая пара есть в каждом операторе if и while программы на Милане.
+ *
+ * Команда памяти команд занимает 8 байт, упакованная - в среднем
+ * около двух, поэтому горячие циклы больших программ занимают меньше
+ * строк кэша. Каждое сочетание кода операции и длины операнда имеет
+ * свой обработчик в switch по байту кода, поэтому длина известна
+ * обработчику заранее.
+ *
+ * Адрес команды по смещению в упакованном коде находит декодер
+ * decode_packed(); он нужен только для сообщений об ошибках, STOP
+ * и INPUT, поэтому таблица смещений при исполнении не читается.
+ */
+
+/* Дополнительные коды операций упакованного кода */
+enum {
+        PACKED_END = PRINT + 1, /* Конец программы: дальше только NOP */
+        PACKED_BAD_JUMP,        /* Переход по адресу вне памяти команд */
+        PACKED_BAD_RELATION,    /* COMPARE с неверным кодом сравнения */
+        PACKED_UNKNOWN,         /* Неизвестная команда */
+
+        /* COMPARE k для каждого кода сравнения k */
+        COMPARE_EQ,
+        COMPARE_NE,
+        COMPARE_LT,
+        COMPARE_GT,
+        COMPARE_LE,
+        COMPARE_GE,
+
+        /* Переход, если сравнение двух верхних слов стека истинно:
+         * COMPARE k; JUMP_YES t или COMPARE с обратным к k кодом;
+         * JUMP_NO t.
+         */
+        JUMP_EQ,
+        JUMP_NE,
+        JUMP_LT,
+        JUMP_GT,
+        JUMP_LE,
+        JUMP_GE,
+
+        PACKED_OPERATIONS
+};
+
+/* Байт кода операции op с операндом длиной length байт */
+#define PACK(op, length)        ((op) + PACKED_OPERATIONS * (length))
+
+/* Длина адреса перехода в байтах */
+#define JUMP_LENGTH     3
+
+/* Наибольшая длина упакованной команды и запас за концом кода,
+ * чтобы чтение 4 байт операнда не выходило за массив.
+ */
+#define MAX_PACKED_LENGTH       5
+#define CODE_PADDING            4
+
+/* Упакованная программа текущего контекста */
+struct packed_workspace {
+        /* Смещение команды с адресом i в code; offset[vm_program_size] -
+         * смещение PACKED_END.
+         */
+        unsigned int offset[MAX_PROGRAM_SIZE + 1];
+        unsigned char code[MAX_PROGRAM_SIZE * MAX_PACKED_LENGTH + 1 + CODE_PADDING];
+
+        /* Признаки команд, на которые есть переходы */
+        unsigned char target[MAX_PROGRAM_SIZE];
+};
+
+/* Обратные коды сравнения: EQ - NE, LT - GE, GT - LE */
+static compare_type const inverse_relation[] = {NE, EQ, GE, LE, GT, LT};
+
+/* Число байтов, нужных для value со знаком */
+static unsigned int immediate_length(int value)
+{
+        if(value >= -0x80 && value < 0x80) {
+                return 1;
+        }
+        if(value >= -0x8000 && value < 0x8000) {
+                return 2;
+        }
+        if(value >= -0x800000 && value < 0x800000) {
+                return 3;
+        }
+        return 4;
+}
+
+/* Признак слияния команды по адресу address со следующей: COMPARE
+ * с верным кодом сравнения, за которой идёт JUMP_YES или JUMP_NO
+ * по верному адресу, и на JUMP_YES или JUMP_NO нет переходов.
+ */
+static int fused_branch(packed_workspace const *packed, unsigned int address)
+{
+        command const *c = &vm_program[address];
+
+        return COMPARE == c->operation && (unsigned int) c->arg <= GE &&
+               address + 1 < vm_program_size && !packed->target[address + 1] &&
+               (JUMP_YES == c[1].operation || JUMP_NO == c[1].operation) &&
+               (unsigned int) c[1].arg < MAX_PROGRAM_SIZE;
+}
+
+/* Код операции, длина операнда и число команд памяти команд
+ * в упакованной команде по адресу address.
+ */
+static unsigned int packed_operation(packed_workspace const *packed, unsigned int address,
+                                     unsigned int *length, unsigned int *count)
+{
+        command const *c = &vm_program[address];
+
+        *length = 0;
+        *count = 1;
+
+        switch(c->operation) {
+        case NOP:
+        case STOP:
+        case POP:
+        case DUP:
+        case INVERT:
+        case ADD:
+        case SUB:
+        case MULT:
+        case DIV:
+        case INPUT:
+        case PRINT:
+                return c->operation;
+
+        case LOAD:
+        case STORE:
+        case BLOAD:
+        case BSTORE:
+        case PUSH:
+                *length = immediate_length(c->arg);
+                return c->operation;
+
+        case COMPARE:
+                if((unsigned int) c->arg > GE) {
+                        return PACKED_BAD_RELATION;
+                }
+                if(fused_branch(packed, address)) {
+                        *length = JUMP_LENGTH;
+                        *count = 2;
+                        return JUMP_EQ + ((JUMP_YES == c[1].operation) ?
+                                          (compare_type) c->arg : inverse_relation[c->arg]);
+                }
+                return COMPARE_EQ + c->arg;
+
+        case JUMP:
+        case JUMP_YES:
+        case JUMP_NO:
+                if((unsigned int) c->arg >= MAX_PROGRAM_SIZE) {
+                        return PACKED_BAD_JUMP;
+                }
+                *length = JUMP_LENGTH;
+                return c->operation;
+
+        default:
+                return PACKED_UNKNOWN;
+        }
+}
+
+static int packed_jump(unsigned int op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op ||
+               (op >= JUMP_EQ && op <= JUMP_GE);
+}
+
+static void put_immediate(unsigned char *code, int value, unsigned int length)
+{
+        unsigned int word = (unsigned int) value;
+        unsigned int i;
+
+        for(i = 0; i < length; ++i) {
+                code[i] = (unsigned char) (word >> (8 * i));
+        }
+}
+
+/* Перевод памяти команд в упакованный код. Смещения команд известны
+ * до записи переходов, так как длина команды не зависит от адреса
+ * перехода. Команда JUMP_YES или JUMP_NO, слитая с COMPARE, получает
+ * смещение следующей команды, как NOP.
+ */
+static void pack_program(packed_workspace *packed)
+{
+        command const *program = vm_program;
+        unsigned int size = vm_program_size;
+        unsigned int position = 0;
+        unsigned int length;
+        unsigned int count;
+        unsigned int address;
+
+        memset(packed->target, 0, size);
+        for(address = 0; address < size; ++address) {
+                operation op = program[address].operation;
+
+                if((JUMP == op || JUMP_YES == op || JUMP_NO == op) &&
+                   (unsigned int) program[address].arg < size) {
+                        packed->target[program[address].arg] = 1;
+                }
+        }
+
+        for(address = 0; address < size; address += count) {
+                packed->offset[address] = position;
+                count = 1;
+                if(NOP != program[address].operation) {
+                        packed_operation(packed, address, &length, &count);
+                        position += 1 + length;
+                }
+                if(count > 1) {
+                        packed->offset[address + 1] = position;
+                }
+        }
+        packed->offset[size] = position;
+
+        for(address = 0; address < size; address += count) {
+                unsigned char *code = packed->code + packed->offset[address];
+                unsigned int op;
+                int arg;
+
+                count = 1;
+                if(NOP == program[address].operation) {
+                        continue;
+                }
+
+                op = packed_operation(packed, address, &length, &count);
+                arg = program[address + count - 1].arg;
+                if(packed_jump(op)) {
+                        /* За концом программы только NOP */
+                        arg = packed->offset[((unsigned int) arg < size) ? (unsigned int) arg : size];
+                }
+
+                code[0] = PACK(op, length);
+                put_immediate(code + 1, arg, length);
+        }
+
+        packed->code[position] = PACKED_END;
+        memset(packed->code + position + 1, 0, CODE_PADDING);
+}
+
+/* Декодер: адрес команды, упакованной по смещению position. Это
+ * последняя команда со смещением не больше position, так как команды
+ * NOP имеют то же смещение, что и следующая за ними. Сама команда
+ * для сообщения об ошибке берётся по адресу из памяти команд.
+ */
+static unsigned int decode_packed(packed_workspace const *packed, unsigned int position)
+{
+        unsigned int low = 0;
+        unsigned int high = vm_program_size;
+
+        while(low < high) {
+                unsigned int middle = low + (high - low + 1) / 2;
+
+                if(packed->offset[middle] <= position) {
+                        low = middle;
+                }
+                else {
+                        high = middle - 1;
+                }
+        }
+
+        return low;
+}
+
+/* Сохранение состояния машины и ошибка в текущей команде */
+#define FAIL(error)                                                     \
+        do {                                                            \
+                vm_stack_pointer = sp;                                  \
+                vm_command_pointer = decode_packed(packed, start - code); \
+                vm_error(error);                                        \
+                return;                                                 \
+        } while(0)
+
+/* Операнд длиной length байт (от 1 до 4) по адресу code: читаются
+ * 4 байта, лишние отбрасываются сдвигом с расширением знака.
+ */
+static inline int read_immediate(unsigned char const *code, unsigned int length)
+{
+        unsigned int word;
+
+        memcpy(&word, code, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        return (int) (word << (32 - 8 * length)) >> (32 - 8 * length);
+}
+
+/* Обработчики команды op с операндом каждой длины: длина операнда
+ * известна в каждом обработчике, поэтому адрес следующей команды
+ * не зависит от прочитанного байта кода. Последний переходит
+ * в общую часть label.
+ */
+#define OPERAND_CASES(op, label)                                        \
+        case PACK(op, 1):                                               \
+                arg = read_immediate(ip + 1, 1);                        \
+                ip += 2;                                                \
+                goto label;                                             \
+        case PACK(op, 2):                                               \
+                arg = read_immediate(ip + 1, 2);                        \
+                ip += 3;                                                \
+                goto label;                                             \
+        case PACK(op, 3):                                               \
+                arg = read_immediate(ip + 1, 3);                        \
+                ip += 4;                                                \
+                goto label;                                             \
+        case PACK(op, 4):                                               \
+                arg = read_immediate(ip + 1, 4);                        \
+                ip += 5;                                                \
+        label
+
+/* COMPARE с кодом сравнения relation */
+#define COMPARE_CASE(op, relation)                                      \
+        case op:                                                        \
+                if(sp < 2) {                                            \
+                        FAIL(STACK_EMPTY);                              \
+                }                                                       \
+                ++ip;                                                   \
+                --sp;                                                   \
+                stack[sp - 1] = (stack[sp - 1] relation stack[sp]) ? 1 : 0; \
+                break
+
+/* COMPARE и следующий за ней переход: два слова выталкиваются,
+ * переход выполняется, если сравнение истинно. Стек проверяется
+ * только для COMPARE: после неё в стеке всегда есть результат.
+ */
+#define BRANCH_CASE(op, relation)                                       \
+        case PACK(op, JUMP_LENGTH):                                     \
+                if(sp < 2) {                                            \
+                        FAIL(STACK_EMPTY);                              \
+                }                                                       \
+                sp -= 2;                                                \
+                if(stack[sp] relation stack[sp + 1]) {                  \
+                        ip = code + read_immediate(ip + 1, JUMP_LENGTH); \
+                }                                                       \
+                else {                                                  \
+                        ip += 1 + JUMP_LENGTH;                          \
+                }                                                       \
+                break
+
+void run_packed()
+{
+        packed_workspace *packed;
+        unsigned char const *code;
+        unsigned char const *ip;
+        unsigned char const *start;
+        int *memory = vm_memory;
+        unsigned int memory_size = vm_memory_size;
+        int *stack = vm_stack;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int address;
+        int arg;
+        int data;
+
+        if(NULL == vm_current->packed) {
+                vm_current->packed = vm_allocate(sizeof(packed_workspace));
+        }
+        packed = vm_current->packed;
+        pack_program(packed);
+        code = packed->code;
+
+        ip = code;
+        for(;;) {
+                start = ip;
+                switch(ip[0]) {
+                case STOP:
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = decode_packed(packed, start - code);
+                        return;
+
+                OPERAND_CASES(LOAD, op_load):
+                        address = arg;
+                        if(address >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        if(sp >= MAX_STACK_SIZE) {
+                                FAIL(STACK_OVERFLOW);
+                        }
+                        stack[sp++] = LOAD_WORD(memory, address);
+                        break;
+
+                OPERAND_CASES(STORE, op_store):
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        address = arg;
+                        if(address >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        --sp;
+                        STORE_WORD(memory, address, stack[sp]);
+                        break;
+
+                OPERAND_CASES(BLOAD, op_bload):
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        address = (unsigned int) arg + stack[sp - 1];
+                        if(address >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        stack[sp - 1] = LOAD_WORD(memory, address);
+                        break;
+
+                OPERAND_CASES(BSTORE, op_bstore):
+                        if(sp < 2) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        address = (unsigned int) arg + stack[sp - 1];
+                        if(address >= memory_size) {
+                                FAIL(BAD_DATA_ADDRESS);
+                        }
+                        STORE_WORD(memory, address, stack[sp - 2]);
+                        sp -= 2;
+                        break;
+
+                OPERAND_CASES(PUSH, op_push):
+                        if(sp >= MAX_STACK_SIZE) {
+                                FAIL(STACK_OVERFLOW);
+                        }
+                        stack[sp++] = arg;
+                        break;
+
+                case POP:
+                        ++ip;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        --sp;
+                        break;
+
+                case DUP:
+                        ++ip;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(sp >= MAX_STACK_SIZE) {
+                                FAIL(STACK_OVERFLOW);
+                        }
+                        stack[sp] = stack[sp - 1];
+                        ++sp;
+                        break;
+
+                case INVERT:
+                        ++ip;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        stack[sp - 1] = -stack[sp - 1];
+                        break;
+
+                case ADD:
+                        ++ip;
+                        if(sp < 2) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        --sp;
+                        stack[sp - 1] = stack[sp - 1] + stack[sp];
+                        break;
+
+                case SUB:
+                        ++ip;
+                        if(sp < 2) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        --sp;
+                        stack[sp - 1] = stack[sp - 1] - stack[sp];
+                        break;
+
+                case MULT:
+                        ++ip;
+                        if(sp < 2) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        --sp;
+                        stack[sp - 1] = stack[sp - 1] * stack[sp];
+                        break;
+
+                case DIV:
+                        ++ip;
+                        /* Делитель проверяется раньше, чем наличие делимого */
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(0 == stack[sp - 1]) {
+                                FAIL(DIVISION_BY_ZERO);
+                        }
+                        if(sp < 2) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(DIVISION_OVERFLOWS(stack[sp - 2], stack[sp - 1])) {
+                                FAIL(DIVISION_OVERFLOW);
+                        }
+                        --sp;
+                        stack[sp - 1] = stack[sp - 1] / stack[sp];
+                        break;
+
+                COMPARE_CASE(COMPARE_EQ, ==);
+                COMPARE_CASE(COMPARE_NE, !=);
+                COMPARE_CASE(COMPARE_LT, <);
+                COMPARE_CASE(COMPARE_GT, >);
+                COMPARE_CASE(COMPARE_LE, <=);
+                COMPARE_CASE(COMPARE_GE, >=);
+
+                case PACKED_BAD_RELATION:
+                        /* Код сравнения проверяется после первого
+                         * выталкивания, как в run().
+                         */
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        FAIL(BAD_RELATION);
+
+                BRANCH_CASE(JUMP_EQ, ==);
+                BRANCH_CASE(JUMP_NE, !=);
+                BRANCH_CASE(JUMP_LT, <);
+                BRANCH_CASE(JUMP_GT, >);
+                BRANCH_CASE(JUMP_LE, <=);
+                BRANCH_CASE(JUMP_GE, >=);
+
+                case PACK(JUMP, JUMP_LENGTH):
+                        ip = code + read_immediate(ip + 1, JUMP_LENGTH);
+                        break;
+
+                case PACK(JUMP_YES, JUMP_LENGTH):
+                        arg = read_immediate(ip + 1, JUMP_LENGTH);
+                        ip += 1 + JUMP_LENGTH;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(stack[--sp]) {
+                                ip = code + arg;
+                        }
+                        break;
+
+                case PACK(JUMP_NO, JUMP_LENGTH):
+                        arg = read_immediate(ip + 1, JUMP_LENGTH);
+                        ip += 1 + JUMP_LENGTH;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        if(!stack[--sp]) {
+                                ip = code + arg;
+                        }
+                        break;
+
+                case INPUT:
+                        ++ip;
+                        /* Адрес команды нужен vm_read() для сообщения об ошибке ввода */
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = decode_packed(packed, start - code);
+                        data = vm_read();
+                        if(sp >= MAX_STACK_SIZE) {
+                                FAIL(STACK_OVERFLOW);
+                        }
+                        stack[sp++] = data;
+                        break;
+
+                case PRINT:
+                        ++ip;
+                        if(0 == sp) {
+                                FAIL(STACK_EMPTY);
+                        }
+                        vm_write(stack[--sp]);
+                        break;
+
+                case PACKED_END:
+                        /* Дальше в памяти команд только NOP */
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = MAX_PROGRAM_SIZE;
+                        return;
+
+                case PACKED_BAD_JUMP:
+                        FAIL(BAD_CODE_ADDRESS);
+
+                default:
+                        FAIL(UNKNOWN_COMMAND);
+                }
+        }
+}
@@ -0,0 +1,327 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#define HAVE_PERF
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#ifdef HAVE_PERF
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Аппаратные счётчики процессора (mvm --perf).
+ *
+ * Счётчики открываются функцией perf_event_open() для текущего потока
+ * и только для пользовательского режима. Каждый счётчик открывается
+ * отдельно: если процессор или ядро ОС не поддерживают какой-то из них,
+ * остальные всё равно считаются. При выборочном замере счётчик тактов
+ * (или, если его нет, счётчик времени процессора) через каждые period
+ * событий посылает сигнал, обработчик которого отмечает код операции
+ * команды, исполняемой ядром switch.
+ */
+
+static char const *counter_names[COUNTERS_COUNT] = {
+        "cycles",
+        "instructions",
+        "branch-misses",
+        "cache-misses"
+};
+
+/* Выборки по кодам операций; последний элемент - неизвестные коды */
+static volatile unsigned long samples[PRINT + 2];
+static unsigned long samples_total;
+
+#ifdef HAVE_PERF
+
+static unsigned long long const counter_configs[COUNTERS_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_MISSES
+};
+
+static int counter_fds[COUNTERS_COUNT];
+static int sample_fd = -1;
+
+static int open_event(unsigned int type, unsigned long long config, unsigned long period)
+{
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if(0 != period) {
+                attr.sample_period = period;
+                attr.wakeup_events = 1;
+        }
+
+        return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void on_sample(int signal)
+{
+        unsigned int cp = vm_command_pointer;
+        unsigned int op = PRINT + 1;
+
+        if(cp < MAX_PROGRAM_SIZE && vm_program[cp].operation <= PRINT) {
+                op = vm_program[cp].operation;
+        }
+        ++samples[op];
+
+        ioctl(sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+}
+
+/* Начало выборочного замера. Возвращает 0, если замер невозможен. */
+static int start_sampling(unsigned long period, int *hardware)
+{
+        struct f_owner_ex owner;
+        struct sigaction action;
+
+        *hardware = 1;
+        sample_fd = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, period);
+        if(sample_fd < 0) {
+                *hardware = 0;
+                sample_fd = open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, period);
+        }
+        if(sample_fd < 0) {
+                return 0;
+        }
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_sample;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGIO, &action, NULL);
+
+        /* Сигнал получает этот поток, в котором исполняется программа */
+        owner.type = F_OWNER_TID;
+        owner.pid = (pid_t) syscall(SYS_gettid);
+        fcntl(sample_fd, F_SETFL, O_ASYNC);
+        fcntl(sample_fd, F_SETSIG, SIGIO);
+        fcntl(sample_fd, F_SETOWN_EX, &owner);
+
+        ioctl(sample_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(sample_fd, PERF_EVENT_IOC_REFRESH, 1);
+        return 1;
+}
+
+static void stop_sampling()
+{
+        if(sample_fd >= 0) {
+                ioctl(sample_fd, PERF_EVENT_IOC_DISABLE, 0);
+                close(sample_fd);
+                sample_fd = -1;
+        }
+        signal(SIGIO, SIG_DFL);
+}
+
+int perf_open()
+{
+        int opened = 0;
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                counter_fds[i] = open_event(PERF_TYPE_HARDWARE, counter_configs[i], 0);
+                opened += (counter_fds[i] >= 0);
+        }
+
+        return opened;
+}
+
+void perf_close()
+{
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                if(counter_fds[i] >= 0) {
+                        close(counter_fds[i]);
+                        counter_fds[i] = -1;
+                }
+        }
+}
+
+void perf_start()
+{
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                if(counter_fds[i] >= 0) {
+                        ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+                        ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+                }
+        }
+}
+
+void perf_stop(perf_values *values)
+{
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                unsigned long long data[3];     /* Значение, время включения и работы */
+
+                values->valid[i] = 0;
+                values->value[i] = 0;
+                if(counter_fds[i] < 0) {
+                        continue;
+                }
+
+                ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                if(sizeof(data) != read(counter_fds[i], data, sizeof(data)) || 0 == data[2]) {
+                        continue;
+                }
+
+                /* Поправка на время, когда счётчик делил регистр с другими */
+                values->value[i] = (data[2] < data[1]) ?
+                        (unsigned long long) ((double) data[0] * data[1] / data[2]) : data[0];
+                values->valid[i] = 1;
+        }
+}
+
+#else
+
+int perf_open()
+{
+        return 0;
+}
+
+void perf_close()
+{
+}
+
+void perf_start()
+{
+}
+
+void perf_stop(perf_values *values)
+{
+        memset(values, 0, sizeof(perf_values));
+}
+
+static int start_sampling(unsigned long period, int *hardware)
+{
+        return 0;
+}
+
+static void stop_sampling()
+{
+}
+
+#endif
+
+void perf_add(perf_values *total, perf_values const *values)
+{
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                total->value[i] += values->value[i];
+                total->valid[i] = values->valid[i];
+        }
+}
+
+void write_perf_values(FILE *stream, perf_values const *values, unsigned long instructions)
+{
+        int i;
+
+        for(i = 0; i < COUNTERS_COUNT; ++i) {
+                if(!values->valid[i]) {
+                        fprintf(stream, "  %-16s %16s\n", counter_names[i], "not supported");
+                }
+                else if(0 != instructions) {
+                        fprintf(stream, "  %-16s %16llu %10.2f per VM instruction\n",
+                                counter_names[i], values->value[i],
+                                (double) values->value[i] / instructions);
+                }
+                else {
+                        fprintf(stream, "  %-16s %16llu\n", counter_names[i], values->value[i]);
+                }
+        }
+
+        if(values->valid[COUNTER_CYCLES] && values->valid[COUNTER_INSTRUCTIONS] &&
+           0 != values->value[COUNTER_CYCLES]) {
+                fprintf(stream, "  %-16s %16.2f\n", "IPC",
+                        (double) values->value[COUNTER_INSTRUCTIONS] / values->value[COUNTER_CYCLES]);
+        }
+
+        if(0 != instructions) {
+                fprintf(stream, "  %-16s %16lu\n", "VM instructions", instructions);
+        }
+        else {
+                fprintf(stream, "  %-16s %16s\n", "VM instructions", "not counted by this engine");
+        }
+}
+
+static void write_samples(FILE *stream, unsigned long period, int hardware)
+{
+        unsigned int i;
+
+        samples_total = 0;
+        for(i = 0; i < PRINT + 2; ++i) {
+                samples_total += samples[i];
+        }
+
+        fprintf(stream, "\nSamples by opcode handler (every %lu %s): %lu\n", period,
+                hardware ? "cycles" : "ns of CPU time", samples_total);
+        for(i = 0; i < PRINT + 2; ++i) {
+                opcode_info *info = operation_info((operation) i);
+
+                if(0 == samples[i]) {
+                        continue;
+                }
+                fprintf(stream, "  %-8s %12lu %6.2f%%\n",
+                        (i <= PRINT && NULL != info) ? info->name : "unknown", samples[i],
+                        100.0 * samples[i] / samples_total);
+        }
+}
+
+vm_status run_perf(vm_engine engine, unsigned long period)
+{
+        perf_values values;
+        vm_status status;
+        int sampling = 0;
+        int hardware = 0;
+
+        if(0 != period) {
+                /* Номер исполняемой команды хранится в памяти только в ядре switch */
+                engine = ENGINE_SWITCH;
+                memset((void *) samples, 0, sizeof(samples));
+                sampling = start_sampling(period, &hardware);
+        }
+
+        perf_open();
+        vm_current->instructions = 0;
+
+        perf_start();
+        status = run_engine(engine);
+        perf_stop(&values);
+
+        if(sampling) {
+                stop_sampling();
+        }
+        perf_close();
+
+        printf("Performance counters:\n");
+        write_perf_values(stdout, &values, vm_current->instructions);
+        if(0 != period) {
+                if(sampling) {
+                        write_samples(stdout, period, hardware);
+                }
+                else {
+                        printf("\nSampling is not supported\n");
+                }
+        }
+        fflush(stdout);
+
+        return status;
+}
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+/* Профилирующий интерпретатор (mvm --profile).
+ *
+ * Отдельное ядро: команды исполняются функцией vm_run_command(), как
+ * в run(), а до и после каждой команды обновляются счётчики. Остальные
+ * ядра счётчиков не содержат и при обычном запуске не замедляются.
+ */
+
+/* Число циклов в отчёте */
+#define HOT_LOOPS       5
+
+/* Длина строки листинга, читаемой за один раз */
+#define LISTING_LINE    256
+
+struct profile_workspace {
+        unsigned long count[MAX_PROGRAM_SIZE];  /* Исполнения команды */
+        unsigned long taken[MAX_PROGRAM_SIZE];  /* Переходы JUMP_YES и JUMP_NO */
+        unsigned long opcode_count[PRINT + 2];  /* Последний - неизвестные коды */
+        unsigned int max_depth;
+};
+
+/* Цикл: обратный переход с from на to */
+typedef struct {
+        unsigned int from;
+        unsigned int to;
+        unsigned long iterations;
+        unsigned long instructions;     /* Исполнения команд to .. from */
+} hot_loop;
+
+#define profile         (vm_current->profile)
+
+static void run_profiled()
+{
+        command const *program = vm_program;
+        unsigned int size = vm_program_size;
+
+        if(NULL == profile) {
+                profile = vm_allocate(sizeof(profile_workspace));
+        }
+        else {
+                memset(profile, 0, sizeof(profile_workspace));
+        }
+
+        vm_command_pointer = 0;
+        vm_current->instructions = 0;
+        while(vm_command_pointer < size) {
+                unsigned int cp = vm_command_pointer;
+                operation op = program[cp].operation;
+                int jump = 0;
+
+                ++profile->count[cp];
+                ++profile->opcode_count[(op <= PRINT) ? op : PRINT + 1];
+                ++vm_current->instructions;
+
+                /* Условие перехода до того, как команда снимет его со стека */
+                if(vm_stack_pointer > 0) {
+                        if(JUMP_YES == op) {
+                                jump = (0 != vm_stack[vm_stack_pointer - 1]);
+                        }
+                        else if(JUMP_NO == op) {
+                                jump = (0 == vm_stack[vm_stack_pointer - 1]);
+                        }
+                }
+
+                if(!vm_run_command()) {
+                        return;
+                }
+
+                profile->taken[cp] += jump;
+                if(vm_stack_pointer > profile->max_depth) {
+                        profile->max_depth = vm_stack_pointer;
+                }
+        }
+
+        /* Дальше в памяти команд только NOP */
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+}
+
+static double percent(unsigned long part, unsigned long total)
+{
+        return (0 != total) ? 100.0 * part / total : 0.0;
+}
+
+/* Счётчики на полях строки листинга для команды address */
+static void write_margin(FILE *stream, unsigned int address)
+{
+        fprintf(stream, "%12lu %6.2f%% | ", profile->count[address],
+                percent(profile->count[address], vm_current->instructions));
+}
+
+/* Число переходов и проходов условного перехода address */
+static void write_branch(FILE *stream, unsigned int address)
+{
+        operation op = vm_program[address].operation;
+
+        if(JUMP_YES == op || JUMP_NO == op) {
+                fprintf(stream, "    [taken %lu, not taken %lu]", profile->taken[address],
+                        profile->count[address] - profile->taken[address]);
+        }
+}
+
+/* Листинг по тексту программы source. Строка команды начинается
+ * с её адреса и двоеточия. Возвращает 0, если файл не прочитан.
+ */
+static int write_source_listing(FILE *stream, char const *source)
+{
+        FILE *file = fopen(source, "rt");
+        char buffer[LISTING_LINE];
+        int line_start = 1;
+        int has_address = 0;
+        unsigned int address = 0;
+        char colon;
+
+        if(NULL == file) {
+                return 0;
+        }
+
+        while(NULL != fgets(buffer, sizeof(buffer), file)) {
+                size_t length = strlen(buffer);
+                int line_end = (length > 0 && '\n' == buffer[length - 1]);
+
+                if(line_end) {
+                        buffer[--length] = '\0';
+                }
+
+                if(line_start) {
+                        has_address = (2 == sscanf(buffer, " %u %c", &address, &colon) &&
+                                       ':' == colon && address < vm_program_size);
+                        if(has_address) {
+                                write_margin(stream, address);
+                        }
+                        else {
+                                fprintf(stream, "%21s| ", "");
+                        }
+                }
+
+                fputs(buffer, stream);
+                if(line_end) {
+                        if(has_address) {
+                                write_branch(stream, address);
+                        }
+                        fputc('\n', stream);
+                }
+                line_start = line_end;
+        }
+
+        if(!line_start) {
+                fputc('\n', stream);
+        }
+
+        fclose(file);
+        return 1;
+}
+
+/* Листинг по памяти команд, если текста программы нет, со строками
+ * программы на Милане из таблицы строк
+ */
+static void write_code_listing(FILE *stream)
+{
+        unsigned int address;
+
+        for(address = 0; address < vm_program_size; ++address) {
+                opcode_info *info = operation_info(vm_program[address].operation);
+
+                write_margin(stream, address);
+                if(NULL == info) {
+                        fprintf(stream, "%5u:  (%d)      %d", address, vm_program[address].operation,
+                                vm_program[address].arg);
+                }
+                else if(info->need_arg) {
+                        fprintf(stream, "%5u:  %-8s  %d", address, info->name,
+                                vm_program[address].arg);
+                }
+                else {
+                        fprintf(stream, "%5u:  %s", address, info->name);
+                }
+                if(vm_source_lines_loaded && 0 != vm_source_line[address]) {
+                        fprintf(stream, "  ; line %u", vm_source_line[address]);
+                }
+                write_branch(stream, address);
+                fputc('\n', stream);
+        }
+}
+
+static int compare_loops(void const *left, void const *right)
+{
+        hot_loop const *a = left;
+        hot_loop const *b = right;
+
+        if(a->instructions != b->instructions) {
+                return (a->instructions < b->instructions) ? 1 : -1;
+        }
+        return (a->to > b->to) - (a->to < b->to);
+}
+
+/* Циклы, найденные по исполненным обратным переходам */
+static void write_hot_loops(FILE *stream)
+{
+        hot_loop loops[HOT_LOOPS + 1];
+        unsigned int count = 0;
+        unsigned int address;
+        unsigned int i;
+
+        for(address = 0; address < vm_program_size; ++address) {
+                command const *cmd = &vm_program[address];
+                hot_loop loop;
+
+                if((unsigned int) cmd->arg > address || 0 == profile->count[address]) {
+                        continue;
+                }
+
+                if(JUMP == cmd->operation) {
+                        loop.iterations = profile->count[address];
+                }
+                else if(JUMP_YES == cmd->operation || JUMP_NO == cmd->operation) {
+                        loop.iterations = profile->taken[address];
+                }
+                else {
+                        continue;
+                }
+                if(0 == loop.iterations) {
+                        continue;
+                }
+
+                loop.from = address;
+                loop.to = cmd->arg;
+                loop.instructions = 0;
+                for(i = loop.to; i <= address; ++i) {
+                        loop.instructions += profile->count[i];
+                }
+
+                /* Вставка с вытеснением самого холодного цикла */
+                loops[count] = loop;
+                qsort(loops, count + 1, sizeof(hot_loop), compare_loops);
+                if(count < HOT_LOOPS) {
+                        ++count;
+                }
+        }
+
+        fprintf(stream, "\nHot loops:\n");
+        if(0 == count) {
+                fprintf(stream, "  none\n");
+        }
+        for(i = 0; i < count; ++i) {
+                fprintf(stream, "  %u-%u: %lu iterations, %lu instructions (%.2f%%)\n",
+                        loops[i].to, loops[i].from, loops[i].iterations, loops[i].instructions,
+                        percent(loops[i].instructions, vm_current->instructions));
+        }
+}
+
+static void write_opcodes(FILE *stream)
+{
+        unsigned int order[PRINT + 2];
+        unsigned int count = 0;
+        unsigned int i;
+        unsigned int j;
+
+        for(i = 0; i < PRINT + 2; ++i) {
+                if(0 != profile->opcode_count[i]) {
+                        order[count++] = i;
+                }
+        }
+
+        /* Вставками по убыванию: кодов операций немного */
+        for(i = 1; i < count; ++i) {
+                unsigned int op = order[i];
+
+                for(j = i; j > 0 && profile->opcode_count[order[j - 1]] < profile->opcode_count[op]; --j) {
+                        order[j] = order[j - 1];
+                }
+                order[j] = op;
+        }
+
+        fprintf(stream, "\nOpcodes:\n");
+        for(i = 0; i < count; ++i) {
+                opcode_info *info = operation_info((operation) order[i]);
+                char const *name = (order[i] <= PRINT && NULL != info) ? info->name : "unknown";
+
+                fprintf(stream, "  %-8s %12lu %6.2f%%\n", name, profile->opcode_count[order[i]],
+                        percent(profile->opcode_count[order[i]], vm_current->instructions));
+        }
+}
+
+static void write_profile(FILE *stream, char const *source)
+{
+        fprintf(stream, "Profile:\n\n");
+        if(NULL == source || !write_source_listing(stream, source)) {
+                write_code_listing(stream);
+        }
+
+        write_opcodes(stream);
+        write_hot_loops(stream);
+
+        fprintf(stream, "\nInstructions: %lu\nMax stack depth: %u\n",
+                vm_current->instructions, profile->max_depth);
+        fflush(stream);
+}
+
+vm_status run_profile(FILE *stream, char const *source)
+{
+        vm_status status = run_protected(run_profiled);
+
+        if(NULL != profile) {
+                write_profile(stream, source);
+        }
+
+        return status;
+}
@@ -0,0 +1,695 @@
+#include <stdlib.h>
+#include "vm_internal.h"
+
+/* Команды регистровой формы.
+ *
+ * Операнды команд - указатели на регистры, ячейки памяти данных или
+ * константы, поэтому LOAD и PUSH не порождают отдельных команд.
+ * Значения, лежащие в стеке на входе в базовый блок, читаются командой
+ * R_FETCH, а на выходе из блока содержимое символического стека
+ * записывается обратно командами R_SPILL.
+ */
+typedef enum {
+        R_ENTER,                /* Начало блока: проверка глубины стека */
+        R_FETCH,                /* dst := стек[sp - value] */
+        R_SPILL,                /* стек[sp + value] := left */
+        R_SP,                   /* sp := sp + value */
+        R_MOVE,                 /* dst := left */
+        R_ADD,                  /* dst := left + right */
+        R_SUB,                  /* dst := left - right */
+        R_MULT,                 /* dst := left * right */
+        R_DIV,                  /* dst := left / right */
+        R_NEG,                  /* dst := -left */
+        R_COMPARE,              /* dst := left <value> right */
+        R_BLOAD,                /* dst := память[value + left] */
+        R_BSTORE,               /* память[value + left] := right */
+        R_INPUT,                /* dst := ввод */
+        R_PRINT,                /* вывод left */
+        R_JUMP,                 /* переход к target */
+        R_JUMP_YES,             /* переход к target, если left != 0 */
+        R_JUMP_NO,              /* переход к target, если left == 0 */
+        R_COMPARE_JUMP_YES,     /* переход к target, если left <value> right */
+        R_COMPARE_JUMP_NO,      /* переход к target, если не left <value> right */
+        R_STOP,                 /* Остановка */
+        R_FAIL                  /* Ошибка времени исполнения value */
+} register_operation;
+
+/* Команда регистровой формы */
+typedef struct {
+        register_operation operation;
+        int *dst;               /* Результат */
+        int const *left;        /* Первый операнд */
+        int const *right;       /* Второй операнд */
+        int value;              /* Код сравнения, смещение в стеке, код ошибки */
+        int target;             /* Цель перехода; у R_ENTER - рост стека */
+        unsigned int address;   /* Адрес исходной команды */
+} register_command;
+
+/* Ячейка символического стека при трансляции блока */
+typedef struct {
+        int const *value;       /* Где лежит значение */
+        int memory;             /* Адрес в памяти данных для LOAD, иначе -1 */
+        int incoming;           /* k > 0, если это неизменённое стек[sp - k] */
+} stack_slot;
+
+/* Рабочие данные регистрового ядра */
+struct register_workspace {
+        register_command *code;
+        unsigned int code_size;
+        unsigned int code_capacity;
+
+        int *registers;
+        unsigned int registers_used;
+
+        int *constants;
+        unsigned int constants_used;
+
+        stack_slot *slots;
+        unsigned int slots_used;
+
+        /* Признак начала базового блока */
+        unsigned char is_leader[MAX_PROGRAM_SIZE];
+
+        /* Индекс R_ENTER блока, начинающегося с данного адреса */
+        unsigned int block_of[MAX_PROGRAM_SIZE];
+
+        /* Индекс команды остановки за концом программы */
+        unsigned int halt_index;
+
+        /* Глубина стека относительно входа в блок и её пределы */
+        int depth;
+        int lowest;
+        int highest;
+};
+
+static void create_workspace()
+{
+        if(NULL == vm_current->register_form) {
+                vm_current->register_form = vm_allocate(sizeof(register_workspace));
+        }
+}
+
+void release_register(vm_context *vm)
+{
+        if(NULL != vm->register_form) {
+                free(vm->register_form->code);
+                free(vm->register_form->registers);
+                free(vm->register_form->constants);
+                free(vm->register_form->slots);
+                free(vm->register_form);
+                vm->register_form = NULL;
+        }
+}
+
+/* Рабочие данные текущего контекста */
+#define code            (vm_current->register_form->code)
+#define code_size       (vm_current->register_form->code_size)
+#define code_capacity   (vm_current->register_form->code_capacity)
+#define registers       (vm_current->register_form->registers)
+#define registers_used  (vm_current->register_form->registers_used)
+#define constants       (vm_current->register_form->constants)
+#define constants_used  (vm_current->register_form->constants_used)
+#define slots           (vm_current->register_form->slots)
+#define slots_used      (vm_current->register_form->slots_used)
+#define is_leader       (vm_current->register_form->is_leader)
+#define block_of        (vm_current->register_form->block_of)
+#define halt_index      (vm_current->register_form->halt_index)
+#define depth           (vm_current->register_form->depth)
+#define lowest          (vm_current->register_form->lowest)
+#define highest         (vm_current->register_form->highest)
+
+static register_command *emit(register_operation op, unsigned int address)
+{
+        register_command *rc;
+
+        if(code_size == code_capacity) {
+                code_capacity = code_capacity ? 2 * code_capacity : 1024;
+                rc = realloc(code, code_capacity * sizeof(register_command));
+                if(NULL == rc) {
+                        vm_fail(VM_NO_MEMORY, "Not enough memory for register code");
+                }
+                code = rc;
+        }
+
+        rc = &code[code_size++];
+        rc->operation = op;
+        rc->dst = NULL;
+        rc->left = rc->right = NULL;
+        rc->value = 0;
+        rc->target = 0;
+        rc->address = address;
+        return rc;
+}
+
+static int *new_register()
+{
+        return &registers[registers_used++];
+}
+
+static void push_slot(int const *value, int memory, int incoming)
+{
+        slots[slots_used].value = value;
+        slots[slots_used].memory = memory;
+        slots[slots_used].incoming = incoming;
+        ++slots_used;
+
+        if(++depth > highest) {
+                highest = depth;
+        }
+}
+
+static void push_register(int const *value)
+{
+        push_slot(value, -1, 0);
+}
+
+/* Выталкивание значения из символического стека. Если он пуст,
+ * значение читается из настоящего стека под входной вершиной.
+ */
+static stack_slot pop_slot(unsigned int address)
+{
+        stack_slot slot;
+
+        if(--depth < lowest) {
+                register_command *rc = emit(R_FETCH, address);
+
+                lowest = depth;
+                rc->dst = new_register();
+                rc->value = -lowest;
+
+                slot.value = rc->dst;
+                slot.memory = -1;
+                slot.incoming = -lowest;
+                return slot;
+        }
+
+        return slots[--slots_used];
+}
+
+/* Копирование в регистры значений, прочитанных из памяти данных
+ * по адресу memory (или по любому адресу, если memory < 0), до того,
+ * как эта память будет изменена.
+ */
+static void materialize(int memory, unsigned int address)
+{
+        unsigned int i;
+
+        for(i = 0; i < slots_used; ++i) {
+                if(slots[i].memory >= 0 && (memory < 0 || slots[i].memory == memory)) {
+                        register_command *rc = emit(R_MOVE, address);
+
+                        rc->dst = new_register();
+                        rc->left = slots[i].value;
+                        slots[i].value = rc->dst;
+                        slots[i].memory = -1;
+                }
+        }
+}
+
+/* Запись символического стека в настоящий стек при выходе из блока */
+static void spill(unsigned int address)
+{
+        unsigned int i;
+        int bottom = lowest;
+
+        for(i = 0; i < slots_used; ++i) {
+                int position = bottom + (int) i;
+
+                if(0 == slots[i].incoming || slots[i].incoming != -position) {
+                        register_command *rc = emit(R_SPILL, address);
+
+                        rc->left = slots[i].value;
+                        rc->value = position;
+                }
+        }
+
+        if(depth != 0) {
+                emit(R_SP, address)->value = depth;
+        }
+}
+
+/* Команда, которая всегда завершается ошибкой. Остаток блока
+ * за ней не транслируется.
+ */
+static int fail(runtime_error error, unsigned int address)
+{
+        emit(R_FAIL, address)->value = error;
+        return 1;
+}
+
+static int is_jump(operation op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op;
+}
+
+/* Трансляция блока с адреса start. Возвращает адрес следующего блока. */
+static unsigned int translate_block(unsigned int start)
+{
+        unsigned int size = vm_program_size;
+        unsigned int enter = code_size;
+        unsigned int address;
+        stack_slot left;
+        stack_slot right;
+        register_command *rc;
+        int *dst;
+        int ended = 0;
+
+        emit(R_ENTER, start);
+        block_of[start] = enter;
+        depth = lowest = highest = 0;
+        slots_used = 0;
+        registers_used = 0;
+
+        for(address = start; address < size && !ended; ++address) {
+                operation op = vm_program[address].operation;
+                int arg = vm_program[address].arg;
+
+                if(address != start && is_leader[address]) {
+                        break;
+                }
+
+                switch(op) {
+                case NOP:
+                        break;
+
+                case STOP:
+                        spill(address);
+                        emit(R_STOP, address);
+                        ended = 1;
+                        break;
+
+                case LOAD:
+                        if((unsigned int) arg >= vm_memory_size) {
+                                ended = fail(BAD_DATA_ADDRESS, address);
+                                break;
+                        }
+                        /* Слоты хранят адрес слова, поэтому его страница
+                         * выделяется уже при переводе.
+                         */
+                        push_slot(memory_word(arg), arg, 0);
+                        break;
+
+                case STORE:
+                        left = pop_slot(address);
+                        if((unsigned int) arg >= vm_memory_size) {
+                                ended = fail(BAD_DATA_ADDRESS, address);
+                                break;
+                        }
+                        materialize(arg, address);
+                        rc = emit(R_MOVE, address);
+                        rc->dst = memory_word(arg);
+                        rc->left = left.value;
+                        break;
+
+                case BLOAD:
+                        left = pop_slot(address);
+                        rc = emit(R_BLOAD, address);
+                        rc->dst = new_register();
+                        rc->left = left.value;
+                        rc->value = arg;
+                        push_register(rc->dst);
+                        break;
+
+                case BSTORE:
+                        left = pop_slot(address);
+                        right = pop_slot(address);
+                        materialize(-1, address);
+                        rc = emit(R_BSTORE, address);
+                        rc->left = left.value;
+                        rc->right = right.value;
+                        rc->value = arg;
+                        break;
+
+                case PUSH:
+                        constants[constants_used] = arg;
+                        push_register(&constants[constants_used++]);
+                        break;
+
+                case POP:
+                        pop_slot(address);
+                        break;
+
+                case DUP:
+                        left = pop_slot(address);
+                        push_slot(left.value, left.memory, left.incoming);
+                        push_slot(left.value, left.memory, 0);
+                        break;
+
+                case INVERT:
+                        left = pop_slot(address);
+                        rc = emit(R_NEG, address);
+                        rc->dst = new_register();
+                        rc->left = left.value;
+                        push_register(rc->dst);
+                        break;
+
+                case ADD:
+                case SUB:
+                case MULT:
+                case DIV:
+                        right = pop_slot(address);
+                        left = pop_slot(address);
+                        rc = emit((ADD == op) ? R_ADD : (SUB == op) ? R_SUB :
+                                  (MULT == op) ? R_MULT : R_DIV, address);
+                        rc->dst = new_register();
+                        rc->left = left.value;
+                        rc->right = right.value;
+                        push_register(rc->dst);
+                        break;
+
+                case COMPARE:
+                        right = pop_slot(address);
+                        if((unsigned int) arg > GE) {
+                                ended = fail(BAD_RELATION, address);
+                                break;
+                        }
+                        left = pop_slot(address);
+                        rc = emit(R_COMPARE, address);
+                        rc->dst = new_register();
+                        rc->left = left.value;
+                        rc->right = right.value;
+                        rc->value = arg;
+                        push_register(rc->dst);
+                        break;
+
+                case JUMP:
+                        if((unsigned int) arg >= MAX_PROGRAM_SIZE) {
+                                ended = fail(BAD_CODE_ADDRESS, address);
+                                break;
+                        }
+                        spill(address);
+                        emit(R_JUMP, address)->target = arg;
+                        ended = 1;
+                        break;
+
+                case JUMP_YES:
+                case JUMP_NO:
+                        if((unsigned int) arg >= MAX_PROGRAM_SIZE) {
+                                ended = fail(BAD_CODE_ADDRESS, address);
+                                break;
+                        }
+                        left = pop_slot(address);
+                        rc = &code[code_size - 1];
+                        dst = rc->dst;
+                        if(R_COMPARE == rc->operation && dst == left.value) {
+                                /* COMPARE k; JUMP_* t - одна команда. Результат
+                                 * сравнения больше нигде не используется, так как
+                                 * вытолкнут из стека сразу после вычисления.
+                                 */
+                                register_command compare = *rc;
+                                unsigned int i;
+                                int used = 0;
+
+                                for(i = 0; i < slots_used; ++i) {
+                                        used |= (slots[i].value == dst);
+                                }
+
+                                if(!used) {
+                                        --code_size;
+                                        spill(address);
+                                        rc = emit((JUMP_YES == op) ? R_COMPARE_JUMP_YES
+                                                                   : R_COMPARE_JUMP_NO, compare.address);
+                                        rc->left = compare.left;
+                                        rc->right = compare.right;
+                                        rc->value = compare.value;
+                                        rc->target = arg;
+                                        ended = 1;
+                                        break;
+                                }
+                        }
+                        spill(address);
+                        rc = emit((JUMP_YES == op) ? R_JUMP_YES : R_JUMP_NO, address);
+                        rc->left = left.value;
+                        rc->target = arg;
+                        ended = 1;
+                        break;
+
+                case INPUT:
+                        rc = emit(R_INPUT, address);
+                        rc->dst = new_register();
+                        push_register(rc->dst);
+                        break;
+
+                case PRINT:
+                        left = pop_slot(address);
+                        rc = emit(R_PRINT, address);
+                        rc->left = left.value;
+                        break;
+
+                default:
+                        ended = fail(UNKNOWN_COMMAND, address);
+                }
+        }
+
+        if(!ended) {
+                /* Переход к следующему блоку или к концу программы */
+                spill(address);
+                emit(R_JUMP, address)->target = address;
+        }
+
+        /* Пределы глубины, при которых в блоке не возникнет ошибок стека */
+        code[enter].value = -lowest;
+        code[enter].target = highest;
+
+        /* Команды после безусловной ошибки до следующего блока недостижимы */
+        while(address < size && !is_leader[address]) {
+                ++address;
+        }
+        return address;
+}
+
+/* Перевод памяти команд в регистровую форму */
+static void translate()
+{
+        unsigned int size = vm_program_size;
+        unsigned int address;
+        unsigned int i;
+
+        for(address = 0; address < size; ++address) {
+                is_leader[address] = (0 == address);
+        }
+
+        for(address = 0; address < size; ++address) {
+                command const *cmd = &vm_program[address];
+                unsigned int target = cmd->arg;
+
+                if(is_jump(cmd->operation) && target < size) {
+                        is_leader[target] = 1;
+                }
+
+                if((is_jump(cmd->operation) || STOP == cmd->operation) && address + 1 < size) {
+                        is_leader[address + 1] = 1;
+                }
+        }
+
+        free(registers);
+        free(constants);
+        free(slots);
+        registers = malloc(sizeof(int) * (4 * size + 1));
+        constants = malloc(sizeof(int) * (size + 1));
+        slots = malloc(sizeof(stack_slot) * (2 * size + 1));
+        if(NULL == registers || NULL == constants || NULL == slots) {
+                vm_fail(VM_NO_MEMORY, "Not enough memory for register code");
+        }
+
+        code_size = 0;
+        constants_used = 0;
+        address = 0;
+        while(address < size) {
+                address = translate_block(address);
+        }
+
+        halt_index = code_size;
+        emit(R_STOP, MAX_PROGRAM_SIZE);
+
+        /* Адреса переходов становятся индексами блоков */
+        for(i = 0; i < code_size; ++i) {
+                switch(code[i].operation) {
+                case R_JUMP:
+                case R_JUMP_YES:
+                case R_JUMP_NO:
+                case R_COMPARE_JUMP_YES:
+                case R_COMPARE_JUMP_NO:
+                        code[i].target = ((unsigned int) code[i].target < size) ?
+                                block_of[code[i].target] : halt_index;
+                        break;
+
+                default:
+                        break;
+                }
+        }
+}
+
+/* Результат сравнения left и right по коду relation */
+static int compare_values(int left, int right, int relation)
+{
+        switch(relation) {
+        case EQ:
+                return left == right;
+
+        case NE:
+                return left != right;
+
+        case LT:
+                return left < right;
+
+        case GT:
+                return left > right;
+
+        case LE:
+                return left <= right;
+
+        default:
+                return left >= right;
+        }
+}
+
+/* Сохранение состояния машины и сообщение об ошибке */
+#define FAIL(error)     do {                                    \
+                                vm_stack_pointer = sp;          \
+                                vm_command_pointer = rc->address; \
+                                vm_error(error);                \
+                                return;                         \
+                        } while(0)
+
+void run_register()
+{
+        int *memory = vm_memory;
+        unsigned int memory_size = vm_memory_size;
+        int *stack = vm_stack;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int address;
+        register_command const *base;
+        register_command const *rc;
+        register_command const *ip;
+
+        create_workspace();
+        translate();
+        base = code;
+        ip = base;
+
+        for(;;) {
+                rc = ip++;
+
+                switch(rc->operation) {
+                case R_ENTER:
+                        if(sp >= (unsigned int) rc->value &&
+                           sp + rc->target <= MAX_STACK_SIZE) {
+                                break;
+                        }
+
+                        /* Стека не хватит: блок исполняется по одной команде
+                         * интерпретатором run(), который и сообщит об ошибке.
+                         */
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = rc->address;
+                        if(!run_until_leader(is_leader)) {
+                                return;
+                        }
+
+                        sp = vm_stack_pointer;
+                        ip = base + block_of[vm_command_pointer];
+                        break;
+
+                case R_FETCH:
+                        *rc->dst = stack[sp - rc->value];
+                        break;
+
+                case R_SPILL:
+                        stack[(int) sp + rc->value] = *rc->left;
+                        break;
+
+                case R_SP:
+                        sp += rc->value;
+                        break;
+
+                case R_MOVE:
+                        *rc->dst = *rc->left;
+                        break;
+
+                case R_ADD:
+                        *rc->dst = *rc->left + *rc->right;
+                        break;
+
+                case R_SUB:
+                        *rc->dst = *rc->left - *rc->right;
+                        break;
+
+                case R_MULT:
+                        *rc->dst = *rc->left * *rc->right;
+                        break;
+
+                case R_DIV:
+                        if(0 == *rc->right)
+                                FAIL(DIVISION_BY_ZERO);
+                        if(DIVISION_OVERFLOWS(*rc->left, *rc->right))
+                                FAIL(DIVISION_OVERFLOW);
+                        *rc->dst = *rc->left / *rc->right;
+                        break;
+
+                case R_NEG:
+                        *rc->dst = -*rc->left;
+                        break;
+
+                case R_COMPARE:
+                        *rc->dst = compare_values(*rc->left, *rc->right, rc->value);
+                        break;
+
+                case R_BLOAD:
+                        address = (unsigned int) rc->value + *rc->left;
+                        if(address >= memory_size)
+                                FAIL(BAD_DATA_ADDRESS);
+                        *rc->dst = LOAD_WORD(memory, address);
+                        break;
+
+                case R_BSTORE:
+                        address = (unsigned int) rc->value + *rc->left;
+                        if(address >= memory_size)
+                                FAIL(BAD_DATA_ADDRESS);
+                        STORE_WORD(memory, address, *rc->right);
+                        break;
+
+                case R_INPUT:
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = rc->address;
+                        *rc->dst = vm_read();
+                        break;
+
+                case R_PRINT:
+                        vm_write(*rc->left);
+                        break;
+
+                case R_JUMP:
+                        ip = base + rc->target;
+                        break;
+
+                case R_JUMP_YES:
+                        if(*rc->left)
+                                ip = base + rc->target;
+                        break;
+
+                case R_JUMP_NO:
+                        if(!*rc->left)
+                                ip = base + rc->target;
+                        break;
+
+                case R_COMPARE_JUMP_YES:
+                        if(compare_values(*rc->left, *rc->right, rc->value))
+                                ip = base + rc->target;
+                        break;
+
+                case R_COMPARE_JUMP_NO:
+                        if(!compare_values(*rc->left, *rc->right, rc->value))
+                                ip = base + rc->target;
+                        break;
+
+                case R_STOP:
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = rc->address;
+                        return;
+
+                case R_FAIL:
+                        FAIL(rc->value);
+                }
+        }
+}
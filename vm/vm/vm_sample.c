@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_ITIMER
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+/* Выборочный профиль по строкам программы на Милане (mvm --sample).
+ *
+ * Выборка - адрес исполняемой команды. Выборки делаются через каждые
+ * interval команд виртуальной машины (отдельное ядро, результат не
+ * зависит от машины) или по сигналу таймера времени процессора (ядро
+ * switch). Компилятор Милана записывает после каждой команды
+ * комментарий "; line N" с номером строки оператора, из которого
+ * получена команда; по таблице строк, построенной из этих комментариев
+ * при загрузке (или записанной в .mbc), выборки собираются по строкам.
+ * Циклы программы (обратные переходы) становятся кадрами стека
+ * в формате folded для flamegraph.pl.
+ */
+
+/* Число строк в отчёте */
+#define HOT_LINES       20
+
+/* Наибольшая глубина вложенности циклов в стеке */
+#define MAX_FRAMES      64
+
+/* Наибольшая длина имени кадра */
+#define FRAME_NAME      32
+
+struct sample_workspace {
+        unsigned long count[MAX_PROGRAM_SIZE];  /* Выборки по адресам */
+        unsigned long interval;
+};
+
+/* Цикл: обратный переход с from на to */
+typedef struct {
+        unsigned int from;
+        unsigned int to;
+} sample_loop;
+
+/* Стек в формате folded и число его выборок */
+typedef struct {
+        char *stack;
+        unsigned long count;
+} folded_stack;
+
+#define sampling        (vm_current->sample)
+
+#ifdef HAVE_ITIMER
+/* Счётчики для обработчика сигнала таймера */
+static unsigned long *volatile timer_counts = NULL;
+
+static void on_timer(int signal)
+{
+        unsigned int cp = vm_command_pointer;
+
+        if(cp < MAX_PROGRAM_SIZE) {
+                ++timer_counts[cp];
+        }
+}
+#endif
+
+static void run_counted()
+{
+        unsigned long interval = sampling->interval;
+        unsigned long countdown = interval;
+        unsigned int size = vm_program_size;
+
+        vm_command_pointer = 0;
+        vm_current->instructions = 0;
+        while(vm_command_pointer < size) {
+                if(0 == --countdown) {
+                        ++sampling->count[vm_command_pointer];
+                        countdown = interval;
+                }
+
+                ++vm_current->instructions;
+                if(!vm_run_command()) {
+                        return;
+                }
+        }
+
+        /* Дальше в памяти команд только NOP */
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+}
+
+/* Имя кадра для команды address: строка на Милане или адрес */
+static void location_name(char *name, char const *prefix, unsigned int address, int by_line)
+{
+        if(by_line && 0 != vm_source_line[address]) {
+                sprintf(name, "%sline %u", prefix, vm_source_line[address]);
+        }
+        else {
+                sprintf(name, "%saddress %u", prefix, address);
+        }
+}
+
+/* Строка (или адрес) и число её выборок */
+typedef struct {
+        unsigned long key;
+        unsigned long count;
+} hot_line;
+
+static int compare_keys(void const *left, void const *right)
+{
+        hot_line const *a = left;
+        hot_line const *b = right;
+
+        return (a->key > b->key) - (a->key < b->key);
+}
+
+static int compare_counts(void const *left, void const *right)
+{
+        hot_line const *a = left;
+        hot_line const *b = right;
+
+        if(a->count != b->count) {
+                return (a->count < b->count) ? 1 : -1;
+        }
+        return compare_keys(left, right);
+}
+
+static void write_hot_lines(FILE *stream, unsigned long total, int by_line)
+{
+        hot_line *lines;
+        unsigned int count = 0;
+        unsigned int merged = 0;
+        unsigned int address;
+        unsigned int i;
+
+        lines = vm_allocate(vm_program_size * sizeof(hot_line) + sizeof(hot_line));
+        for(address = 0; address < vm_program_size; ++address) {
+                if(0 != sampling->count[address]) {
+                        lines[count].key = by_line ? vm_source_line[address] : address;
+                        lines[count].count = sampling->count[address];
+                        ++count;
+                }
+        }
+
+        /* Выборки команд одной строки складываются */
+        qsort(lines, count, sizeof(hot_line), compare_keys);
+        for(i = 0; i < count; ++i) {
+                if(merged > 0 && lines[merged - 1].key == lines[i].key) {
+                        lines[merged - 1].count += lines[i].count;
+                }
+                else {
+                        lines[merged++] = lines[i];
+                }
+        }
+        qsort(lines, merged, sizeof(hot_line), compare_counts);
+
+        fprintf(stream, "\nHot %s:\n", by_line ? "lines" : "addresses");
+        fprintf(stream, "  %8s %12s %8s\n", by_line ? "Line" : "Address", "Samples", "Share");
+        for(i = 0; i < merged && i < HOT_LINES; ++i) {
+                if(by_line && 0 == lines[i].key) {
+                        fprintf(stream, "  %8s", "unknown");
+                }
+                else {
+                        fprintf(stream, "  %8lu", lines[i].key);
+                }
+                fprintf(stream, " %12lu %7.2f%%\n", lines[i].count, 100.0 * lines[i].count / total);
+        }
+
+        free(lines);
+}
+
+static int compare_loops(void const *left, void const *right)
+{
+        sample_loop const *a = left;
+        sample_loop const *b = right;
+
+        /* Внешние циклы раньше вложенных */
+        if(a->to != b->to) {
+                return (a->to > b->to) - (a->to < b->to);
+        }
+        return (a->from < b->from) - (a->from > b->from);
+}
+
+static int compare_stacks(void const *left, void const *right)
+{
+        return strcmp(((folded_stack const *) left)->stack, ((folded_stack const *) right)->stack);
+}
+
+/* Стеки в формате folded: main;loop line A;...;line B число */
+static int write_folded(char const *file, int by_line)
+{
+        sample_loop *loops;
+        folded_stack *stacks;
+        unsigned int loops_count = 0;
+        unsigned int stacks_count = 0;
+        unsigned int address;
+        unsigned int i;
+        FILE *out;
+
+        out = fopen(file, "wt");
+        if(NULL == out) {
+                return 0;
+        }
+
+        loops = vm_allocate(vm_program_size * sizeof(sample_loop) + sizeof(sample_loop));
+        stacks = vm_allocate(vm_program_size * sizeof(folded_stack) + sizeof(folded_stack));
+
+        for(address = 0; address < vm_program_size; ++address) {
+                command const *cmd = &vm_program[address];
+
+                if((JUMP == cmd->operation || JUMP_YES == cmd->operation ||
+                    JUMP_NO == cmd->operation) && (unsigned int) cmd->arg <= address) {
+                        loops[loops_count].from = address;
+                        loops[loops_count].to = cmd->arg;
+                        ++loops_count;
+                }
+        }
+        qsort(loops, loops_count, sizeof(sample_loop), compare_loops);
+
+        for(address = 0; address < vm_program_size; ++address) {
+                char name[FRAME_NAME];
+                char *stack;
+                unsigned int frames = 0;
+
+                if(0 == sampling->count[address]) {
+                        continue;
+                }
+
+                stack = vm_allocate((MAX_FRAMES + 2) * (FRAME_NAME + 1));
+                strcpy(stack, "main");
+                for(i = 0; i < loops_count && frames < MAX_FRAMES; ++i) {
+                        if(loops[i].to <= address && address <= loops[i].from) {
+                                location_name(name, ";loop ", loops[i].to, by_line);
+                                strcat(stack, name);
+                                ++frames;
+                        }
+                }
+                location_name(name, ";", address, by_line);
+                strcat(stack, name);
+
+                stacks[stacks_count].stack = stack;
+                stacks[stacks_count].count = sampling->count[address];
+                ++stacks_count;
+        }
+
+        /* Одинаковые стеки разных команд одной строки объединяются */
+        qsort(stacks, stacks_count, sizeof(folded_stack), compare_stacks);
+        for(i = 0; i < stacks_count; ++i) {
+                unsigned long count = stacks[i].count;
+
+                while(i + 1 < stacks_count && 0 == strcmp(stacks[i].stack, stacks[i + 1].stack)) {
+                        free(stacks[i].stack);
+                        count += stacks[++i].count;
+                }
+                fprintf(out, "%s %lu\n", stacks[i].stack, count);
+                free(stacks[i].stack);
+        }
+
+        free(stacks);
+        free(loops);
+        fclose(out);
+        return 1;
+}
+
+static void write_samples(FILE *stream, char const *folded, int timer)
+{
+        unsigned long total = 0;
+        unsigned int address;
+        int by_line;
+
+        for(address = 0; address < vm_program_size; ++address) {
+                total += sampling->count[address];
+        }
+
+        by_line = vm_source_lines_loaded;
+
+        if(timer) {
+                fprintf(stream, "Samples: %lu (every %lu us of CPU time)\n", total,
+                        sampling->interval);
+        }
+        else {
+                fprintf(stream, "Samples: %lu (every %lu VM instructions)\n", total,
+                        sampling->interval);
+        }
+        if(!by_line) {
+                fprintf(stream, "No line table (\"; line N\" comments), samples are shown by address\n");
+        }
+
+        if(0 != total) {
+                write_hot_lines(stream, total, by_line);
+        }
+
+        if(NULL != folded && !write_folded(folded, by_line)) {
+                fprintf(stream, "Unable to write %s\n", folded);
+        }
+        fflush(stream);
+}
+
+vm_status run_sampled(unsigned long interval, int timer, char const *folded)
+{
+        vm_status status;
+
+        if(NULL == sampling) {
+                sampling = calloc(1, sizeof(sample_workspace));
+                if(NULL == sampling) {
+                        return VM_NO_MEMORY;
+                }
+        }
+        else {
+                memset(sampling, 0, sizeof(sample_workspace));
+        }
+        sampling->interval = interval;
+
+        if(!timer) {
+                status = run_protected(run_counted);
+        }
+        else {
+#ifdef HAVE_ITIMER
+                struct itimerval period;
+                struct sigaction action;
+
+                timer_counts = sampling->count;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = on_timer;
+                action.sa_flags = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGPROF, &action, NULL);
+
+                period.it_interval.tv_sec = interval / 1000000;
+                period.it_interval.tv_usec = interval % 1000000;
+                period.it_value = period.it_interval;
+                setitimer(ITIMER_PROF, &period, NULL);
+
+                /* Номер исполняемой команды хранится в памяти только в ядре switch */
+                status = run_protected(run);
+
+                memset(&period, 0, sizeof(period));
+                setitimer(ITIMER_PROF, &period, NULL);
+                signal(SIGPROF, SIG_DFL);
+#else
+                printf("Timer sampling is not supported\n");
+                return VM_LOAD_ERROR;
+#endif
+        }
+
+        write_samples(stdout, folded, timer);
+        return status;
+}
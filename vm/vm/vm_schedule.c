@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Планировщик многих контекстов на нескольких потоках.
+ *
+ * Готовые к исполнению задачи стоят в общей очереди. Рабочий поток
+ * берёт задачу из её начала, исполняет не более budget команд
+ * (vm_context_resume()) и ставит задачу в конец очереди, поэтому
+ * бесконечный цикл одной программы не задерживает остальные. Команда
+ * INPUT без данных во входной очереди задачи снимает задачу с очереди
+ * (задача ждёт), vm_scheduler_input() возвращает её в очередь. Задача,
+ * исполнившая больше limit команд, завершается с VM_LIMIT. Все поля
+ * планировщика и задач, кроме контекстов, защищены блокировкой.
+ */
+
+#ifdef HAVE_PTHREAD
+#define LOCK(scheduler)         pthread_mutex_lock(&(scheduler)->lock)
+#define UNLOCK(scheduler)       pthread_mutex_unlock(&(scheduler)->lock)
+#else
+#define LOCK(scheduler)
+#define UNLOCK(scheduler)
+#endif
+
+typedef enum {
+        TASK_READY,             /* В очереди */
+        TASK_RUNNING,           /* Исполняется рабочим потоком */
+        TASK_WAITING,           /* Ждёт данных для INPUT */
+        TASK_DONE               /* Программа завершилась */
+} task_state;
+
+typedef struct schedule_task schedule_task;
+
+struct schedule_task {
+        vm_scheduler *scheduler;
+        vm_context *vm;
+        task_state state;
+        vm_status status;               /* Результат при TASK_DONE */
+        schedule_task *next;            /* Следующая задача в очереди */
+
+        /* Входные данные для INPUT */
+        int *input;
+        unsigned int input_count;
+        unsigned int input_capacity;
+        unsigned int input_position;
+        int input_closed;
+
+        /* Функция вывода, заданная для контекста до добавления задачи */
+        void (*write)(void *data, int value);
+        void *write_data;
+};
+
+struct vm_scheduler {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_t lock;           /* Защищает всё, кроме контекстов задач */
+        pthread_cond_t ready;           /* В очереди появилась задача */
+        pthread_cond_t idle;            /* Нет задач в очереди и исполняемых */
+        pthread_cond_t finished;        /* Задача завершилась или ждёт ввода */
+        pthread_t *threads;
+#endif
+        int threads_count;
+        unsigned long budget;
+        unsigned long limit;            /* Наибольшее число команд задачи; 0 - без ограничения */
+        int stop;
+
+        schedule_task **tasks;
+        unsigned int tasks_count;
+        unsigned int tasks_capacity;
+
+        schedule_task *head;            /* Очередь готовых задач */
+        schedule_task *tail;
+        unsigned int active;            /* Задачи в очереди и исполняемые */
+};
+
+static void enqueue(vm_scheduler *scheduler, schedule_task *task)
+{
+        task->state = TASK_READY;
+        task->next = NULL;
+        if(NULL == scheduler->tail) {
+                scheduler->head = task;
+        }
+        else {
+                scheduler->tail->next = task;
+        }
+        scheduler->tail = task;
+
+#ifdef HAVE_PTHREAD
+        pthread_cond_signal(&scheduler->ready);
+#endif
+}
+
+static schedule_task *dequeue(vm_scheduler *scheduler)
+{
+        schedule_task *task = scheduler->head;
+
+        scheduler->head = task->next;
+        if(NULL == scheduler->head) {
+                scheduler->tail = NULL;
+        }
+        task->state = TASK_RUNNING;
+        return task;
+}
+
+static int schedule_read(void *data, int *value)
+{
+        schedule_task *task = data;
+        vm_scheduler *scheduler = task->scheduler;
+        int result = -1;
+
+        LOCK(scheduler);
+        if(task->input_position < task->input_count) {
+                *value = task->input[task->input_position++];
+                result = 1;
+        }
+        else if(task->input_closed) {
+                result = 0;
+        }
+        UNLOCK(scheduler);
+
+        return result;
+}
+
+static void schedule_write(void *data, int value)
+{
+        schedule_task *task = data;
+
+        if(NULL != task->write) {
+                task->write(task->write_data, value);
+        }
+        else {
+                output_word(value);
+        }
+}
+
+/* Исполнение задачи task в течение одного кванта. Вызывается под
+ * блокировкой, исполняет программу без неё.
+ */
+static void run_task(vm_scheduler *scheduler, schedule_task *task)
+{
+        unsigned long budget = scheduler->budget;
+        unsigned long limit = scheduler->limit;
+        vm_status status;
+
+        UNLOCK(scheduler);
+        if(0 != limit && limit - task->vm->instructions < budget) {
+                budget = limit - task->vm->instructions;
+        }
+        status = vm_context_resume(task->vm, budget);
+        if(VM_YIELD == status && 0 != limit && task->vm->instructions >= limit) {
+                status = VM_LIMIT;
+        }
+        LOCK(scheduler);
+
+        if(VM_YIELD == status) {
+                enqueue(scheduler, task);
+                return;
+        }
+
+        if(VM_WAIT_INPUT == status) {
+                /* Данные могли прийти, пока задача исполнялась */
+                if(task->input_position < task->input_count || task->input_closed) {
+                        enqueue(scheduler, task);
+                        return;
+                }
+                task->state = TASK_WAITING;
+        }
+        else {
+                task->state = TASK_DONE;
+                task->status = status;
+        }
+
+        --scheduler->active;
+#ifdef HAVE_PTHREAD
+        pthread_cond_broadcast(&scheduler->finished);
+        if(0 == scheduler->active) {
+                pthread_cond_broadcast(&scheduler->idle);
+        }
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void *worker_main(void *data)
+{
+        vm_scheduler *scheduler = data;
+
+        LOCK(scheduler);
+        for(;;) {
+                while(!scheduler->stop && NULL == scheduler->head) {
+                        pthread_cond_wait(&scheduler->ready, &scheduler->lock);
+                }
+                if(scheduler->stop) {
+                        break;
+                }
+                run_task(scheduler, dequeue(scheduler));
+        }
+        UNLOCK(scheduler);
+
+        return NULL;
+}
+#endif
+
+vm_scheduler *vm_scheduler_create(int threads, unsigned long budget)
+{
+        vm_scheduler *scheduler = calloc(1, sizeof(vm_scheduler));
+
+        if(NULL == scheduler) {
+                return NULL;
+        }
+
+        scheduler->budget = (0 != budget) ? budget : 1;
+        scheduler->threads_count = (threads > 0) ? threads : 1;
+
+#ifdef HAVE_PTHREAD
+        {
+                int i;
+
+                pthread_mutex_init(&scheduler->lock, NULL);
+                pthread_cond_init(&scheduler->ready, NULL);
+                pthread_cond_init(&scheduler->idle, NULL);
+                pthread_cond_init(&scheduler->finished, NULL);
+
+                scheduler->threads = calloc(scheduler->threads_count, sizeof(pthread_t));
+                if(NULL == scheduler->threads) {
+                        scheduler->threads_count = 0;
+                        vm_scheduler_destroy(scheduler);
+                        return NULL;
+                }
+                for(i = 0; i < scheduler->threads_count; ++i) {
+                        if(0 != pthread_create(&scheduler->threads[i], NULL, worker_main, scheduler)) {
+                                scheduler->threads_count = i;
+                                vm_scheduler_destroy(scheduler);
+                                return NULL;
+                        }
+                }
+        }
+#endif
+
+        return scheduler;
+}
+
+void vm_scheduler_set_limit(vm_scheduler *scheduler, unsigned long limit)
+{
+        LOCK(scheduler);
+        scheduler->limit = limit;
+        UNLOCK(scheduler);
+}
+
+int vm_scheduler_add(vm_scheduler *scheduler, vm_context *vm)
+{
+        schedule_task *task = calloc(1, sizeof(schedule_task));
+        int id;
+
+        if(NULL == task) {
+                return -1;
+        }
+
+        task->scheduler = scheduler;
+        task->vm = vm;
+        task->write = vm->write;
+        task->write_data = vm->io_data;
+        vm_context_set_io(vm, schedule_read, schedule_write, task);
+
+        LOCK(scheduler);
+        if(scheduler->tasks_count == scheduler->tasks_capacity) {
+                unsigned int capacity = scheduler->tasks_capacity ? 2 * scheduler->tasks_capacity : 64;
+                schedule_task **tasks = realloc(scheduler->tasks, capacity * sizeof(schedule_task *));
+
+                if(NULL == tasks) {
+                        UNLOCK(scheduler);
+                        vm_context_set_io(vm, NULL, task->write, task->write_data);
+                        free(task);
+                        return -1;
+                }
+                scheduler->tasks = tasks;
+                scheduler->tasks_capacity = capacity;
+        }
+
+        id = (int) scheduler->tasks_count;
+        scheduler->tasks[scheduler->tasks_count++] = task;
+        ++scheduler->active;
+        enqueue(scheduler, task);
+        UNLOCK(scheduler);
+
+        return id;
+}
+
+/* Возврат ждущей задачи в очередь. Вызывается под блокировкой. */
+static void wake(vm_scheduler *scheduler, schedule_task *task)
+{
+        if(TASK_WAITING == task->state) {
+                ++scheduler->active;
+                enqueue(scheduler, task);
+        }
+}
+
+int vm_scheduler_input(vm_scheduler *scheduler, int task_id, int const *values,
+                       unsigned int count)
+{
+        schedule_task *task;
+        int ok = 1;
+
+        LOCK(scheduler);
+        task = scheduler->tasks[task_id];
+
+        /* Прочитанные числа больше не нужны */
+        if(task->input_position == task->input_count) {
+                task->input_position = 0;
+                task->input_count = 0;
+        }
+
+        if(task->input_count + count > task->input_capacity) {
+                unsigned int capacity = task->input_capacity ? task->input_capacity : 16;
+                int *input;
+
+                while(capacity < task->input_count + count) {
+                        capacity *= 2;
+                }
+                input = realloc(task->input, capacity * sizeof(int));
+                if(NULL == input) {
+                        ok = 0;
+                }
+                else {
+                        task->input = input;
+                        task->input_capacity = capacity;
+                }
+        }
+
+        if(ok) {
+                memcpy(task->input + task->input_count, values, count * sizeof(int));
+                task->input_count += count;
+                wake(scheduler, task);
+        }
+        UNLOCK(scheduler);
+
+        return ok;
+}
+
+void vm_scheduler_close_input(vm_scheduler *scheduler, int task_id)
+{
+        LOCK(scheduler);
+        scheduler->tasks[task_id]->input_closed = 1;
+        wake(scheduler, scheduler->tasks[task_id]);
+        UNLOCK(scheduler);
+}
+
+void vm_scheduler_wait(vm_scheduler *scheduler)
+{
+        LOCK(scheduler);
+#ifdef HAVE_PTHREAD
+        while(0 != scheduler->active) {
+                pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+        }
+#else
+        /* Без потоков задачи исполняет вызывающий поток */
+        while(NULL != scheduler->head) {
+                run_task(scheduler, dequeue(scheduler));
+        }
+#endif
+        UNLOCK(scheduler);
+}
+
+void vm_scheduler_wait_task(vm_scheduler *scheduler, int task_id)
+{
+        schedule_task *task;
+
+        LOCK(scheduler);
+        task = scheduler->tasks[task_id];
+#ifdef HAVE_PTHREAD
+        while(TASK_READY == task->state || TASK_RUNNING == task->state) {
+                pthread_cond_wait(&scheduler->finished, &scheduler->lock);
+        }
+#else
+        while(TASK_READY == task->state) {
+                run_task(scheduler, dequeue(scheduler));
+        }
+#endif
+        UNLOCK(scheduler);
+}
+
+vm_status vm_scheduler_status(vm_scheduler *scheduler, int task_id)
+{
+        schedule_task *task;
+        vm_status status;
+
+        LOCK(scheduler);
+        task = scheduler->tasks[task_id];
+        switch(task->state) {
+        case TASK_DONE:
+                status = task->status;
+                break;
+
+        case TASK_WAITING:
+                status = VM_WAIT_INPUT;
+                break;
+
+        default:
+                status = VM_YIELD;
+        }
+        UNLOCK(scheduler);
+
+        return status;
+}
+
+void vm_scheduler_destroy(vm_scheduler *scheduler)
+{
+        unsigned int i;
+
+#ifdef HAVE_PTHREAD
+        int thread;
+
+        /* Задачи в очереди остаются неисполненными */
+        LOCK(scheduler);
+        scheduler->stop = 1;
+        pthread_cond_broadcast(&scheduler->ready);
+        UNLOCK(scheduler);
+
+        for(thread = 0; thread < scheduler->threads_count; ++thread) {
+                pthread_join(scheduler->threads[thread], NULL);
+        }
+        free(scheduler->threads);
+
+        pthread_cond_destroy(&scheduler->finished);
+        pthread_cond_destroy(&scheduler->idle);
+        pthread_cond_destroy(&scheduler->ready);
+        pthread_mutex_destroy(&scheduler->lock);
+#endif
+
+        for(i = 0; i < scheduler->tasks_count; ++i) {
+                schedule_task *task = scheduler->tasks[i];
+
+                vm_context_set_io(task->vm, NULL, task->write, task->write_data);
+                free(task->input);
+                free(task);
+        }
+        free(scheduler->tasks);
+        free(scheduler);
+}
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_SOCKETS
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+/* Сервер исполнения программ (mvm --serve).
+ *
+ * Сервер принимает соединения на локальном сокете Unix. Запрос - одно
+ * соединение: строка заголовка, текст программы и входные данные до
+ * конца потока (клиент закрывает соединение на запись). Разобранные
+ * и проверенные программы хранятся в кэше по хэшу их текста, поэтому
+ * повторный запрос с той же программой не разбирает её заново, а запрос
+ * HASH не передаёт её вовсе. Каждый рабочий поток принимает соединения
+ * сам и исполняет программу в своём контексте. Перед следующим
+ * запуском той же программы восстанавливаются только слова памяти
+ * данных, в которые программа может писать (адреса команд STORE);
+ * если в программе есть BSTORE, память копируется целиком.
+ *
+ * Программа исполняется квантами по SERVE_SLICE команд. Между квантами
+ * сервер проверяет, не закрыл ли клиент соединение и не превышено ли
+ * ограничение числа команд одного запроса, поэтому бесконечный цикл
+ * в программе не занимает рабочий поток навсегда.
+ */
+
+#ifdef HAVE_SOCKETS
+
+/* Наибольшая длина строки заголовка */
+#define SERVE_HEADER            128
+
+/* Наибольший размер запроса */
+#define SERVE_MAX_REQUEST       (64 * 1024 * 1024)
+
+/* Размер буфера вывода соединения */
+#define SERVE_OUTPUT            8192
+
+/* Число команд в кванте исполнения запроса */
+#define SERVE_SLICE             (1024 * 1024)
+
+/* Программа в кэше */
+typedef struct {
+        unsigned long long hash;
+        unsigned char *text;            /* Текст программы для сравнения */
+        size_t length;
+        vm_context *vm;                 /* Программа и начальная память данных */
+        int verified;
+        unsigned int *stores;           /* Адреса STORE; NULL - вся память */
+        unsigned int stores_count;
+        unsigned int refs;              /* Ссылки из кэша и рабочих потоков */
+        unsigned long used;             /* Время последнего обращения */
+} cached_program;
+
+/* Рабочий поток */
+typedef struct {
+        pthread_t thread;
+        vm_context *vm;
+        cached_program *program;        /* Программа в памяти команд vm */
+        int client;
+        input_source source;
+        char output[SERVE_OUTPUT];
+        size_t output_length;
+        int output_failed;
+} serve_worker;
+
+static int listener = -1;
+static char const *socket_path;
+
+/* Размер памяти данных программ: как у контекста, запустившего сервер */
+static unsigned int memory_size;
+
+/* Наибольшее число команд одного запроса; 0 - без ограничения */
+static unsigned long instruction_limit;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_program **cache;
+static unsigned int cache_size;
+static unsigned int cache_count;
+static unsigned long cache_clock;
+
+/* Хэш FNV-1a */
+static unsigned long long hash_text(unsigned char const *text, size_t length)
+{
+        unsigned long long hash = 14695981039346656037ull;
+        size_t i;
+
+        for(i = 0; i < length; ++i) {
+                hash = (hash ^ text[i]) * 1099511628211ull;
+        }
+
+        return hash;
+}
+
+/* Освобождение ссылки на программу. Вызывается под cache_lock. */
+static void release_program(cached_program *program)
+{
+        if(NULL == program || 0 != --program->refs) {
+                return;
+        }
+
+        vm_context_destroy(program->vm);
+        free(program->stores);
+        free(program->text);
+        free(program);
+}
+
+/* Адреса памяти данных, в которые может писать программа текущего
+ * контекста. Программы с BSTORE и записью за плотной страницей памяти
+ * списка не получают: их память копируется целиком.
+ */
+static void find_stores(cached_program *program)
+{
+        unsigned char *seen;
+        unsigned int address;
+
+        for(address = 0; address < vm_program_size; ++address) {
+                if(BSTORE == vm_program[address].operation ||
+                   (STORE == vm_program[address].operation &&
+                    (unsigned int) vm_program[address].arg >= DENSE_MEMORY_SIZE)) {
+                        return;
+                }
+        }
+
+        seen = calloc(DENSE_MEMORY_SIZE, 1);
+        program->stores = malloc(vm_program_size * sizeof(unsigned int) + sizeof(unsigned int));
+        if(NULL == seen || NULL == program->stores) {
+                free(seen);
+                free(program->stores);
+                program->stores = NULL;
+                return;
+        }
+
+        for(address = 0; address < vm_program_size; ++address) {
+                unsigned int target = (unsigned int) vm_program[address].arg;
+
+                if(STORE == vm_program[address].operation && !seen[target]) {
+                        seen[target] = 1;
+                        program->stores[program->stores_count++] = target;
+                }
+        }
+
+        free(seen);
+}
+
+/* Загрузка и проверка программы. Возвращает NULL при ошибке. */
+static cached_program *load_program(unsigned char const *text, size_t length,
+                                    unsigned long long hash)
+{
+        cached_program *program = calloc(1, sizeof(cached_program));
+        vm_context *previous = vm_current;
+        verify_result result;
+
+        if(NULL == program) {
+                return NULL;
+        }
+
+        program->hash = hash;
+        program->length = length;
+        program->text = malloc(length + 1);
+        program->vm = vm_context_create();
+        program->refs = 1;
+        if(NULL == program->text || NULL == program->vm ||
+           !vm_context_set_memory(program->vm, memory_size) ||
+           VM_OK != vm_context_load_memory(program->vm, text, length)) {
+                release_program(program);
+                return NULL;
+        }
+        memcpy(program->text, text, length);
+
+        vm_current = program->vm;
+        verify_program(&result);
+        program->verified = (VERIFY_OK == result.status);
+        find_stores(program);
+        vm_current = previous;
+
+        return program;
+}
+
+/* Добавление программы в кэш, при необходимости - с вытеснением
+ * программы, к которой дольше всего не обращались. Вызывается под
+ * cache_lock.
+ */
+static void insert_program(cached_program *program)
+{
+        unsigned int oldest = 0;
+        unsigned int i;
+
+        if(cache_count == cache_size) {
+                for(i = 1; i < cache_count; ++i) {
+                        if(cache[i]->used < cache[oldest]->used) {
+                                oldest = i;
+                        }
+                }
+                release_program(cache[oldest]);
+                cache[oldest] = cache[--cache_count];
+        }
+
+        ++program->refs;
+        program->used = ++cache_clock;
+        cache[cache_count++] = program;
+}
+
+/* Поиск программы в кэше: по хэшу или, если text не NULL, по тексту.
+ * Возвращает программу со ссылкой для вызывающего или NULL. Вызывается
+ * под cache_lock.
+ */
+static cached_program *find_program(unsigned long long hash, unsigned char const *text,
+                                    size_t length)
+{
+        unsigned int i;
+
+        for(i = 0; i < cache_count; ++i) {
+                cached_program *program = cache[i];
+
+                if(program->hash == hash && (NULL == text || (program->length == length &&
+                   0 == memcmp(program->text, text, length)))) {
+                        ++program->refs;
+                        program->used = ++cache_clock;
+                        return program;
+                }
+        }
+
+        return NULL;
+}
+
+/* Программа с текстом text из кэша или загруженная заново */
+static cached_program *acquire_program(unsigned char const *text, size_t length)
+{
+        unsigned long long hash = hash_text(text, length);
+        cached_program *program;
+        cached_program *found;
+
+        pthread_mutex_lock(&cache_lock);
+        program = find_program(hash, text, length);
+        pthread_mutex_unlock(&cache_lock);
+        if(NULL != program) {
+                return program;
+        }
+
+        program = load_program(text, length, hash);
+        if(NULL == program) {
+                return NULL;
+        }
+
+        /* Пока программа загружалась, её мог загрузить другой поток */
+        pthread_mutex_lock(&cache_lock);
+        found = find_program(hash, text, length);
+        if(NULL != found) {
+                release_program(program);
+                program = found;
+        }
+        else {
+                insert_program(program);
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        return program;
+}
+
+static void flush_client(serve_worker *worker)
+{
+        size_t written = 0;
+
+        while(!worker->output_failed && written < worker->output_length) {
+                ssize_t result = write(worker->client, worker->output + written,
+                                       worker->output_length - written);
+
+                if(result > 0) {
+                        written += result;
+                }
+                else if(result < 0 && EINTR == errno) {
+                        continue;
+                }
+                else {
+                        /* Клиент закрыл соединение: вывод дальше не нужен */
+                        worker->output_failed = 1;
+                }
+        }
+
+        worker->output_length = 0;
+}
+
+static void send_line(serve_worker *worker, char const *line)
+{
+        size_t length = strlen(line);
+
+        if(worker->output_length + length > SERVE_OUTPUT) {
+                flush_client(worker);
+        }
+        memcpy(worker->output + worker->output_length, line, length);
+        worker->output_length += length;
+}
+
+static int serve_read(void *data, int *value)
+{
+        return read_input(&((serve_worker *) data)->source, value);
+}
+
+static void serve_write(void *data, int value)
+{
+        char line[16];
+
+        sprintf(line, "%d\n", value);
+        send_line(data, line);
+}
+
+/* Клиент закрыл соединение, и результат запроса уже некому передать */
+static int client_gone(serve_worker *worker)
+{
+        struct pollfd client;
+
+        if(worker->output_failed) {
+                return 1;
+        }
+        client.fd = worker->client;
+        client.events = 0;
+        client.revents = 0;
+        return poll(&client, 1, 0) > 0 && 0 != (client.revents & (POLLHUP | POLLERR));
+}
+
+/* Квант исполнения программы запроса: не более vm_current->budget команд
+ * (для проверенных программ - до ближайшего перехода после них)
+ */
+static void run_slice()
+{
+        serve_worker *worker = vm_current->io_data;
+        int more = worker->program->verified ?
+                run_unchecked_budget(vm_current->budget) : run_budget(vm_current->budget);
+
+        if(more) {
+                vm_current->status = VM_YIELD;
+        }
+}
+
+/* Чтение запроса до конца потока. Возвращает NULL при ошибке. */
+static unsigned char *read_request(int client, size_t *length)
+{
+        size_t capacity = 4096;
+        unsigned char *request = malloc(capacity);
+
+        *length = 0;
+        while(NULL != request) {
+                ssize_t result;
+
+                if(*length == capacity) {
+                        unsigned char *larger = NULL;
+
+                        if(capacity < SERVE_MAX_REQUEST) {
+                                capacity *= 2;
+                                larger = realloc(request, capacity);
+                        }
+                        if(NULL == larger) {
+                                free(request);
+                                return NULL;
+                        }
+                        request = larger;
+                }
+
+                result = read(client, request + *length, capacity - *length);
+                if(result > 0) {
+                        *length += result;
+                }
+                else if(0 == result) {
+                        break;
+                }
+                else if(EINTR != errno) {
+                        free(request);
+                        return NULL;
+                }
+        }
+
+        return request;
+}
+
+/* Переход контекста потока к программе program. Ссылка на program
+ * переходит к потоку. Возвращает 0, если не хватило памяти под
+ * страницы памяти данных.
+ */
+static int switch_program(serve_worker *worker, cached_program *program)
+{
+        vm_context *vm = worker->vm;
+        unsigned int i;
+
+        if(worker->program != program) {
+                pthread_mutex_lock(&cache_lock);
+                release_program(worker->program);
+                pthread_mutex_unlock(&cache_lock);
+
+                worker->program = program;
+                if(VM_OK == vm_context_share(vm, program->vm)) {
+                        return 1;
+                }
+        }
+        else {
+                pthread_mutex_lock(&cache_lock);
+                release_program(program);
+                pthread_mutex_unlock(&cache_lock);
+
+                /* Память после прошлого запуска этой же программы */
+                vm->stack_pointer = 0;
+                vm->command_pointer = 0;
+                if(NULL != program->stores) {
+                        for(i = 0; i < program->stores_count; ++i) {
+                                vm->memory[program->stores[i]] = program->vm->memory[program->stores[i]];
+                        }
+                        return 1;
+                }
+                if(copy_memory(vm, program->vm)) {
+                        return 1;
+                }
+        }
+
+        /* Память скопирована не целиком: следующий запрос скопирует её заново */
+        pthread_mutex_lock(&cache_lock);
+        release_program(worker->program);
+        pthread_mutex_unlock(&cache_lock);
+        worker->program = NULL;
+        return 0;
+}
+
+static void serve_request(serve_worker *worker)
+{
+        unsigned char *request;
+        size_t length;
+        size_t header_length;
+        char header[SERVE_HEADER + 1];
+        char kind[16];
+        char argument[32];
+        char format_name[16] = "text";
+        input_format format = INPUT_TEXT;
+        cached_program *program = NULL;
+        unsigned char *input;
+        char line[128];
+        vm_status status;
+        int fields;
+
+        request = read_request(worker->client, &length);
+        if(NULL == request) {
+                send_line(worker, "# Error: bad request\n");
+                return;
+        }
+
+        for(header_length = 0; header_length < length && header_length < SERVE_HEADER &&
+            '\n' != request[header_length]; ++header_length) {
+        }
+        memcpy(header, request, header_length);
+        header[header_length] = '\0';
+        input = request + header_length + 1;
+
+        fields = (header_length < length && '\n' == request[header_length]) ?
+                sscanf(header, "%15s %31s %15s", kind, argument, format_name) : 0;
+        if(0 == strcmp(format_name, "binary")) {
+                format = INPUT_BINARY;
+        }
+        else if(0 != strcmp(format_name, "text")) {
+                fields = 0;
+        }
+
+        if(fields >= 2 && 0 == strcmp(kind, "PROGRAM")) {
+                char *end;
+                unsigned long size = strtoul(argument, &end, 10);
+
+                if('\0' != *end || size > (unsigned long) (request + length - input)) {
+                        send_line(worker, "# Error: bad request\n");
+                        free(request);
+                        return;
+                }
+
+                program = acquire_program(input, size);
+                if(NULL == program) {
+                        send_line(worker, "# Error: unable to load program\n");
+                        free(request);
+                        return;
+                }
+                input += size;
+        }
+        else if(fields >= 2 && 0 == strcmp(kind, "HASH")) {
+                char *end;
+                unsigned long long hash = strtoull(argument, &end, 16);
+
+                if('\0' == *end) {
+                        pthread_mutex_lock(&cache_lock);
+                        program = find_program(hash, NULL, 0);
+                        pthread_mutex_unlock(&cache_lock);
+                }
+                if(NULL == program) {
+                        send_line(worker, "# Error: unknown program\n");
+                        free(request);
+                        return;
+                }
+        }
+        else {
+                send_line(worker, "# Error: bad request\n");
+                free(request);
+                return;
+        }
+
+        sprintf(line, "# Program %016llx\n", program->hash);
+        send_line(worker, line);
+
+        if(switch_program(worker, program)) {
+                vm_context *vm = worker->vm;
+
+                open_input_memory(&worker->source, input, request + length - input, format);
+                vm->instructions = 0;
+                vm->stack_pointer = 0;
+                vm->command_pointer = 0;
+                do {
+                        vm->budget = SERVE_SLICE;
+                        if(0 != instruction_limit && instruction_limit - vm->instructions < SERVE_SLICE) {
+                                vm->budget = instruction_limit - vm->instructions;
+                        }
+                        status = run_protected(run_slice);
+                } while(VM_YIELD == status && !client_gone(worker) &&
+                        (0 == instruction_limit || vm->instructions < instruction_limit));
+                close_input(&worker->source);
+        }
+        else {
+                status = VM_NO_MEMORY;
+        }
+
+        if(VM_YIELD == status) {
+                if(client_gone(worker)) {
+                        free(request);
+                        return;
+                }
+                sprintf(line, "# Error: instruction limit exceeded at %u\n", worker->vm->command_pointer);
+        }
+        else if(VM_OK == status) {
+                sprintf(line, "# OK %lu\n", worker->vm->instructions);
+        }
+        else if(VM_RUNTIME_ERROR == status) {
+                sprintf(line, "# Error: %s at %u\n", vm_error_message(worker->vm->error),
+                        worker->vm->error_address);
+        }
+        else {
+                sprintf(line, "# Error: not enough memory\n");
+        }
+        send_line(worker, line);
+
+        free(request);
+}
+
+static void *worker_main(void *data)
+{
+        serve_worker *worker = data;
+
+        vm_current = worker->vm;
+        for(;;) {
+                worker->client = accept(listener, NULL, NULL);
+                if(worker->client < 0) {
+                        if(EINTR == errno || ECONNABORTED == errno) {
+                                continue;
+                        }
+                        perror("accept");
+                        break;
+                }
+
+                worker->output_length = 0;
+                worker->output_failed = 0;
+                serve_request(worker);
+                flush_client(worker);
+                close(worker->client);
+        }
+
+        return NULL;
+}
+
+static void on_stop_signal(int signal)
+{
+        unlink(socket_path);
+        _exit(0);
+}
+
+int run_server(char const *path, int threads, unsigned int programs, unsigned long limit)
+{
+        struct sockaddr_un address;
+        struct stat info;
+        serve_worker *workers;
+        int i;
+
+        if(strlen(path) >= sizeof(address.sun_path)) {
+                printf("Socket path is too long: %s\n", path);
+                return 1;
+        }
+
+        if(threads <= 0) {
+                threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                threads = (threads > 0) ? threads : 1;
+        }
+        memory_size = vm_memory_size;
+        instruction_limit = limit;
+        cache_size = (programs > 0) ? programs : 1;
+        cache = calloc(cache_size, sizeof(cached_program *));
+        workers = calloc(threads, sizeof(serve_worker));
+        if(NULL == cache || NULL == workers) {
+                printf("Not enough memory\n");
+                return 1;
+        }
+
+        /* Сокет, оставшийся от прошлого запуска */
+        if(0 == stat(path, &info) && S_ISSOCK(info.st_mode)) {
+                unlink(path);
+        }
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path);
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listener < 0 || 0 != bind(listener, (struct sockaddr *) &address, sizeof(address)) ||
+           0 != listen(listener, SOMAXCONN)) {
+                printf("Unable to listen on %s\n", path);
+                return 1;
+        }
+
+        socket_path = path;
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, on_stop_signal);
+        signal(SIGTERM, on_stop_signal);
+
+        for(i = 0; i < threads; ++i) {
+                workers[i].vm = vm_context_create();
+                if(NULL == workers[i].vm) {
+                        printf("Not enough memory\n");
+                        return 1;
+                }
+                vm_context_set_io(workers[i].vm, serve_read, serve_write, &workers[i]);
+        }
+
+        printf("Listening on %s, %d threads, %u cached programs\n", path, threads, cache_size);
+        fflush(stdout);
+
+        for(i = 0; i < threads; ++i) {
+                if(0 != pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+                        printf("Unable to start worker thread\n");
+                        exit(1);
+                }
+        }
+        for(i = 0; i < threads; ++i) {
+                pthread_join(workers[i].thread, NULL);
+        }
+
+        unlink(path);
+        return 1;
+}
+
+#else
+
+int run_server(char const *path, int threads, unsigned int programs, unsigned long limit)
+{
+        printf("Server mode is not supported\n");
+        return 1;
+}
+
+#endif
@@ -0,0 +1,477 @@
+#include "vm_internal.h"
+
+#ifdef __GNUC__
+
+/* Ячейка шитого кода */
+typedef struct {
+        void const *handler;    /* Адрес обработчика команды */
+        int arg;                /* Аргументы команды из super_program */
+        int arg2;
+        int arg3;
+        int arg4;
+} threaded_command;
+
+/* Шитый код. Ячейки соответствуют командам super_program. */
+struct threaded_workspace {
+        threaded_command code[MAX_PROGRAM_SIZE + 1];
+};
+
+/* Переход к следующей команде */
+#define NEXT()          goto *(++ip)->handler
+
+/* Переход к ячейке с индексом target */
+#define JUMP_TO(target) do { ip = code + (target); goto *ip->handler; } while(0)
+
+/* Сохранение состояния машины и сообщение об ошибке в команде,
+ * отстоящей на offset от начала текущей (супер)команды.
+ */
+#define FAIL_AT(error, offset)                                                  \
+                        do {                                                    \
+                                vm_stack_pointer = sp;                          \
+                                vm_command_pointer =                            \
+                                        super_program[ip - code].address \
+                                        + (offset);                             \
+                                vm_error(error);                                \
+                                return;                                         \
+                        } while(0)
+
+#define FAIL(error)     FAIL_AT(error, 0)
+
+/* Проверка места в стеке под два значения, заталкиваемых
+ * первыми двумя командами суперкоманды.
+ */
+#define CHECK_TWO_PUSHES()                                                      \
+                        do {                                                    \
+                                if(sp + 1 >= MAX_STACK_SIZE)                    \
+                                        FAIL_AT(STACK_OVERFLOW,                 \
+                                                (sp >= MAX_STACK_SIZE) ? 0 : 1); \
+                        } while(0)
+
+/* Результат сравнения left и right по коду relation */
+static int compare_values(int left, int right, int relation)
+{
+        switch(relation) {
+        case EQ:
+                return left == right;
+
+        case NE:
+                return left != right;
+
+        case LT:
+                return left < right;
+
+        case GT:
+                return left > right;
+
+        case LE:
+                return left <= right;
+
+        default:
+                return left >= right;
+        }
+}
+
+void run_threaded()
+{
+        static void const *handlers[SUPER_OPERATIONS_COUNT] = {
+                [NOP]                           = &&op_nop,
+                [STOP]                          = &&op_stop,
+                [LOAD]                          = &&op_load,
+                [STORE]                         = &&op_store,
+                [BLOAD]                         = &&op_bload,
+                [BSTORE]                        = &&op_bstore,
+                [PUSH]                          = &&op_push,
+                [POP]                           = &&op_pop,
+                [DUP]                           = &&op_dup,
+                [INVERT]                        = &&op_invert,
+                [ADD]                           = &&op_add,
+                [SUB]                           = &&op_sub,
+                [MULT]                          = &&op_mult,
+                [DIV]                           = &&op_div,
+                [COMPARE]                       = &&op_compare,
+                [JUMP]                          = &&op_jump,
+                [JUMP_YES]                      = &&op_jump_yes,
+                [JUMP_NO]                       = &&op_jump_no,
+                [INPUT]                         = &&op_input,
+                [PRINT]                         = &&op_print,
+                [HALT]                          = &&op_stop,
+                [BAD_JUMP]                      = &&op_bad_jump,
+                [UNKNOWN_OPERATION]             = &&op_unknown,
+                [LOAD_LOAD_ADD]                 = &&op_load_load_add,
+                [LOAD_LOAD_SUB]                 = &&op_load_load_sub,
+                [LOAD_LOAD_MULT]                = &&op_load_load_mult,
+                [LOAD_PUSH_ADD]                 = &&op_load_push_add,
+                [LOAD_PUSH_SUB]                 = &&op_load_push_sub,
+                [LOAD_PUSH_MULT]                = &&op_load_push_mult,
+                [LOAD_LOAD_ADD_STORE]           = &&op_load_load_add_store,
+                [LOAD_LOAD_SUB_STORE]           = &&op_load_load_sub_store,
+                [LOAD_LOAD_MULT_STORE]          = &&op_load_load_mult_store,
+                [LOAD_PUSH_ADD_STORE]           = &&op_load_push_add_store,
+                [LOAD_PUSH_SUB_STORE]           = &&op_load_push_sub_store,
+                [LOAD_PUSH_MULT_STORE]          = &&op_load_push_mult_store,
+                [LOAD_STORE]                    = &&op_load_store,
+                [PUSH_STORE]                    = &&op_push_store,
+                [COMPARE_JUMP_YES]              = &&op_compare_jump_yes,
+                [COMPARE_JUMP_NO]               = &&op_compare_jump_no,
+                [LOAD_PUSH_COMPARE_JUMP_YES]    = &&op_load_push_compare_jump_yes,
+                [LOAD_PUSH_COMPARE_JUMP_NO]     = &&op_load_push_compare_jump_no,
+                [LOAD_LOAD_COMPARE_JUMP_YES]    = &&op_load_load_compare_jump_yes,
+                [LOAD_LOAD_COMPARE_JUMP_NO]     = &&op_load_load_compare_jump_no
+        };
+
+        threaded_command *code;
+        threaded_command const *ip;
+        int *memory = vm_memory;
+        unsigned int memory_size = vm_memory_size;
+        int *stack = vm_stack;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int address;
+        unsigned int i;
+        int data;
+
+        /* Слияние команд и перевод результата в шитый код. Проверки,
+         * не зависящие от данных, выполнены при слиянии.
+         */
+        fuse_program();
+
+        if(NULL == vm_current->threaded) {
+                vm_current->threaded = vm_allocate(sizeof(threaded_workspace));
+        }
+        code = vm_current->threaded->code;
+
+        for(i = 0; i <= super_program_size; ++i) {
+                super_command const *super = &super_program[i];
+                threaded_command *cell = &code[i];
+
+                cell->handler = fusion_stats ? &&op_count : handlers[super->operation];
+                cell->arg = super->arg;
+                cell->arg2 = super->arg2;
+                cell->arg3 = super->arg3;
+                cell->arg4 = super->arg4;
+        }
+
+        for(i = 0; i < SUPER_OPERATIONS_COUNT; ++i) {
+                super_hits[i] = 0;
+        }
+
+        ip = code;
+        goto *ip->handler;
+
+op_count:
+        /* Подсчёт исполнений для отчёта о слиянии */
+        data = super_program[ip - code].operation;
+        ++super_hits[data];
+        goto *handlers[data];
+
+op_nop:
+        NEXT();
+
+op_stop:
+        /* У HALT адрес равен MAX_PROGRAM_SIZE, как после выполнения
+         * всей памяти команд в run().
+         */
+        vm_stack_pointer = sp;
+        vm_command_pointer = super_program[ip - code].address;
+        if(fusion_stats) {
+                fusion_report(stderr);
+        }
+        return;
+
+op_load:
+        address = ip->arg;
+        if(address >= memory_size)
+                FAIL(BAD_DATA_ADDRESS);
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        stack[sp++] = LOAD_WORD(memory, address);
+        NEXT();
+
+op_store:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        address = ip->arg;
+        if(address >= memory_size)
+                FAIL(BAD_DATA_ADDRESS);
+        --sp;
+        STORE_WORD(memory, address, stack[sp]);
+        NEXT();
+
+op_bload:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        address = (unsigned int) ip->arg + stack[sp - 1];
+        if(address >= memory_size)
+                FAIL(BAD_DATA_ADDRESS);
+        stack[sp - 1] = LOAD_WORD(memory, address);
+        NEXT();
+
+op_bstore:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        address = (unsigned int) ip->arg + stack[sp - 1];
+        if(address >= memory_size)
+                FAIL(BAD_DATA_ADDRESS);
+        STORE_WORD(memory, address, stack[sp - 2]);
+        sp -= 2;
+        NEXT();
+
+op_push:
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        stack[sp++] = ip->arg;
+        NEXT();
+
+op_pop:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        --sp;
+        NEXT();
+
+op_dup:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        stack[sp] = stack[sp - 1];
+        ++sp;
+        NEXT();
+
+op_invert:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        stack[sp - 1] = -stack[sp - 1];
+        NEXT();
+
+op_add:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        --sp;
+        stack[sp - 1] = stack[sp - 1] + stack[sp];
+        NEXT();
+
+op_sub:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        --sp;
+        stack[sp - 1] = stack[sp - 1] - stack[sp];
+        NEXT();
+
+op_mult:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        --sp;
+        stack[sp - 1] = stack[sp - 1] * stack[sp];
+        NEXT();
+
+op_div:
+        /* Делитель проверяется раньше, чем наличие делимого */
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        if(0 == stack[sp - 1])
+                FAIL(DIVISION_BY_ZERO);
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        if(DIVISION_OVERFLOWS(stack[sp - 2], stack[sp - 1]))
+                FAIL(DIVISION_OVERFLOW);
+        --sp;
+        stack[sp - 1] = stack[sp - 1] / stack[sp];
+        NEXT();
+
+op_compare:
+        /* Код сравнения проверяется после первого и до второго
+         * выталкивания, как в run().
+         */
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        if((unsigned int) ip->arg > GE)
+                FAIL(BAD_RELATION);
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        data = stack[--sp];
+        switch(ip->arg) {
+        case EQ:
+                stack[sp - 1] = (stack[sp - 1] == data) ? 1 : 0;
+                break;
+
+        case NE:
+                stack[sp - 1] = (stack[sp - 1] != data) ? 1 : 0;
+                break;
+
+        case LT:
+                stack[sp - 1] = (stack[sp - 1] < data) ? 1 : 0;
+                break;
+
+        case GT:
+                stack[sp - 1] = (stack[sp - 1] > data) ? 1 : 0;
+                break;
+
+        case LE:
+                stack[sp - 1] = (stack[sp - 1] <= data) ? 1 : 0;
+                break;
+
+        case GE:
+                stack[sp - 1] = (stack[sp - 1] >= data) ? 1 : 0;
+                break;
+        }
+        NEXT();
+
+op_jump:
+        JUMP_TO(ip->arg);
+
+op_jump_yes:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        if(stack[--sp])
+                JUMP_TO(ip->arg);
+        NEXT();
+
+op_jump_no:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        if(!stack[--sp])
+                JUMP_TO(ip->arg);
+        NEXT();
+
+op_bad_jump:
+        FAIL(BAD_CODE_ADDRESS);
+
+op_input:
+        /* Адрес команды нужен vm_read() для сообщения об ошибке ввода */
+        vm_stack_pointer = sp;
+        vm_command_pointer = super_program[ip - code].address;
+        data = vm_read();
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        stack[sp++] = data;
+        NEXT();
+
+op_print:
+        if(0 == sp)
+                FAIL(STACK_EMPTY);
+        vm_write(stack[--sp]);
+        NEXT();
+
+op_unknown:
+        FAIL(UNKNOWN_COMMAND);
+
+op_load_load_add:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] + memory[ip->arg2];
+        NEXT();
+
+op_load_load_sub:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] - memory[ip->arg2];
+        NEXT();
+
+op_load_load_mult:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] * memory[ip->arg2];
+        NEXT();
+
+op_load_push_add:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] + ip->arg2;
+        NEXT();
+
+op_load_push_sub:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] - ip->arg2;
+        NEXT();
+
+op_load_push_mult:
+        CHECK_TWO_PUSHES();
+        stack[sp++] = memory[ip->arg] * ip->arg2;
+        NEXT();
+
+op_load_load_add_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] + memory[ip->arg2];
+        NEXT();
+
+op_load_load_sub_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] - memory[ip->arg2];
+        NEXT();
+
+op_load_load_mult_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] * memory[ip->arg2];
+        NEXT();
+
+op_load_push_add_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] + ip->arg2;
+        NEXT();
+
+op_load_push_sub_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] - ip->arg2;
+        NEXT();
+
+op_load_push_mult_store:
+        CHECK_TWO_PUSHES();
+        memory[ip->arg3] = memory[ip->arg] * ip->arg2;
+        NEXT();
+
+op_load_store:
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        memory[ip->arg3] = memory[ip->arg];
+        NEXT();
+
+op_push_store:
+        if(sp >= MAX_STACK_SIZE)
+                FAIL(STACK_OVERFLOW);
+        memory[ip->arg3] = ip->arg;
+        NEXT();
+
+op_compare_jump_yes:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        sp -= 2;
+        if(compare_values(stack[sp], stack[sp + 1], ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+
+op_compare_jump_no:
+        if(sp < 2)
+                FAIL(STACK_EMPTY);
+        sp -= 2;
+        if(!compare_values(stack[sp], stack[sp + 1], ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+
+op_load_push_compare_jump_yes:
+        CHECK_TWO_PUSHES();
+        if(compare_values(memory[ip->arg], ip->arg2, ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+
+op_load_push_compare_jump_no:
+        CHECK_TWO_PUSHES();
+        if(!compare_values(memory[ip->arg], ip->arg2, ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+
+op_load_load_compare_jump_yes:
+        CHECK_TWO_PUSHES();
+        if(compare_values(memory[ip->arg], memory[ip->arg2], ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+
+op_load_load_compare_jump_no:
+        CHECK_TWO_PUSHES();
+        if(!compare_values(memory[ip->arg], memory[ip->arg2], ip->arg3))
+                JUMP_TO(ip->arg4);
+        NEXT();
+}
+
+#else
+
+void run_threaded()
+{
+        run();
+}
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_internal.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_SIGNALS
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+/* Трасса исполнения (mvm --trace).
+ *
+ * Перед каждой командой в кольцевой буфер в памяти записывается запись
+ * trace_record: адрес, код операции и вершина стека. Буфер пишет только
+ * поток, исполняющий программу, поэтому блокировки не нужны: запись
+ * кладётся в ячейку position & mask, затем position увеличивается.
+ * Последние записи сохраняются в двоичный файл при ошибке времени
+ * исполнения и по сигналу SIGUSR1 (из обработчика сигнала, функциями
+ * open() и write()); mvm --decode-trace переводит файл в текст.
+ */
+
+#define TRACE_MAGIC     "MVMT"
+#define TRACE_VERSION   1
+
+/* Признак записи: стек перед командой пуст, поле top не определено */
+#define TRACE_EMPTY     1
+
+/* Запись трассы, 8 байт */
+typedef struct {
+        unsigned short address;
+        unsigned char operation;
+        unsigned char flags;
+        int top;
+} trace_record;
+
+/* Заголовок файла трассы; за ним count записей от старых к новым */
+typedef struct {
+        char magic[4];
+        unsigned int version;
+        unsigned int record_size;
+        unsigned int count;
+        unsigned long long total;       /* Число записей за весь запуск */
+} trace_header;
+
+struct trace_workspace {
+        trace_record *records;
+        unsigned long mask;             /* Размер буфера - 1 */
+        volatile unsigned long position;
+        char const *file;
+};
+
+#define tracing         (vm_current->trace)
+
+/* Буфер, который сохраняет обработчик SIGUSR1 */
+static trace_workspace *volatile signal_trace = NULL;
+
+static void run_traced()
+{
+        trace_record *records = tracing->records;
+        unsigned long mask = tracing->mask;
+        unsigned long position = tracing->position;
+        unsigned int size = vm_program_size;
+
+        vm_command_pointer = 0;
+        while(vm_command_pointer < size) {
+                trace_record *record = &records[position & mask];
+                unsigned int sp = vm_stack_pointer;
+
+                record->address = (unsigned short) vm_command_pointer;
+                record->operation = (unsigned char) vm_program[vm_command_pointer].operation;
+                record->flags = (0 == sp) ? TRACE_EMPTY : 0;
+                record->top = (0 == sp) ? 0 : vm_stack[sp - 1];
+                tracing->position = ++position;
+
+                if(!vm_run_command()) {
+                        return;
+                }
+        }
+
+        /* Дальше в памяти команд только NOP */
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+}
+
+/* Запись буфера trace в файл. Использует только функции, допустимые
+ * в обработчике сигнала. Возвращает 0 при ошибке.
+ */
+static int save_trace(trace_workspace *trace)
+{
+        unsigned long position = trace->position;
+        unsigned long size = trace->mask + 1;
+        unsigned long count = (position < size) ? position : size;
+        unsigned long first = (position - count) & trace->mask;
+        trace_header header;
+        int ok = 1;
+
+#ifdef HAVE_SIGNALS
+        int fd = open(trace->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if(fd < 0) {
+                return 0;
+        }
+#else
+        FILE *out = fopen(trace->file, "wb");
+
+        if(NULL == out) {
+                return 0;
+        }
+#endif
+
+        memcpy(header.magic, TRACE_MAGIC, 4);
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(trace_record);
+        header.count = (unsigned int) count;
+        header.total = position;
+
+#ifdef HAVE_SIGNALS
+#define WRITE(data, length)     (write(fd, (data), (length)) == (ssize_t) (length))
+#else
+#define WRITE(data, length)     (fwrite((data), 1, (length), out) == (length))
+#endif
+
+        /* Хвост кольца от first до конца буфера, затем его начало */
+        ok = ok && WRITE(&header, sizeof(header));
+        if(first + count > size) {
+                ok = ok && WRITE(&trace->records[first], (size - first) * sizeof(trace_record));
+                ok = ok && WRITE(trace->records, (first + count - size) * sizeof(trace_record));
+        }
+        else {
+                ok = ok && WRITE(&trace->records[first], count * sizeof(trace_record));
+        }
+
+#undef WRITE
+
+#ifdef HAVE_SIGNALS
+        close(fd);
+#else
+        fclose(out);
+#endif
+        return ok;
+}
+
+#ifdef HAVE_SIGNALS
+static void on_dump_signal(int signal)
+{
+        trace_workspace *trace = signal_trace;
+
+        if(NULL != trace) {
+                save_trace(trace);
+        }
+}
+#endif
+
+vm_status run_trace(char const *file, unsigned long size)
+{
+        unsigned long capacity = 1;
+        vm_status status;
+
+        /* Размер буфера - степень двойки не меньше size */
+        while(capacity < size && capacity < (1ul << 30)) {
+                capacity <<= 1;
+        }
+
+        if(NULL == tracing) {
+                tracing = calloc(1, sizeof(trace_workspace));
+                if(NULL == tracing) {
+                        return VM_NO_MEMORY;
+                }
+        }
+        if(NULL == tracing->records || tracing->mask + 1 != capacity) {
+                free(tracing->records);
+                tracing->records = calloc(capacity, sizeof(trace_record));
+                if(NULL == tracing->records) {
+                        return VM_NO_MEMORY;
+                }
+        }
+        tracing->mask = capacity - 1;
+        tracing->position = 0;
+        tracing->file = file;
+
+#ifdef HAVE_SIGNALS
+        {
+                struct sigaction action;
+
+                signal_trace = tracing;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = on_dump_signal;
+                action.sa_flags = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGUSR1, &action, NULL);
+        }
+#endif
+
+        status = run_protected(run_traced);
+
+#ifdef HAVE_SIGNALS
+        signal(SIGUSR1, SIG_DFL);
+        signal_trace = NULL;
+#endif
+
+        if(VM_RUNTIME_ERROR == status) {
+                if(save_trace(tracing)) {
+                        fprintf(stderr, "Trace written to %s\n", file);
+                }
+                else {
+                        fprintf(stderr, "Unable to write %s\n", file);
+                }
+        }
+
+        return status;
+}
+
+void release_trace(vm_context *vm)
+{
+        if(NULL != vm->trace) {
+                free(vm->trace->records);
+                free(vm->trace);
+                vm->trace = NULL;
+        }
+}
+
+int decode_trace(char const *file, int with_program)
+{
+        FILE *in = fopen(file, "rb");
+        trace_header header;
+        trace_record record;
+        unsigned long long index;
+        unsigned int i;
+
+        if(NULL == in) {
+                printf("Unable to read %s\n", file);
+                return 0;
+        }
+
+        if(1 != fread(&header, sizeof(header), 1, in) ||
+           0 != memcmp(header.magic, TRACE_MAGIC, 4) || TRACE_VERSION != header.version ||
+           sizeof(trace_record) != header.record_size || header.count > header.total) {
+                printf("%s is not a trace file\n", file);
+                fclose(in);
+                return 0;
+        }
+
+        printf("Trace: last %u of %llu instructions\n", header.count, header.total);
+        printf("%12s %7s  %-10s %11s %11s\n", "Index", "Address", "Command", "Argument", "Top");
+
+        index = header.total - header.count;
+        for(i = 0; i < header.count; ++i, ++index) {
+                opcode_info *info;
+                char argument[16] = "";
+                char top[16] = "empty";
+
+                if(1 != fread(&record, sizeof(record), 1, in)) {
+                        printf("Trace is truncated\n");
+                        fclose(in);
+                        return 0;
+                }
+
+                info = operation_info((operation) record.operation);
+                if(with_program && NULL != info && info->need_arg &&
+                   vm_program[record.address].operation == record.operation) {
+                        sprintf(argument, "%d", vm_program[record.address].arg);
+                }
+                if(!(record.flags & TRACE_EMPTY)) {
+                        sprintf(top, "%d", record.top);
+                }
+
+                if(NULL != info) {
+                        printf("%12llu %7u  %-10s %11s %11s\n", index, record.address,
+                               info->name, argument, top);
+                }
+                else {
+                        printf("%12llu %7u  (%u)%7s %11s %11s\n", index, record.address,
+                               record.operation, "", argument, top);
+                }
+        }
+
+        fclose(in);
+        return 1;
+}
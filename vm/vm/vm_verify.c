@@ -0,0 +1,429 @@
+#include "vm_internal.h"
+
+#define worklist        (vm_current->verify->worklist)
+
+static int is_jump(operation op)
+{
+        return JUMP == op || JUMP_YES == op || JUMP_NO == op;
+}
+
+int stack_effect(unsigned int address, int depth, runtime_error *error)
+{
+        command const *cmd = &vm_program[address];
+        unsigned int arg = cmd->arg;
+
+        switch(cmd->operation) {
+        case NOP:
+        case STOP:
+                return depth;
+
+        case LOAD:
+                if(arg >= vm_memory_size) {
+                        *error = BAD_DATA_ADDRESS;
+                        return -1;
+                }
+                /* Переход к проверке переполнения */
+                FALLTHROUGH;
+
+        case PUSH:
+        case INPUT:
+                if(depth >= MAX_STACK_SIZE) {
+                        *error = STACK_OVERFLOW;
+                        return -1;
+                }
+                return depth + 1;
+
+        case STORE:
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                if(arg >= vm_memory_size) {
+                        *error = BAD_DATA_ADDRESS;
+                        return -1;
+                }
+                return depth - 1;
+
+        case DUP:
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                if(depth >= MAX_STACK_SIZE) {
+                        *error = STACK_OVERFLOW;
+                        return -1;
+                }
+                return depth + 1;
+
+        case BLOAD:
+        case INVERT:
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth;
+
+        case POP:
+        case PRINT:
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth - 1;
+
+        case BSTORE:
+                if(depth < 2) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth - 2;
+
+        case ADD:
+        case SUB:
+        case MULT:
+        case DIV:
+                if(depth < 2) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth - 1;
+
+        case COMPARE:
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                if(arg > GE) {
+                        *error = BAD_RELATION;
+                        return -1;
+                }
+                if(depth < 2) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth - 1;
+
+        case JUMP:
+        case JUMP_YES:
+        case JUMP_NO:
+                if(arg >= MAX_PROGRAM_SIZE) {
+                        *error = BAD_CODE_ADDRESS;
+                        return -1;
+                }
+                if(JUMP == cmd->operation) {
+                        return depth;
+                }
+                if(depth < 1) {
+                        *error = STACK_EMPTY;
+                        return -1;
+                }
+                return depth - 1;
+
+        default:
+                *error = UNKNOWN_COMMAND;
+                return -1;
+        }
+}
+
+void verify_program(verify_result *result)
+{
+        unsigned int size = vm_program_size;
+        unsigned int count = 0;
+        unsigned int address;
+
+        result->status = VERIFY_OK;
+        result->address = 0;
+        result->error = UNKNOWN_COMMAND;
+        result->max_depth = 0;
+
+        if(NULL == vm_current->verify) {
+                vm_current->verify = vm_allocate(sizeof(verify_workspace));
+        }
+
+        for(address = 0; address < size; ++address) {
+                vm_stack_depth[address] = -1;
+        }
+
+        if(0 == size) {
+                return;
+        }
+
+        vm_stack_depth[0] = 0;
+        worklist[count++] = 0;
+
+        while(count > 0) {
+                unsigned int successors[2];
+                unsigned int successors_count = 0;
+                runtime_error error;
+                command const *cmd;
+                unsigned int i;
+                int depth;
+
+                address = worklist[--count];
+                cmd = &vm_program[address];
+
+                depth = stack_effect(address, vm_stack_depth[address], &error);
+                if(depth < 0) {
+                        if(VERIFY_OK == result->status || address < result->address) {
+                                result->status = VERIFY_ERROR;
+                                result->address = address;
+                                result->error = error;
+                        }
+                        continue;
+                }
+
+                if(STOP == cmd->operation) {
+                        continue;
+                }
+                if(depth > result->max_depth) {
+                        result->max_depth = depth;
+                }
+
+                if(JUMP != cmd->operation) {
+                        successors[successors_count++] = address + 1;
+                }
+                if(is_jump(cmd->operation)) {
+                        successors[successors_count++] = cmd->arg;
+                }
+
+                for(i = 0; i < successors_count; ++i) {
+                        unsigned int next = successors[i];
+
+                        if(next >= size) {
+                                /* Остановка за концом программы */
+                                continue;
+                        }
+                        if(vm_stack_depth[next] < 0) {
+                                vm_stack_depth[next] = depth;
+                                worklist[count++] = next;
+                        }
+                        else if(vm_stack_depth[next] != depth) {
+                                result->status = VERIFY_CONFLICT;
+                                result->address = next;
+                                return;
+                        }
+                }
+        }
+}
+
+int run_unchecked_budget(unsigned long budget)
+{
+        command const *program = vm_program;
+        unsigned int size = vm_program_size;
+        int *memory = vm_memory;
+        unsigned int memory_size = vm_memory_size;
+        int *stack = vm_stack;
+        unsigned int sp = vm_stack_pointer;
+        unsigned int cp = vm_command_pointer;
+        unsigned int address;
+        unsigned long executed = vm_current->instructions;
+        unsigned long limit = (budget < ULONG_MAX - executed) ? executed + budget : ULONG_MAX;
+        int data;
+
+        while(cp < size) {
+                int arg = program[cp].arg;
+
+                ++executed;
+                switch(program[cp].operation) {
+                case STOP:
+                        vm_current->instructions = executed;
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = cp;
+                        return 0;
+
+                case LOAD:
+                        address = arg;
+                        stack[sp++] = LOAD_WORD(memory, address);
+                        break;
+
+                case STORE:
+                        address = arg;
+                        --sp;
+                        STORE_WORD(memory, address, stack[sp]);
+                        break;
+
+                case BLOAD:
+                        address = arg + stack[sp - 1];
+                        if(address >= memory_size) {
+                                --sp;
+                                goto bad_address;
+                        }
+                        stack[sp - 1] = LOAD_WORD(memory, address);
+                        break;
+
+                case BSTORE:
+                        address = arg + stack[sp - 1];
+                        sp -= 2;
+                        if(address >= memory_size) {
+                                goto bad_address;
+                        }
+                        STORE_WORD(memory, address, stack[sp]);
+                        break;
+
+                case PUSH:
+                        stack[sp++] = arg;
+                        break;
+
+                case POP:
+                        --sp;
+                        break;
+
+                case DUP:
+                        stack[sp] = stack[sp - 1];
+                        ++sp;
+                        break;
+
+                case INVERT:
+                        stack[sp - 1] = -stack[sp - 1];
+                        break;
+
+                case ADD:
+                        --sp;
+                        stack[sp - 1] += stack[sp];
+                        break;
+
+                case SUB:
+                        --sp;
+                        stack[sp - 1] -= stack[sp];
+                        break;
+
+                case MULT:
+                        --sp;
+                        stack[sp - 1] *= stack[sp];
+                        break;
+
+                case DIV:
+                        data = stack[--sp];
+                        if(0 == data) {
+                                vm_current->instructions = executed;
+                                vm_stack_pointer = sp;
+                                vm_command_pointer = cp;
+                                vm_error(DIVISION_BY_ZERO);
+                                return 0;
+                        }
+                        if(DIVISION_OVERFLOWS(stack[sp - 1], data)) {
+                                vm_current->instructions = executed;
+                                vm_stack_pointer = sp;
+                                vm_command_pointer = cp;
+                                vm_error(DIVISION_OVERFLOW);
+                                return 0;
+                        }
+                        stack[sp - 1] /= data;
+                        break;
+
+                case COMPARE:
+                        data = stack[--sp];
+                        switch(arg) {
+                        case EQ:
+                                stack[sp - 1] = (stack[sp - 1] == data);
+                                break;
+
+                        case NE:
+                                stack[sp - 1] = (stack[sp - 1] != data);
+                                break;
+
+                        case LT:
+                                stack[sp - 1] = (stack[sp - 1] < data);
+                                break;
+
+                        case GT:
+                                stack[sp - 1] = (stack[sp - 1] > data);
+                                break;
+
+                        case LE:
+                                stack[sp - 1] = (stack[sp - 1] <= data);
+                                break;
+
+                        default:
+                                stack[sp - 1] = (stack[sp - 1] >= data);
+                        }
+                        break;
+
+                case JUMP:
+                        cp = arg;
+                        goto jumped;
+
+                case JUMP_YES:
+                        if(stack[--sp]) {
+                                cp = arg;
+                                goto jumped;
+                        }
+                        break;
+
+                case JUMP_NO:
+                        if(!stack[--sp]) {
+                                cp = arg;
+                                goto jumped;
+                        }
+                        break;
+
+                case INPUT:
+                        vm_current->instructions = executed;
+                        vm_command_pointer = cp;
+                        stack[sp++] = vm_read();
+                        break;
+
+                case PRINT:
+                        vm_write(stack[--sp]);
+                        break;
+
+                default:
+                        break;
+                }
+
+                ++cp;
+                continue;
+
+jumped:
+                /* Без переходов исполняется не больше size команд подряд */
+                if(executed >= limit) {
+                        vm_current->instructions = executed;
+                        vm_stack_pointer = sp;
+                        vm_command_pointer = cp;
+                        return 1;
+                }
+        }
+
+        /* Дальше в памяти команд только NOP */
+        vm_current->instructions = executed;
+        vm_stack_pointer = sp;
+        vm_command_pointer = MAX_PROGRAM_SIZE;
+        return 0;
+
+bad_address:
+        vm_current->instructions = executed;
+        vm_stack_pointer = sp;
+        vm_command_pointer = cp;
+        vm_error(BAD_DATA_ADDRESS);
+        return 0;
+}
+
+void run_unchecked()
+{
+        vm_command_pointer = 0;
+        vm_current->instructions = 0;
+        run_unchecked_budget(ULONG_MAX);
+}
+
+void run_verified()
+{
+        verify_result result;
+
+        verify_program(&result);
+
+        if(VERIFY_CONFLICT == result.status) {
+                fprintf(stderr, "Verification failed at %u: stack depth depends on the path, "
+                        "using checked engine\n", result.address);
+        }
+        else if(VERIFY_ERROR == result.status) {
+                fprintf(stderr, "Verification failed at %u: %s, using checked engine\n",
+                        result.address, vm_error_message(result.error));
+        }
+
+        if(VERIFY_OK != result.status) {
+                run();
+                return;
+        }
+
+        run_unchecked();
+}